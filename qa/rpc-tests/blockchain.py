@@ -52,12 +52,22 @@ class BlockchainTest(ZumyTestFramework):
         res = node.gettxoutsetinfo()
 
         assert_equal(res[u'total_amount'], Decimal('98214.28571450'))
-        assert_equal(res[u'transactions'], 200)
         assert_equal(res[u'height'], 200)
         assert_equal(res[u'txouts'], 200)
         assert_equal(res[u'bytes_serialized'], 14273),
         assert_equal(len(res[u'bestblock']), 64)
-        assert_equal(len(res[u'hash_serialized']), 64)
+        assert_equal(len(res[u'hash_set']), 64)
+        assert('transactions' not in res)
+
+        # A scan of the chainstate agrees with the kept commitment
+        scan = node.gettxoutsetinfo(True)
+        assert_equal(scan[u'transactions'], 200)
+        assert_equal(len(scan[u'hash_serialized']), 64)
+        for key in ['height', 'bestblock', 'txouts', 'bytes_serialized', 'hash_set', 'total_amount']:
+            assert_equal(scan[key], res[key])
+
+        # Both nodes are at the same block, so they have the same set
+        assert_equal(self.nodes[1].gettxoutsetinfo()[u'hash_set'], res[u'hash_set'])
 
     def _test_getblockheader(self):
         node = self.nodes[0]
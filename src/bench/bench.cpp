@@ -4,6 +4,8 @@
 
 #include "bench.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sys/time.h>
 
@@ -17,6 +19,18 @@ static double gettimedouble(void) {
     return tv.tv_usec * 0.000001 + tv.tv_sec;
 }
 
+// Calls slower than this are timed one by one. Only those benchmarks get
+// latency percentiles; faster ones are timed in windows of many calls, whose
+// averages say nothing about the spread of single calls.
+static const double MAX_BATCHED_CALL_TIME = 0.00001;
+
+// Nearest-rank percentile of the sorted per-call samples
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+    size_t nRank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::max(nRank, (size_t)1) - 1];
+}
+
 BenchRunner::BenchRunner(std::string name, BenchFunction func)
 {
     benchmarks.insert(std::make_pair(name, func));
@@ -25,7 +39,8 @@ BenchRunner::BenchRunner(std::string name, BenchFunction func)
 void
 BenchRunner::RunAll(double elapsedTimeForOne)
 {
-    std::cout << "Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << "\n";
+    std::cout << "Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << ","
+              << "per_sec" << "," << "p50" << "," << "p90" << "," << "p99" << "\n";
 
     for (std::map<std::string,BenchFunction>::iterator it = benchmarks.begin();
          it != benchmarks.end(); ++it) {
@@ -53,7 +68,8 @@ bool State::KeepRunning()
         double elapsedOne = (now - lastTime)/timeCheckCount;
         if (elapsedOne < minTime) minTime = elapsedOne;
         if (elapsedOne > maxTime) maxTime = elapsedOne;
-        if (elapsedOne*timeCheckCount < maxElapsed/16) timeCheckCount *= 2;
+        if (timeCheckCount == 1) samples.push_back(elapsedOne);
+        if (elapsedOne*timeCheckCount < maxElapsed/16 && elapsedOne < MAX_BATCHED_CALL_TIME) timeCheckCount *= 2;
     }
     lastTime = now;
     ++count;
@@ -64,7 +80,16 @@ bool State::KeepRunning()
 
     // Output results
     double average = (now-beginTime)/count;
-    std::cout << name << "," << count << "," << minTime << "," << maxTime << "," << average << "\n";
+    std::cout << name << "," << count << "," << minTime << "," << maxTime << "," << average << ","
+              << 1 / average << ",";
+    if (timeCheckCount == 1 && !samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        std::cout << Percentile(samples, 0.5) << "," << Percentile(samples, 0.9) << ","
+                  << Percentile(samples, 0.99);
+    } else {
+        std::cout << ",,";
+    }
+    std::cout << "\n";
 
     return false;
 }
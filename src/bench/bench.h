@@ -5,8 +5,10 @@
 #ifndef ZUMY_BENCH_BENCH_H
 #define ZUMY_BENCH_BENCH_H
 
+#include <limits>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/preprocessor/cat.hpp>
@@ -43,6 +45,9 @@ namespace benchmark {
         double lastTime, minTime, maxTime;
         int64_t count;
         int64_t timeCheckCount;
+        // Time of every call while calls are timed one by one, for the
+        // latency percentiles
+        std::vector<double> samples;
     public:
         State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0) {
             minTime = std::numeric_limits<double>::max();
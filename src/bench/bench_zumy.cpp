@@ -4,6 +4,7 @@
 
 #include "bench.h"
 
+#include "crypto/argon2d/argon2.h"
 #include "key.h"
 #include "main.h"
 #include "util.h"
@@ -12,6 +13,7 @@ int
 main(int argc, char** argv)
 {
     ECC_Start();
+    argon2_select_kernel();
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
@@ -0,0 +1,74 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+
+#include <boost/thread.hpp>
+
+// Proof-of-work check of a full headers message, as done by the "headers"
+// handler before it takes cs_main.
+static const unsigned int HEADERS_BATCH_SIZE = MAX_HEADERS_RESULTS;
+
+static std::vector<CBlockHeader> BuildHeadersBatch()
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    std::vector<CBlockHeader> headers;
+    headers.reserve(HEADERS_BATCH_SIZE);
+    uint256 hashPrev = consensusParams.hashGenesisBlock;
+    for (unsigned int i = 0; i < HEADERS_BATCH_SIZE; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = hashPrev;
+        header.nTime = Params().GenesisBlock().nTime + (i + 1) * consensusParams.nPowTargetSpacing;
+        header.nBits = UintToArith256(consensusParams.powLimit).GetCompact();
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, consensusParams))
+            header.nNonce++;
+        hashPrev = header.GetHash();
+
+        // Drop the memoized hash, every run has to hash the batch again
+        header.fHashCached = false;
+        headers.push_back(header);
+    }
+    return headers;
+}
+
+static void RunHeadersBatch(benchmark::State& state, int nThreads)
+{
+    const std::vector<CBlockHeader> headers = BuildHeadersBatch();
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    nScriptCheckThreads = nThreads > 1 ? nThreads : 0;
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(&ThreadCheckWorker);
+
+    while (state.KeepRunning()) {
+        std::vector<CBlockHeader> batch(headers);
+        assert(CheckHeadersProofOfWork(batch, consensusParams) == batch.size());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+}
+
+static void CheckHeadersBatchSerial(benchmark::State& state)
+{
+    RunHeadersBatch(state, 1);
+}
+
+static void CheckHeadersBatchParallel(benchmark::State& state)
+{
+    RunHeadersBatch(state, std::max(2, std::min(GetNumCores(), MAX_SCRIPTCHECK_THREADS)));
+}
+
+BENCHMARK(CheckHeadersBatchSerial);
+BENCHMARK(CheckHeadersBatchParallel);
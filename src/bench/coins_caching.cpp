@@ -0,0 +1,385 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "coins.h"
+#include "compressor.h"
+#include "dbwrapper.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/script.h"
+#include "serialize.h"
+
+#include <assert.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Spending one output of a many-output transaction, the shape of pool and
+// masternode payouts. With per-output cache entries a spend only touches the
+// coin it spends, however many siblings are still unspent.
+static const unsigned int PAYOUT_OUTPUTS = 64;
+
+static CTransaction BuildPayout(unsigned int nSeed)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(), nSeed);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(PAYOUT_OUTPUTS);
+    for (unsigned int i = 0; i < PAYOUT_OUTPUTS; i++) {
+        tx.vout[i].nValue = 1000 + i;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+// Spend a single output of a payout in a child cache and flush it down.
+static void CoinsCachePayoutSpend(benchmark::State& state)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache base(&viewDummy);
+    std::vector<CTransaction> vPayouts;
+    for (unsigned int i = 0; i < 100; i++) {
+        vPayouts.push_back(BuildPayout(i));
+        AddCoins(base, vPayouts.back(), 1);
+    }
+
+    unsigned int n = 0;
+    while (state.KeepRunning()) {
+        const CTransaction& tx = vPayouts[n % vPayouts.size()];
+        COutPoint outpoint(tx.GetHash(), (n / vPayouts.size()) % PAYOUT_OUTPUTS);
+        CCoinsViewCache cache(&base);
+        Coin undo;
+        cache.SpendCoin(outpoint, &undo);
+        cache.Flush();
+        // Put it back so the next round finds it unspent
+        base.AddCoin(outpoint, std::move(undo), true);
+        n++;
+    }
+}
+
+// Look up every output of a cached payout.
+static void CoinsCacheAccess(benchmark::State& state)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache cache(&viewDummy);
+    CTransaction tx = BuildPayout(0);
+    AddCoins(cache, tx, 1);
+
+    while (state.KeepRunning()) {
+        CAmount nTotal = 0;
+        for (unsigned int i = 0; i < PAYOUT_OUTPUTS; i++)
+            nTotal += cache.AccessCoin(COutPoint(tx.GetHash(), i)).out.nValue;
+        assert(nTotal > 0);
+    }
+}
+
+// Per-output and per-transaction layouts of the chainstate on disk: connect
+// blocks against a LevelDB holding a UTXO set shaped like a real one, reading
+// each spent coin from the database and writing the block's changes in one
+// batch, the way a cold cache fetches and flushes them. The per-transaction
+// layout is the record format the chainstate had before the per-output
+// upgrade; it is kept here only to compare against.
+static const unsigned int CHAINSTATE_TXS = 20000;
+static const int CHAINSTATE_HEIGHT = 100000;
+static const unsigned int BLOCK_SPENDS = 500;
+static const size_t CHAINSTATE_CACHE_SIZE = 8 << 20;
+
+// Unspent outputs per transaction: mostly a payment and its change, some
+// small batches, and a tail of pool and masternode payouts with dozens to
+// hundreds of outputs still unspent.
+static unsigned int RandOutputCount(FastRandomContext& rng)
+{
+    unsigned int r = rng.rand32() % 100;
+    if (r < 70)
+        return 1 + rng.rand32() % 2;
+    if (r < 90)
+        return 3 + rng.rand32() % 8;
+    if (r < 98)
+        return 11 + rng.rand32() % 40;
+    return 51 + rng.rand32() % 250;
+}
+
+static uint256 RandHash(FastRandomContext& rng)
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p += 4) {
+        uint32_t n = rng.rand32();
+        memcpy(p, &n, 4);
+    }
+    return hash;
+}
+
+static std::vector<CTxOut> RandOutputs(FastRandomContext& rng)
+{
+    std::vector<CTxOut> vout(RandOutputCount(rng));
+    for (unsigned int i = 0; i < vout.size(); i++) {
+        std::vector<unsigned char> vchHash(20);
+        for (unsigned int j = 0; j < vchHash.size(); j++)
+            vchHash[j] = rng.rand32() & 0xff;
+        vout[i].nValue = 1 + rng.rand32() % (100 * COIN / 1000) * 1000;
+        vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vchHash << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return vout;
+}
+
+/** A chainstate database in a temporary directory, removed with it */
+struct CBenchChainstate
+{
+    boost::filesystem::path path;
+    std::unique_ptr<CDBWrapper> pdb;
+
+    CBenchChainstate() : path(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()), pdb(new CDBWrapper(path, CHAINSTATE_CACHE_SIZE, false, false, true)) {}
+    ~CBenchChainstate()
+    {
+        pdb.reset();
+        boost::filesystem::remove_all(path);
+    }
+};
+
+/** Key of a per-output record, as CCoinsViewDB writes it */
+struct CBenchCoinKey
+{
+    COutPoint outpoint;
+
+    explicit CBenchCoinKey(const COutPoint& outpointIn) : outpoint(outpointIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        char chKey = 'C';
+        READWRITE(chKey);
+        READWRITE(outpoint.hash);
+        READWRITE(VARINT(outpoint.n));
+    }
+};
+
+/** The pre-upgrade per-transaction record: all outputs of a transaction, spent ones null */
+struct CBenchTxidCoins
+{
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CBenchTxidCoins() : fCoinBase(false), nHeight(0) {}
+
+    //! Drop the spent outputs at the end, as the old cache did before writing
+    void Cleanup()
+    {
+        while (!vout.empty() && vout.back().IsNull())
+            vout.pop_back();
+    }
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        // Availability of the first two outputs goes in the header code, of
+        // the others in a bitmask of which only the non-zero bytes count
+        unsigned int nMaskSize = 0, nMaskCode = 0;
+        for (unsigned int b = 0; 2 + b * 8 < vout.size(); b++) {
+            for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++) {
+                if (!vout[2 + b * 8 + i].IsNull()) {
+                    nMaskSize = b + 1;
+                    nMaskCode++;
+                    break;
+                }
+            }
+        }
+        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
+        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
+        assert(fFirst || fSecond || nMaskCode);
+        unsigned int nCode = 8 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fFirst ? 2 : 0) + (fSecond ? 4 : 0);
+        int nVersionDummy = 1;
+        ::Serialize(s, VARINT(nVersionDummy), nType, nVersion);
+        ::Serialize(s, VARINT(nCode), nType, nVersion);
+        for (unsigned int b = 0; b < nMaskSize; b++) {
+            unsigned char chAvail = 0;
+            for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++)
+                if (!vout[2 + b * 8 + i].IsNull())
+                    chAvail |= (1 << i);
+            ::Serialize(s, chAvail, nType, nVersion);
+        }
+        for (unsigned int i = 0; i < vout.size(); i++) {
+            if (!vout[i].IsNull())
+                ::Serialize(s, CTxOutCompressor(REF(vout[i])), nType, nVersion);
+        }
+        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++)
+                vAvail.push_back((chAvail & (1 << p)) != 0);
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+/** One record per output: a spend reads and erases just that output */
+struct CPerOutpointLayout
+{
+    static const char KEY = 'C';
+
+    void Add(CDBBatch& batch, const uint256& txid, const std::vector<CTxOut>& vout, int nHeight)
+    {
+        for (unsigned int i = 0; i < vout.size(); i++)
+            batch.Write(CBenchCoinKey(COutPoint(txid, i)), Coin(vout[i], nHeight, false));
+    }
+
+    void Spend(CDBWrapper& db, CDBBatch& batch, const COutPoint& outpoint)
+    {
+        Coin coin;
+        bool fFound = db.Read(CBenchCoinKey(outpoint), coin);
+        assert(fFound && !coin.IsSpent());
+        batch.Erase(CBenchCoinKey(outpoint));
+    }
+
+    void Flush(CDBBatch& batch) {}
+};
+
+const char CPerOutpointLayout::KEY;
+
+/**
+ * One record per transaction: a spend reads the whole record, and the flush
+ * writes it back whole unless its last output was spent.
+ */
+struct CPerTxidLayout
+{
+    static const char KEY = 'c';
+
+    std::map<uint256, CBenchTxidCoins> mapModified;
+
+    void Add(CDBBatch& batch, const uint256& txid, const std::vector<CTxOut>& vout, int nHeight)
+    {
+        CBenchTxidCoins coins;
+        coins.vout = vout;
+        coins.nHeight = nHeight;
+        batch.Write(std::make_pair(KEY, txid), coins);
+    }
+
+    void Spend(CDBWrapper& db, CDBBatch& batch, const COutPoint& outpoint)
+    {
+        std::map<uint256, CBenchTxidCoins>::iterator it = mapModified.find(outpoint.hash);
+        if (it == mapModified.end()) {
+            it = mapModified.insert(std::make_pair(outpoint.hash, CBenchTxidCoins())).first;
+            bool fFound = db.Read(std::make_pair(KEY, outpoint.hash), it->second);
+            assert(fFound);
+        }
+        assert(outpoint.n < it->second.vout.size() && !it->second.vout[outpoint.n].IsNull());
+        it->second.vout[outpoint.n].SetNull();
+    }
+
+    void Flush(CDBBatch& batch)
+    {
+        for (std::map<uint256, CBenchTxidCoins>::iterator it = mapModified.begin(); it != mapModified.end(); ++it) {
+            it->second.Cleanup();
+            if (it->second.vout.empty())
+                batch.Erase(std::make_pair(KEY, it->first));
+            else
+                batch.Write(std::make_pair(KEY, it->first), it->second);
+        }
+        mapModified.clear();
+    }
+};
+
+const char CPerTxidLayout::KEY;
+
+// Each round connects one block: BLOCK_SPENDS random unspent outputs are
+// read and spent, about as many new ones are created, and the changes are
+// written in a single batch.
+template <typename Layout>
+static void ChainstateConnect(benchmark::State& state, const char* strName)
+{
+    FastRandomContext rng(true);
+    CBenchChainstate chainstate;
+    CDBWrapper& db = *chainstate.pdb;
+    Layout layout;
+    std::vector<COutPoint> vUnspent;
+
+    CDBBatch batch(&db.GetObfuscateKey());
+    for (unsigned int i = 0; i < CHAINSTATE_TXS; i++) {
+        uint256 txid = RandHash(rng);
+        std::vector<CTxOut> vout = RandOutputs(rng);
+        layout.Add(batch, txid, vout, 1 + rng.rand32() % CHAINSTATE_HEIGHT);
+        for (unsigned int j = 0; j < vout.size(); j++)
+            vUnspent.push_back(COutPoint(txid, j));
+        if (i % 1000 == 999) {
+            db.WriteBatch(batch);
+            batch = CDBBatch(&db.GetObfuscateKey());
+        }
+    }
+    db.WriteBatch(batch);
+    const std::pair<char, uint256> keyBegin(Layout::KEY, uint256()), keyEnd(Layout::KEY + 1, uint256());
+    // Read from tables, not the write buffer
+    db.CompactRange(keyBegin, keyEnd);
+
+    int nHeight = CHAINSTATE_HEIGHT;
+    while (state.KeepRunning()) {
+        CDBBatch batchBlock(&db.GetObfuscateKey());
+        for (unsigned int i = 0; i < BLOCK_SPENDS; i++) {
+            size_t nPos = rng.rand32() % vUnspent.size();
+            layout.Spend(db, batchBlock, vUnspent[nPos]);
+            vUnspent[nPos] = vUnspent.back();
+            vUnspent.pop_back();
+        }
+        layout.Flush(batchBlock);
+        nHeight++;
+        for (unsigned int nCreated = 0; nCreated < BLOCK_SPENDS; ) {
+            uint256 txid = RandHash(rng);
+            std::vector<CTxOut> vout = RandOutputs(rng);
+            layout.Add(batchBlock, txid, vout, nHeight);
+            for (unsigned int j = 0; j < vout.size(); j++)
+                vUnspent.push_back(COutPoint(txid, j));
+            nCreated += vout.size();
+        }
+        db.WriteBatch(batchBlock);
+    }
+
+    db.CompactRange(keyBegin, keyEnd);
+    std::cout << "# " << strName << ": " << db.EstimateSize(keyBegin, keyEnd) << " bytes of tables for "
+              << vUnspent.size() << " unspent outputs\n";
+}
+
+static void CoinsDBConnectPerOutpoint(benchmark::State& state) { ChainstateConnect<CPerOutpointLayout>(state, "per-outpoint records"); }
+static void CoinsDBConnectPerTxid(benchmark::State& state) { ChainstateConnect<CPerTxidLayout>(state, "per-txid records"); }
+
+BENCHMARK(CoinsCachePayoutSpend);
+BENCHMARK(CoinsCacheAccess);
+BENCHMARK(CoinsDBConnectPerOutpoint);
+BENCHMARK(CoinsDBConnectPerTxid);
@@ -0,0 +1,153 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/blake2/blake2.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <assert.h>
+#include <vector>
+
+// Header hashing primitives, from the Argon2d proof of work down to the
+// SHA256d and blake2b building blocks. The Argon2d inputs are real header
+// serializations (mainnet genesis) with the nonce bumped every call.
+
+static CBlockHeader BenchHeader()
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashMerkleRoot = uint256S("0x14e595d32df8b7327c3a00a2ffaffc9468a13699f57ae98b31109439a7b05255");
+    header.nTime = 1543504836;
+    header.nBits = 0x1f00ffff;
+    header.nNonce = 103043;
+    return header;
+}
+
+static void Argon2dPhase1(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    while (state.KeepRunning()) {
+        hash_Argon2d(BEGIN(header.nVersion), 1);
+        header.nNonce++;
+    }
+}
+
+// The phase 2 parameters (64 lanes, 250 KiB) are rejected by argon2_ctx, as
+// 64 lanes need at least 512 KiB. This hashes with the phase 2 lanes, threads
+// and iterations and that smallest accepted memory, so memory is really
+// filled; Argon2dPhase2Rejected times the call as consensus makes it.
+static void Argon2dPhase2(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    uint256 hash;
+    argon2_context context;
+    context.out = hash.begin();
+    context.outlen = (uint32_t)OUTPUT_BYTES;
+    context.pwd = (uint8_t *)BEGIN(header.nVersion);
+    context.pwdlen = (uint32_t)INPUT_BYTES;
+    context.salt = (uint8_t *)BEGIN(header.nVersion);
+    context.saltlen = (uint32_t)INPUT_BYTES;
+    context.secret = NULL;
+    context.secretlen = 0;
+    context.ad = NULL;
+    context.adlen = 0;
+    context.allocate_cbk = Argon2dThreadArenaAllocate;
+    context.free_cbk = Argon2dThreadArenaFree;
+    context.flags = DEFAULT_ARGON2_FLAG;
+    context.lanes = 64;
+    context.m_cost = 8 * context.lanes;
+    context.threads = 2;
+    context.t_cost = 1;
+    while (state.KeepRunning()) {
+        int ret = argon2_ctx(&context, Argon2_d);
+        assert(ret == ARGON2_OK);
+        header.nNonce++;
+    }
+}
+
+static void Argon2dPhase2Rejected(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    while (state.KeepRunning()) {
+        hash_Argon2d(BEGIN(header.nVersion), 2);
+        header.nNonce++;
+    }
+}
+
+#ifdef __AVX2__
+static void Argon2dGetHashWithCtx(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    void *Matrix;
+    WolfArgon2dAllocateCtx(&Matrix);
+    while (state.KeepRunning()) {
+        header.GetHashWithCtx(Matrix);
+        header.nNonce++;
+    }
+    WolfArgon2dFreeCtx(Matrix);
+}
+#endif
+
+// One call hashes ARGON2_BATCH_MAX consecutive nonces, compare per_sec
+// against Argon2dPhase1 times the batch size.
+static void Argon2dBatch(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    std::vector<unsigned char> vchHeaders(ARGON2_BATCH_MAX * CBlockHeader::HEADER_SIZE);
+    uint256 vHashes[ARGON2_BATCH_MAX];
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < ARGON2_BATCH_MAX; i++) {
+            header.nNonce++;
+            memcpy(&vchHeaders[i * CBlockHeader::HEADER_SIZE], BEGIN(header.nVersion), CBlockHeader::HEADER_SIZE);
+        }
+        hash_Argon2d_batch(&vchHeaders[0], ARGON2_BATCH_MAX, vHashes);
+    }
+}
+
+static void SHA256dHeader(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    uint256 hash;
+    while (state.KeepRunning()) {
+        CHash256().Write(UBEGIN(header.nVersion), CBlockHeader::HEADER_SIZE).Finalize(hash.begin());
+        header.nNonce++;
+    }
+}
+
+static void CHashWriterHeader(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    while (state.KeepRunning()) {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << header;
+        ss.GetHash();
+        header.nNonce++;
+    }
+}
+
+static void Blake2bHeader(benchmark::State& state)
+{
+    CBlockHeader header = BenchHeader();
+    uint256 hash;
+    while (state.KeepRunning()) {
+        blake2b(hash.begin(), hash.size(), BEGIN(header.nVersion), CBlockHeader::HEADER_SIZE, NULL, 0);
+        header.nNonce++;
+    }
+}
+
+BENCHMARK(Argon2dPhase1);
+BENCHMARK(Argon2dPhase2);
+BENCHMARK(Argon2dPhase2Rejected);
+#ifdef __AVX2__
+BENCHMARK(Argon2dGetHashWithCtx);
+#endif
+BENCHMARK(Argon2dBatch);
+BENCHMARK(SHA256dHeader);
+BENCHMARK(CHashWriterHeader);
+BENCHMARK(Blake2bHeader);
@@ -0,0 +1,137 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "dbwrapper.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <iostream>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Address index shaped data: per address a run of entries keyed by height
+// and txid, read by seeking to the address and iterating over its entries.
+// Compare the default and index profiles on point reads and range scans of
+// a database on disk, and on the time to write and compact it along with
+// the size of its tables.
+static const unsigned int DB_ADDRESSES = 500;
+static const unsigned int DB_ENTRIES_PER_ADDRESS = 100;
+static const size_t DB_CACHE_SIZE = 2 << 20;
+
+typedef std::pair<char, std::pair<uint160, std::pair<int, uint256> > > BenchKey;
+
+static uint160 BenchAddress(unsigned int n)
+{
+    uint160 address;
+    memcpy(address.begin(), &n, sizeof(n));
+    return address;
+}
+
+/** A temporary directory, removed with it */
+struct CBenchDir
+{
+    boost::filesystem::path path;
+
+    CBenchDir() : path(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()) {}
+    ~CBenchDir() { boost::filesystem::remove_all(path); }
+};
+
+/** A database on disk, closed before its directory is removed */
+struct CBenchDB
+{
+    CBenchDir dir;
+    CDBWrapper db;
+
+    explicit CBenchDB(DBProfile profile) : db(dir.path, DB_CACHE_SIZE, false, false, false, profile) {}
+};
+
+static const BenchKey BENCH_KEY_BEGIN('a', std::make_pair(uint160(), std::make_pair(0, uint256())));
+static const BenchKey BENCH_KEY_END('b', std::make_pair(uint160(), std::make_pair(0, uint256())));
+
+static CBenchDB* FillDB(DBProfile profile, std::vector<BenchKey>& vKeys)
+{
+    CBenchDB* pdb = new CBenchDB(profile);
+    CDBBatch batch(&pdb->db.GetObfuscateKey());
+    for (unsigned int i = 0; i < DB_ADDRESSES; i++) {
+        for (unsigned int j = 0; j < DB_ENTRIES_PER_ADDRESS; j++) {
+            BenchKey key('a', std::make_pair(BenchAddress(i), std::make_pair((int)j, GetRandHash())));
+            batch.Write(key, (CAmount)(i * j + 1));
+            vKeys.push_back(key);
+        }
+        if (i % 50 == 49) {
+            pdb->db.WriteBatch(batch);
+            batch = CDBBatch(&pdb->db.GetObfuscateKey());
+        }
+    }
+    pdb->db.WriteBatch(batch);
+    // Read from tables, not the write buffer
+    pdb->db.CompactRange(BENCH_KEY_BEGIN, BENCH_KEY_END);
+    return pdb;
+}
+
+static void Fill(benchmark::State& state, DBProfile profile)
+{
+    size_t nSize = 0;
+    bool fCompressed = false;
+    while (state.KeepRunning()) {
+        std::vector<BenchKey> vKeys;
+        std::unique_ptr<CBenchDB> pdb(FillDB(profile, vKeys));
+        nSize = pdb->db.EstimateSize(BENCH_KEY_BEGIN, BENCH_KEY_END);
+        fCompressed = pdb->db.IsCompressed();
+    }
+    std::cout << "# " << GetDBProfileName(profile) << " profile" << (fCompressed ? ", Snappy" : "")
+              << ": " << nSize << " bytes of tables for " << DB_ADDRESSES * DB_ENTRIES_PER_ADDRESS << " entries\n";
+}
+
+static void PointRead(benchmark::State& state, DBProfile profile)
+{
+    std::vector<BenchKey> vKeys;
+    std::unique_ptr<CBenchDB> pdb(FillDB(profile, vKeys));
+    unsigned int n = 0;
+    while (state.KeepRunning()) {
+        CAmount nValue;
+        bool fFound = pdb->db.Read(vKeys[(n * 7919) % vKeys.size()], nValue);
+        assert(fFound);
+        n++;
+    }
+}
+
+static void RangeScan(benchmark::State& state, DBProfile profile)
+{
+    std::vector<BenchKey> vKeys;
+    std::unique_ptr<CBenchDB> pdb(FillDB(profile, vKeys));
+    unsigned int n = 0;
+    while (state.KeepRunning()) {
+        uint160 address = BenchAddress((n * 31) % DB_ADDRESSES);
+        std::unique_ptr<CDBIterator> pcursor(pdb->db.NewIterator());
+        pcursor->Seek(BenchKey('a', std::make_pair(address, std::make_pair(0, uint256()))));
+        unsigned int nEntries = 0;
+        BenchKey key;
+        for (; pcursor->Valid() && pcursor->GetKey(key) && key.second.first == address; pcursor->Next())
+            nEntries++;
+        assert(nEntries == DB_ENTRIES_PER_ADDRESS);
+        n++;
+    }
+}
+
+static void DBWrapperFillDefault(benchmark::State& state) { Fill(state, DBPROFILE_DEFAULT); }
+static void DBWrapperFillIndex(benchmark::State& state) { Fill(state, DBPROFILE_INDEX); }
+static void DBWrapperPointReadDefault(benchmark::State& state) { PointRead(state, DBPROFILE_DEFAULT); }
+static void DBWrapperPointReadIndex(benchmark::State& state) { PointRead(state, DBPROFILE_INDEX); }
+static void DBWrapperRangeScanDefault(benchmark::State& state) { RangeScan(state, DBPROFILE_DEFAULT); }
+static void DBWrapperRangeScanIndex(benchmark::State& state) { RangeScan(state, DBPROFILE_INDEX); }
+
+BENCHMARK(DBWrapperFillDefault);
+BENCHMARK(DBWrapperFillIndex);
+BENCHMARK(DBWrapperPointReadDefault);
+BENCHMARK(DBWrapperPointReadIndex);
+BENCHMARK(DBWrapperRangeScanDefault);
+BENCHMARK(DBWrapperRangeScanIndex);
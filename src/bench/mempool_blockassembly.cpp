@@ -0,0 +1,70 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "miner.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "txmempool.h"
+
+#include <assert.h>
+#include <vector>
+
+// A mempool of 300 MB in chains of five transactions where the children pay
+// more than their parents. Selecting a block from it walks the ancestor
+// feerate index and updates the packages of the descendants of everything
+// that goes in.
+static const size_t MEMPOOL_USAGE = 300 << 20;
+static const unsigned int CHAIN_LENGTH = 5;
+
+static CTransaction BuildTx(const COutPoint& prevout, unsigned int nSeed)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, nSeed) << std::vector<unsigned char>(33, nSeed);
+    tx.vout.resize(2);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = 1000 + nSeed;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, nSeed + i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+static void FillMempool()
+{
+    LOCK(mempool.cs);
+    mempool.clear();
+    for (unsigned int nChain = 0; mempool.ZumyMemoryUsage() < MEMPOOL_USAGE; nChain++) {
+        COutPoint prevout(uint256(), nChain);
+        for (unsigned int n = 0; n < CHAIN_LENGTH; n++) {
+            CTransaction tx = BuildTx(prevout, nChain * CHAIN_LENGTH + n);
+            // Feerates from 1 to 100 satoshi per byte, rising along the chain
+            CAmount nFee = (1 + (nChain * 7919) % 80 + n * 5) * ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            CTxMemPoolEntry entry(tx, nFee, 0, 0, 1, n == 0, n == 0 ? tx.GetValueOut() : 0, false, 1, LockPoints());
+            mempool.addUnchecked(tx.GetHash(), entry, false);
+            prevout = COutPoint(tx.GetHash(), 0);
+        }
+    }
+}
+
+// Select the transactions of a block template from the full mempool.
+static void MempoolBlockAssembly(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    FillMempool();
+    BlockAssembler assembler(Params());
+    while (state.KeepRunning()) {
+        LOCK2(cs_main, mempool.cs);
+        std::unique_ptr<CBlockTemplate> pblocktemplate = assembler.SelectTransactions(2, 0);
+        assert(pblocktemplate->block.vtx.size() > 1);
+    }
+    LOCK(mempool.cs);
+    mempool.clear();
+}
+
+BENCHMARK(MempoolBlockAssembly);
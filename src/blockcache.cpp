@@ -0,0 +1,87 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "core_memusage.h"
+
+size_t CBlockCache::BlockUsage(const CBlock& block)
+{
+    // The list node and map entry come on top of the block itself
+    return sizeof(CBlock) + RecursiveZumyUsage(block) + 128;
+}
+
+void CBlockCache::EvictLocked()
+{
+    while (nUsage > nMaxUsage && !listBlocks.empty()) {
+        nUsage -= BlockUsage(*listBlocks.back().second);
+        mapBlocks.erase(listBlocks.back().first);
+        listBlocks.pop_back();
+    }
+}
+
+void CBlockCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    EvictLocked();
+}
+
+bool CBlockCache::IsEnabled() const
+{
+    LOCK(cs);
+    return nMaxUsage > 0;
+}
+
+CBlockRef CBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::unordered_map<uint256, BlockList::iterator, HashHasher>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end()) {
+        nMisses++;
+        return CBlockRef();
+    }
+    nHits++;
+    listBlocks.splice(listBlocks.begin(), listBlocks, it->second);
+    return it->second->second;
+}
+
+void CBlockCache::Insert(const CBlockRef& pblock)
+{
+    size_t nBlockUsage = BlockUsage(*pblock);
+    LOCK(cs);
+    // A block that would push out everything else is not worth it
+    if (nBlockUsage > nMaxUsage / 2)
+        return;
+    const uint256& hash = pblock->GetHash();
+    std::unordered_map<uint256, BlockList::iterator, HashHasher>::iterator it = mapBlocks.find(hash);
+    if (it != mapBlocks.end()) {
+        listBlocks.splice(listBlocks.begin(), listBlocks, it->second);
+        return;
+    }
+    listBlocks.push_front(std::make_pair(hash, pblock));
+    mapBlocks[hash] = listBlocks.begin();
+    nUsage += nBlockUsage;
+    EvictLocked();
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs);
+    listBlocks.clear();
+    mapBlocks.clear();
+    nUsage = 0;
+}
+
+CBlockCache::Stats CBlockCache::GetStats() const
+{
+    LOCK(cs);
+    Stats stats;
+    stats.nBlocks = listBlocks.size();
+    stats.nUsage = nUsage;
+    stats.nMaxUsage = nMaxUsage;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    return stats;
+}
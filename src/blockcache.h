@@ -0,0 +1,72 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZUMY_BLOCKCACHE_H
+#define ZUMY_BLOCKCACHE_H
+
+#include "primitives/block.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+typedef std::shared_ptr<const CBlock> CBlockRef;
+
+/**
+ * Recently used blocks, deserialized, shared by everyone who reads blocks:
+ * RPC, REST, ZMQ and peers. Blocks are immutable once in here, so they are
+ * handed out as shared pointers that stay valid after eviction. The least
+ * recently used blocks are dropped once their memory usage passes
+ * nMaxUsage.
+ */
+class CBlockCache
+{
+private:
+    struct HashHasher
+    {
+        size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+    };
+    typedef std::list<std::pair<uint256, CBlockRef> > BlockList;
+
+    mutable CCriticalSection cs;
+    size_t nMaxUsage;
+    size_t nUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+    //! Most recently used first
+    BlockList listBlocks;
+    std::unordered_map<uint256, BlockList::iterator, HashHasher> mapBlocks;
+
+    static size_t BlockUsage(const CBlock& block);
+    void EvictLocked();
+
+public:
+    CBlockCache(size_t nMaxUsageIn = 0) : nMaxUsage(nMaxUsageIn), nUsage(0), nHits(0), nMisses(0) {}
+
+    //! 0 empties the cache and turns it off
+    void SetMaxUsage(size_t nMaxUsageIn);
+    bool IsEnabled() const;
+
+    //! The block with hash, NULL if it is not cached. Counts a hit or a miss.
+    CBlockRef Get(const uint256& hash);
+    //! Cache a block. Its hash has to be memoized already, it is read from several threads.
+    void Insert(const CBlockRef& pblock);
+    void Clear();
+
+    struct Stats
+    {
+        size_t nBlocks;
+        size_t nUsage;
+        size_t nMaxUsage;
+        uint64_t nHits;
+        uint64_t nMisses;
+    };
+    Stats GetStats() const;
+};
+
+#endif // ZUMY_BLOCKCACHE_H
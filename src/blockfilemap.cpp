@@ -0,0 +1,85 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "util.h"
+
+#include <boost/interprocess/exceptions.hpp>
+
+CMappedBlockFile::CMappedBlockFile(const boost::filesystem::path& path) :
+    mapping(path.string().c_str(), boost::interprocess::read_only),
+    region(mapping, boost::interprocess::read_only)
+{
+}
+
+void CBlockFileMapCache::EraseLocked(const FileKey& key)
+{
+    std::map<FileKey, FileList::iterator>::iterator it = mapFiles.find(key);
+    if (it == mapFiles.end())
+        return;
+    listFiles.erase(it->second);
+    mapFiles.erase(it);
+}
+
+void CBlockFileMapCache::SetMaxFiles(size_t nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (listFiles.size() > nMaxFiles)
+        EraseLocked(listFiles.back().first);
+}
+
+CMappedBlockFileRef CBlockFileMapCache::Get(const std::string& strPrefix, int nFile, const boost::filesystem::path& path, uint64_t nPos)
+{
+    LOCK(cs);
+    if (nMaxFiles == 0)
+        return CMappedBlockFileRef();
+
+    FileKey key(strPrefix, nFile);
+    std::map<FileKey, FileList::iterator>::iterator it = mapFiles.find(key);
+    if (it != mapFiles.end()) {
+        if (nPos < it->second->second->size()) {
+            listFiles.splice(listFiles.begin(), listFiles, it->second);
+            return it->second->second;
+        }
+        EraseLocked(key);
+    }
+
+    CMappedBlockFileRef mapped;
+    try {
+        mapped.reset(new CMappedBlockFile(path));
+    } catch (const boost::interprocess::interprocess_exception& e) {
+        LogPrint("db", "%s: cannot map %s: %s\n", __func__, path.string(), e.what());
+        return CMappedBlockFileRef();
+    }
+    if (nPos >= mapped->size())
+        return CMappedBlockFileRef();
+
+    listFiles.push_front(std::make_pair(key, mapped));
+    mapFiles[key] = listFiles.begin();
+    while (listFiles.size() > nMaxFiles)
+        EraseLocked(listFiles.back().first);
+    return mapped;
+}
+
+void CBlockFileMapCache::Erase(int nFile)
+{
+    LOCK(cs);
+    EraseLocked(FileKey("blk", nFile));
+    EraseLocked(FileKey("rev", nFile));
+}
+
+void CBlockFileMapCache::Clear()
+{
+    LOCK(cs);
+    listFiles.clear();
+    mapFiles.clear();
+}
+
+size_t CBlockFileMapCache::size() const
+{
+    LOCK(cs);
+    return listFiles.size();
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZUMY_BLOCKFILEMAP_H
+#define ZUMY_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/** A whole block or undo file, mapped read-only */
+class CMappedBlockFile
+{
+private:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+
+public:
+    //! Throws boost::interprocess::interprocess_exception if the file cannot be mapped
+    explicit CMappedBlockFile(const boost::filesystem::path& path);
+
+    const char* begin() const { return (const char*)region.get_address(); }
+    const char* end() const { return begin() + size(); }
+    size_t size() const { return region.get_size(); }
+};
+
+typedef std::shared_ptr<const CMappedBlockFile> CMappedBlockFileRef;
+
+/**
+ * Read-only mappings of block and undo files, by prefix ("blk" or "rev") and
+ * file number. At most nMaxFiles are kept, the least recently used one is
+ * unmapped first. A mapping handed out stays valid for as long as it is
+ * held, also when it has been dropped here in the meantime.
+ */
+class CBlockFileMapCache
+{
+private:
+    typedef std::pair<std::string, int> FileKey;
+    typedef std::list<std::pair<FileKey, CMappedBlockFileRef> > FileList;
+
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Most recently used first
+    FileList listFiles;
+    std::map<FileKey, FileList::iterator> mapFiles;
+
+    void EraseLocked(const FileKey& key);
+
+public:
+    CBlockFileMapCache(size_t nMaxFilesIn = 0) : nMaxFiles(nMaxFilesIn) {}
+
+    //! 0 unmaps everything and turns mapping off
+    void SetMaxFiles(size_t nMaxFilesIn);
+
+    /**
+     * The mapping of the file at path, mapped again if the one kept ends at
+     * or before nPos because the file grew. NULL when mapping is off or the
+     * file cannot be mapped.
+     */
+    CMappedBlockFileRef Get(const std::string& strPrefix, int nFile, const boost::filesystem::path& path, uint64_t nPos);
+
+    //! Drop the mappings of the block and undo files nFile, before they are truncated or removed
+    void Erase(int nFile);
+    void Clear();
+    size_t size() const;
+};
+
+#endif // ZUMY_BLOCKFILEMAP_H
@@ -214,6 +214,9 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        // The index is keyed by the header's hash, no need to rehash it
+        if (phashBlock)
+            block.SetCachedHash(*phashBlock);
         return block;
     }
 
@@ -224,6 +224,10 @@ public:
             2000        // * estimated number of transactions per day after checkpoint
         };
 
+        // Snapshot blocks must be buried deep enough never to be reorganized
+        // away, like checkpoints. None published yet.
+        mapUTXOSnapshots.clear();
+
 	consensus.nZumyBeginsBlock =  1800;
 	consensus.nDevPhaseTotalBlocks = 250000; // extended from 65,000 to 250,000
 	consensus.nIntPhaseTotalBlocks = 125000;
@@ -339,6 +343,9 @@ public:
             1000        // * estimated number of transactions per day after checkpoint
         };
 
+        // None published yet
+        mapUTXOSnapshots.clear();
+
 	consensus.nIntPhaseTotalBlocks = 5000;
   consensus.nPhase1LastBlock = 30000;
 	consensus.nPhase2LastBlock = 60000;
@@ -26,6 +26,8 @@ struct SeedSpec6 {
 };
 
 typedef std::map<int, uint256> MapCheckpoints;
+//! Block hash to the hash_set of the UTXO set after it
+typedef std::map<uint256, uint256> MapUTXOSnapshots;
 
 struct CCheckpointData {
     MapCheckpoints mapCheckpoints;
@@ -79,6 +81,8 @@ public:
     int ExtCoinType() const { return nExtCoinType; }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
+    /** UTXO sets loadtxoutset accepts without being given their block and hash. None on any network yet. */
+    const MapUTXOSnapshots& UTXOSnapshots() const { return mapUTXOSnapshots; }
     int PoolMaxTransactions() const { return nPoolMaxTransactions; }
     int FulfilledRequestExpireTime() const { return nFulfilledRequestExpireTime; }
     std::string SporkPubKey() const { return strSporkPubKey; }
@@ -106,6 +110,7 @@ protected:
     bool fTestnetToBeDeprecatedFieldRPC;
     bool startNewChain;
     CCheckpointData checkpointData;
+    MapUTXOSnapshots mapUTXOSnapshots;
     int nPoolMaxTransactions;
     int nFulfilledRequestExpireTime;
     std::string strSporkPubKey;
@@ -9,6 +9,7 @@
 #define ZUMY_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -19,6 +20,81 @@
 template <typename T>
 class CCheckQueueControl;
 
+/** A check queue that can be helped by a shared pool of worker threads. */
+class CCheckQueueBase
+{
+public:
+    //! Process queued checks until there are none left, then return
+    virtual void Help() = 0;
+
+protected:
+    ~CCheckQueueBase() {}
+};
+
+/**
+ * Worker threads shared by several check queues, so that queues which are
+ * only busy now and then do not each need a pool of their own. A worker
+ * waits until any of the queues has checks added, helps that queue until it
+ * is drained, and goes back to waiting. The master of each queue still joins
+ * in on Wait(), so a queue makes progress while the pool is busy elsewhere.
+ */
+class CCheckQueueWorkers
+{
+private:
+    boost::mutex mutex;
+
+    //! Workers block on this while no queue has work for them
+    boost::condition_variable cond;
+
+    //! Queues that had checks added, once per worker wanted
+    std::deque<CCheckQueueBase*> pending;
+
+    //! The number of worker threads running.
+    unsigned int nWorkers;
+
+public:
+    CCheckQueueWorkers() : nWorkers(0) {}
+
+    //! Worker thread
+    void Thread()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers++;
+        }
+        try {
+            do {
+                CCheckQueueBase* pqueue;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (pending.empty())
+                        cond.wait(lock);
+                    pqueue = pending.front();
+                    pending.pop_front();
+                }
+                pqueue->Help();
+            } while (true);
+        } catch (...) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers--;
+            throw;
+        }
+    }
+
+    //! Wake up to nChecks workers to help pqueue
+    void Notify(CCheckQueueBase* pqueue, unsigned int nChecks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        unsigned int nWanted = std::min(nChecks, nWorkers);
+        for (unsigned int i = 0; i < nWanted; i++)
+            pending.push_back(pqueue);
+        if (nWanted == 1)
+            cond.notify_one();
+        else if (nWanted > 1)
+            cond.notify_all();
+    }
+};
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -30,7 +106,7 @@ class CCheckQueueControl;
   * as an N'th worker, until all jobs are done.
   */
 template <typename T>
-class CCheckQueue
+class CCheckQueue : public CCheckQueueBase
 {
 private:
     //! Mutex to protect the inner state
@@ -68,8 +144,15 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    //! Shared workers woken up when checks are added, if any
+    CCheckQueueWorkers* pworkers;
+
+    /**
+     * Internal function that does bulk of the verification work. A helper
+     * from the shared workers leaves as soon as the queue is empty instead
+     * of waiting for more.
+     */
+    bool Loop(bool fMaster = false, bool fHelper = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
@@ -92,6 +175,10 @@ private:
                 }
                 // logically, the do loop starts here
                 while (queue.empty()) {
+                    if (fHelper) {
+                        nTotal--;
+                        return fAllOk;
+                    }
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
@@ -130,8 +217,8 @@ private:
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, optionally helped by shared workers
+    CCheckQueue(unsigned int nBatchSizeIn, CCheckQueueWorkers* pworkersIn = NULL) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn), pworkers(pworkersIn) {}
 
     //! Worker thread
     void Thread()
@@ -139,6 +226,12 @@ public:
         Loop();
     }
 
+    //! Help from a shared worker thread
+    void Help()
+    {
+        Loop(false, true);
+    }
+
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
@@ -148,16 +241,20 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            BOOST_FOREACH (T& check, vChecks) {
+                queue.push_back(T());
+                check.swap(queue.back());
+            }
+            nTodo += vChecks.size();
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else if (vChecks.size() > 1)
+                condWorker.notify_all();
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        if (pworkers != NULL && !vChecks.empty())
+            pworkers->Notify(this, vChecks.size());
     }
 
     ~CCheckQueue()
@@ -27,6 +27,18 @@
 #include "encoding.h"
 #include "core.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define ARGON2_HAVE_CPUID
+#include <cpuid.h>
+#endif
+
+/* Kernel used by argon2_ctx, see argon2_set_kernel() */
+static argon2_kernel argon2_current_kernel = ARGON2_KERNEL_SSE2;
+static argon2_fill_block_fn argon2_current_fill_block = fill_block_sse2;
+
+static int argon2_ctx_kernel(argon2_context *context, argon2_type type,
+                             argon2_fill_block_fn fill_block);
+
 const char *argon2_type2string(argon2_type type, int uppercase) {
     switch (type) {
         case Argon2_d:
@@ -37,10 +49,19 @@ const char *argon2_type2string(argon2_type type, int uppercase) {
 }
 
 int argon2_ctx(argon2_context *context, argon2_type type) {
+    return argon2_ctx_kernel(context, type, argon2_current_fill_block);
+}
+
+/*
+ * Validates @context and sets up @instance for it: memory geometry,
+ * allocation, and the first blocks of each lane
+ */
+static int argon2_init_instance(argon2_instance_t *instance,
+                                argon2_context *context, argon2_type type,
+                                argon2_fill_block_fn fill_block) {
     /* 1. Validate all inputs */
     int result = validate_inputs(context);
     uint32_t memory_blocks, segment_length;
-    argon2_instance_t instance;
 
     if (ARGON2_OK != result) {
         return result;
@@ -62,24 +83,31 @@ int argon2_ctx(argon2_context *context, argon2_type type) {
     /* Ensure that all segments have equal length */
     memory_blocks = segment_length * (context->lanes * ARGON2_SYNC_POINTS);
 
-    instance.memory = NULL;
-    instance.passes = context->t_cost;
-    instance.memory_blocks = memory_blocks;
-    instance.segment_length = segment_length;
-    instance.lane_length = segment_length * ARGON2_SYNC_POINTS;
-    instance.lanes = context->lanes;
-    instance.limit = 1;
-    instance.threads = context->threads;
-    instance.type = type;
-
-    if (instance.threads > instance.limit) {
-        instance.threads = instance.limit;
+    instance->memory = NULL;
+    instance->passes = context->t_cost;
+    instance->memory_blocks = memory_blocks;
+    instance->segment_length = segment_length;
+    instance->lane_length = segment_length * ARGON2_SYNC_POINTS;
+    instance->lanes = context->lanes;
+    instance->limit = 1;
+    instance->threads = context->threads;
+    instance->type = type;
+    instance->fill_block = fill_block;
+
+    if (instance->threads > instance->limit) {
+        instance->threads = instance->limit;
     }
 
     /* 3. Initialization: Hashing inputs, allocating memory, filling first
      * blocks
      */
-    result = initialize(&instance, context);
+    return initialize(instance, context);
+}
+
+static int argon2_ctx_kernel(argon2_context *context, argon2_type type,
+                             argon2_fill_block_fn fill_block) {
+    argon2_instance_t instance;
+    int result = argon2_init_instance(&instance, context, type, fill_block);
 
     if (ARGON2_OK != result) {
         return result;
@@ -97,6 +125,48 @@ int argon2_ctx(argon2_context *context, argon2_type type) {
     return ARGON2_OK;
 }
 
+int argon2d_ctx_batch(argon2_context *contexts, size_t count) {
+    argon2_instance_t instances[ARGON2_BATCH_MAX];
+    size_t k, initialized;
+    int result = ARGON2_OK;
+
+    if (contexts == NULL || count == 0 || count > ARGON2_BATCH_MAX) {
+        return ARGON2_INCORRECT_PARAMETER;
+    }
+
+    /* The memory of all inputs is filled in lockstep */
+    for (k = 1; k < count; ++k) {
+        if (contexts[k].m_cost != contexts[0].m_cost ||
+            contexts[k].t_cost != contexts[0].t_cost ||
+            contexts[k].lanes != contexts[0].lanes) {
+            return ARGON2_INCORRECT_PARAMETER;
+        }
+    }
+
+    for (initialized = 0; initialized < count; ++initialized) {
+        result = argon2_init_instance(&instances[initialized],
+                                      &contexts[initialized], Argon2_d,
+                                      argon2_current_fill_block);
+        if (ARGON2_OK != result) {
+            break;
+        }
+    }
+
+    if (ARGON2_OK == result) {
+        fill_memory_blocks_batch(instances, count);
+        for (k = 0; k < count; ++k) {
+            finalize(&contexts[k], &instances[k]);
+        }
+        return ARGON2_OK;
+    }
+
+    for (k = 0; k < initialized; ++k) {
+        free_memory(&contexts[k], (uint8_t *)instances[k].memory,
+                    instances[k].memory_blocks, sizeof(block));
+    }
+    return result;
+}
+
 int argon2_hash(const uint32_t t_cost, const uint32_t m_cost,
                 const uint32_t parallelism, const void *pwd,
                 const size_t pwdlen, const void *salt, const size_t saltlen,
@@ -370,6 +440,10 @@ const char *argon2_error_message(int error_code) {
         return "Some of encoded parameters are too long or too short";
     case ARGON2_VERIFY_MISMATCH:
         return "The password does not match the supplied hash";
+    case ARGON2_KERNEL_UNAVAILABLE:
+        return "Kernel is not supported on this CPU";
+    case ARGON2_KERNEL_MISMATCH:
+        return "Kernel failed its self test";
     default:
         return "Unknown error code";
     }
@@ -382,6 +456,196 @@ size_t argon2_encodedlen(uint32_t t_cost, uint32_t m_cost, uint32_t parallelism,
          b64len(saltlen) + b64len(hashlen);
 }
 
+static argon2_fill_block_fn argon2_kernel_fill_block(argon2_kernel kernel) {
+    switch (kernel) {
+    case ARGON2_KERNEL_REF:
+        return fill_block_ref;
+    case ARGON2_KERNEL_SSE2:
+        return fill_block_sse2;
+#ifdef ENABLE_SSSE3
+    case ARGON2_KERNEL_SSSE3:
+        return fill_block_ssse3;
+#endif
+#ifdef ENABLE_AVX2
+    case ARGON2_KERNEL_AVX2:
+        return fill_block_avx2;
+#endif
+#ifdef ENABLE_AVX512F
+    case ARGON2_KERNEL_AVX512F:
+        return fill_block_avx512f;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+const char *argon2_kernel2string(argon2_kernel kernel) {
+    switch (kernel) {
+    case ARGON2_KERNEL_REF:
+        return "ref";
+    case ARGON2_KERNEL_SSE2:
+        return "sse2";
+    case ARGON2_KERNEL_SSSE3:
+        return "ssse3";
+    case ARGON2_KERNEL_AVX2:
+        return "avx2";
+    case ARGON2_KERNEL_AVX512F:
+        return "avx512f";
+    }
+
+    return NULL;
+}
+
+#ifdef ARGON2_HAVE_CPUID
+/* Extended control register 0, the register state enabled by the OS */
+static uint64_t argon2_xgetbv(void) {
+    uint32_t a, d;
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t)d << 32) | a;
+}
+#endif
+
+int argon2_kernel_available(argon2_kernel kernel) {
+#ifdef ARGON2_HAVE_CPUID
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+    uint32_t ecx1, edx1, ebx7 = 0;
+    uint64_t xcr0 = 0;
+#endif
+
+    if (argon2_kernel_fill_block(kernel) == NULL) {
+        return 0;
+    }
+    if (kernel == ARGON2_KERNEL_REF) {
+        return 1;
+    }
+
+#ifdef ARGON2_HAVE_CPUID
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+        return 0;
+    }
+    ecx1 = ecx;
+    edx1 = edx;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        ebx7 = ebx;
+    }
+    /* OSXSAVE: the OS saves the AVX registers on context switch */
+    if (ecx1 & (1u << 27)) {
+        xcr0 = argon2_xgetbv();
+    }
+
+    switch (kernel) {
+    case ARGON2_KERNEL_SSE2:
+        return (edx1 >> 26) & 1;
+    case ARGON2_KERNEL_SSSE3:
+        return (ecx1 >> 9) & 1;
+    case ARGON2_KERNEL_AVX2:
+        return (xcr0 & 0x06) == 0x06 && (ebx7 >> 5) & 1;
+    case ARGON2_KERNEL_AVX512F:
+        return (xcr0 & 0xe6) == 0xe6 && (ebx7 >> 16) & 1;
+    default:
+        return 0;
+    }
+#else
+    return 0;
+#endif
+}
+
+/* Main network genesis block header and its phase 1 PoW hash */
+static const uint8_t argon2_selftest_header[80] = {
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x55, 0x52, 0xb0, 0xa7,
+    0x39, 0x94, 0x10, 0x31, 0x8b, 0xe9, 0x7a, 0xf5, 0x99, 0x36,
+    0xa1, 0x68, 0x94, 0xfc, 0xaf, 0xff, 0xa2, 0x00, 0x3a, 0x7c,
+    0x32, 0xb7, 0xf8, 0x2d, 0xd3, 0x95, 0xe5, 0x14, 0xc4, 0x03,
+    0x00, 0x5c, 0xff, 0xff, 0x00, 0x1f, 0x83, 0x92, 0x01, 0x00};
+
+static const uint8_t argon2_selftest_hash[32] = {
+    0xa2, 0x90, 0xa0, 0xe6, 0x2f, 0xc2, 0xe4, 0x03,
+    0x55, 0x0e, 0xad, 0xaf, 0xbe, 0x52, 0x57, 0x3a,
+    0x89, 0x0f, 0x0a, 0xdb, 0x64, 0xea, 0x98, 0x88,
+    0x90, 0x85, 0x28, 0x5d, 0xdf, 0xa1, 0x00, 0x00};
+
+/* Phase 1 PoW parameters, see hash_Argon2d() in hash.h */
+static int argon2_selftest_hash_with(argon2_fill_block_fn fill_block,
+                                     uint8_t out[32]) {
+    argon2_context context;
+
+    memset(&context, 0, sizeof(context));
+    context.out = out;
+    context.outlen = 32;
+    context.pwd = CONST_CAST(uint8_t *)argon2_selftest_header;
+    context.pwdlen = sizeof(argon2_selftest_header);
+    context.salt = CONST_CAST(uint8_t *)argon2_selftest_header;
+    context.saltlen = sizeof(argon2_selftest_header);
+    context.flags = ARGON2_DEFAULT_FLAGS;
+    context.m_cost = 250;
+    context.lanes = 4;
+    context.threads = 1;
+    context.t_cost = 1;
+
+    return argon2_ctx_kernel(&context, Argon2_d, fill_block);
+}
+
+int argon2_kernel_selftest(argon2_kernel kernel) {
+    uint8_t expected[32], out[32];
+    int result;
+
+    if (!argon2_kernel_available(kernel)) {
+        return ARGON2_KERNEL_UNAVAILABLE;
+    }
+
+    result = argon2_selftest_hash_with(fill_block_ref, expected);
+    if (ARGON2_OK != result) {
+        return result;
+    }
+    if (memcmp(expected, argon2_selftest_hash, sizeof(expected)) != 0) {
+        return ARGON2_KERNEL_MISMATCH;
+    }
+
+    result = argon2_selftest_hash_with(argon2_kernel_fill_block(kernel), out);
+    if (ARGON2_OK != result) {
+        return result;
+    }
+    if (memcmp(expected, out, sizeof(out)) != 0) {
+        return ARGON2_KERNEL_MISMATCH;
+    }
+
+    return ARGON2_OK;
+}
+
+int argon2_set_kernel(argon2_kernel kernel) {
+    int result = argon2_kernel_selftest(kernel);
+
+    if (ARGON2_OK != result) {
+        return result;
+    }
+
+    argon2_current_kernel = kernel;
+    argon2_current_fill_block = argon2_kernel_fill_block(kernel);
+    return ARGON2_OK;
+}
+
+argon2_kernel argon2_get_kernel(void) {
+    return argon2_current_kernel;
+}
+
+argon2_kernel argon2_select_kernel(void) {
+    int kernel;
+
+    /* Kernels are ordered from slowest to fastest */
+    for (kernel = ARGON2_KERNEL_COUNT - 1; kernel > ARGON2_KERNEL_REF; --kernel) {
+        if (ARGON2_OK == argon2_set_kernel((argon2_kernel)kernel)) {
+            return argon2_current_kernel;
+        }
+    }
+
+    argon2_set_kernel(ARGON2_KERNEL_REF);
+    return argon2_current_kernel;
+}
+
 #ifdef __AVX2__
 
 ///////////////////////////
@@ -155,7 +155,10 @@ typedef enum Argon2_ErrorCodes {
 
     ARGON2_DECODING_LENGTH_FAIL = -34,
 
-    ARGON2_VERIFY_MISMATCH = -35
+    ARGON2_VERIFY_MISMATCH = -35,
+
+    ARGON2_KERNEL_UNAVAILABLE = -36,
+    ARGON2_KERNEL_MISMATCH = -37
 } argon2_error_codes;
 
 /* Memory allocator types --- for external allocation */
@@ -297,6 +300,19 @@ ARGON2_PUBLIC int argon2_verify(const char *encoded, const void *pwd,
  */
 ARGON2_PUBLIC int argon2d_ctx(argon2_context *context);
 
+/* Maximum number of inputs hashed together by argon2d_ctx_batch */
+#define ARGON2_BATCH_MAX 8
+
+/**
+ * Argon2d of up to ARGON2_BATCH_MAX inputs at once. The memory of all inputs
+ * is filled in lockstep, so the data dependent reference block loads of one
+ * input overlap with the compression of the others.
+ * @param  contexts  Array of @count contexts, with the same time cost, memory
+ * cost and lanes
+ * @return  Zero if successful, a non zero error code otherwise
+ */
+ARGON2_PUBLIC int argon2d_ctx_batch(argon2_context *contexts, size_t count);
+
 /**
  * Verify if a given password is correct for Argon2d hashing
  * @param  context  Pointer to current Argon2 context
@@ -330,6 +346,56 @@ ARGON2_PUBLIC size_t argon2_encodedlen(uint32_t t_cost, uint32_t m_cost,
                                        uint32_t parallelism, uint32_t saltlen,
                                        uint32_t hashlen, argon2_type type);
 
+/* Block fill kernels, selectable at runtime */
+typedef enum Argon2_kernel {
+    ARGON2_KERNEL_REF = 0,
+    ARGON2_KERNEL_SSE2 = 1,
+    ARGON2_KERNEL_SSSE3 = 2,
+    ARGON2_KERNEL_AVX2 = 3,
+    ARGON2_KERNEL_AVX512F = 4
+} argon2_kernel;
+
+#define ARGON2_KERNEL_COUNT 5
+
+/**
+ * Get the name of a block fill kernel
+ * @return  NULL if invalid kernel, otherwise the kernel name
+ */
+ARGON2_PUBLIC const char *argon2_kernel2string(argon2_kernel kernel);
+
+/**
+ * Check whether a kernel was compiled in and is supported by the CPU and OS
+ * @return  Non zero if the kernel can be used
+ */
+ARGON2_PUBLIC int argon2_kernel_available(argon2_kernel kernel);
+
+/**
+ * Hash a fixed block header with the given kernel and compare the result
+ * against the reference kernel and a known answer
+ * @return  ARGON2_OK if the kernel produced the expected hash
+ */
+ARGON2_PUBLIC int argon2_kernel_selftest(argon2_kernel kernel);
+
+/**
+ * Use @kernel for all subsequent hashes. Not thread safe: must be called
+ * before any other thread starts hashing.
+ * @return  ARGON2_OK on success, ARGON2_KERNEL_UNAVAILABLE or
+ * ARGON2_KERNEL_MISMATCH if the kernel can not be used
+ */
+ARGON2_PUBLIC int argon2_set_kernel(argon2_kernel kernel);
+
+/**
+ * Get the kernel currently used for hashing
+ */
+ARGON2_PUBLIC argon2_kernel argon2_get_kernel(void);
+
+/**
+ * Select the fastest available kernel that passes its self test, falling back
+ * to the reference kernel. Same thread safety rules as argon2_set_kernel.
+ * @return  The kernel now in use
+ */
+ARGON2_PUBLIC argon2_kernel argon2_select_kernel(void);
+
 #ifdef __AVX2__
 
 ///////////////////////////
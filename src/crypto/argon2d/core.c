@@ -50,6 +50,12 @@
 #define NOT_OPTIMIZED
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define ARGON2_PREFETCH(p) __builtin_prefetch((p))
+#else
+#define ARGON2_PREFETCH(p)
+#endif
+
 /***************Instance and Position constructors**********/
 void init_block_value(block *b, uint8_t in) { memset(b->v, in, sizeof(b->v)); }
 
@@ -238,6 +244,152 @@ uint32_t index_alpha(const argon2_instance_t *instance,
     return absolute_position;
 }
 
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+    block *ref_block = NULL, *curr_block = NULL;
+    block state;
+    uint64_t pseudo_rand, ref_index, ref_lane;
+    uint32_t prev_offset, curr_offset;
+    uint32_t starting_index, i;
+
+    if (instance == NULL) {
+        return;
+    }
+
+    starting_index = 0;
+
+    if ((0 == position.pass) && (0 == position.slice)) {
+        starting_index = 2; /* we have already generated the first two blocks */
+    }
+
+    /* Offset of the current block */
+    curr_offset = position.lane * instance->lane_length +
+                  position.slice * instance->segment_length + starting_index;
+
+    if (0 == curr_offset % instance->lane_length) {
+        /* Last block in this lane */
+        prev_offset = curr_offset + instance->lane_length - 1;
+    } else {
+        /* Previous block */
+        prev_offset = curr_offset - 1;
+    }
+
+    copy_block(&state, instance->memory + prev_offset);
+
+    for (i = starting_index; i < instance->segment_length;
+         ++i, ++curr_offset, ++prev_offset) {
+        /*1.1 Rotating prev_offset if needed */
+        if (curr_offset % instance->lane_length == 1) {
+            prev_offset = curr_offset - 1;
+        }
+
+        /* 1.2 Computing the index of the reference block */
+        /* 1.2.1 Taking pseudo-random value from the previous block */
+        pseudo_rand = instance->memory[prev_offset].v[0];
+
+        /* 1.2.2 Computing the lane of the reference block */
+        ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
+
+        if ((position.pass == 0) && (position.slice == 0)) {
+            /* Can not reference other lanes yet */
+            ref_lane = position.lane;
+        }
+
+        /* 1.2.3 Computing the number of possible reference block within the
+         * lane.
+         */
+        position.index = i;
+        ref_index = index_alpha(instance, &position, pseudo_rand & 0xFFFFFFFF,
+                                ref_lane == position.lane);
+
+        /* 2 Creating a new block */
+        ref_block =
+            instance->memory + instance->lane_length * ref_lane + ref_index;
+        curr_block = instance->memory + curr_offset;
+
+        instance->fill_block(&state, ref_block, curr_block);
+    }
+}
+
+/* Pull all cache lines of @b towards the core */
+static void prefetch_block(const block *b) {
+    unsigned i;
+    for (i = 0; i < ARGON2_QWORDS_IN_BLOCK; i += 8) {
+        ARGON2_PREFETCH(&b->v[i]);
+    }
+}
+
+void fill_segment_batch(const argon2_instance_t *instances, size_t count,
+                        argon2_position_t position) {
+    block state[ARGON2_BATCH_MAX];
+    block *ref_blocks[ARGON2_BATCH_MAX];
+    const argon2_instance_t *instance = instances;
+    uint64_t pseudo_rand, ref_index, ref_lane;
+    uint32_t prev_offset, curr_offset;
+    uint32_t starting_index, i;
+    size_t k;
+
+    if (instances == NULL || count == 0 || count > ARGON2_BATCH_MAX) {
+        return;
+    }
+
+    starting_index = 0;
+
+    if ((0 == position.pass) && (0 == position.slice)) {
+        starting_index = 2; /* we have already generated the first two blocks */
+    }
+
+    /* Offset of the current block, the same in every instance */
+    curr_offset = position.lane * instance->lane_length +
+                  position.slice * instance->segment_length + starting_index;
+
+    if (0 == curr_offset % instance->lane_length) {
+        /* Last block in this lane */
+        prev_offset = curr_offset + instance->lane_length - 1;
+    } else {
+        /* Previous block */
+        prev_offset = curr_offset - 1;
+    }
+
+    for (k = 0; k < count; ++k) {
+        copy_block(&state[k], instances[k].memory + prev_offset);
+    }
+
+    for (i = starting_index; i < instance->segment_length;
+         ++i, ++curr_offset, ++prev_offset) {
+        /*1.1 Rotating prev_offset if needed */
+        if (curr_offset % instance->lane_length == 1) {
+            prev_offset = curr_offset - 1;
+        }
+        position.index = i;
+
+        /* 1.2 Locate the reference block of every instance first, so that
+         * their loads are in flight while the first ones are compressed */
+        for (k = 0; k < count; ++k) {
+            pseudo_rand = instances[k].memory[prev_offset].v[0];
+            ref_lane = ((pseudo_rand >> 32)) % instance->lanes;
+
+            if ((position.pass == 0) && (position.slice == 0)) {
+                /* Can not reference other lanes yet */
+                ref_lane = position.lane;
+            }
+
+            ref_index = index_alpha(instance, &position,
+                                    pseudo_rand & 0xFFFFFFFF,
+                                    ref_lane == position.lane);
+            ref_blocks[k] = instances[k].memory +
+                            instance->lane_length * ref_lane + ref_index;
+            prefetch_block(ref_blocks[k]);
+        }
+
+        /* 2 Creating the new blocks */
+        for (k = 0; k < count; ++k) {
+            instances[k].fill_block(&state[k], ref_blocks[k],
+                                    instances[k].memory + curr_offset);
+        }
+    }
+}
+
 /* Single-threaded version for p=1 case */
 static int fill_memory_blocks_st(argon2_instance_t *instance) {
     uint32_t r, s, l;
@@ -357,6 +509,19 @@ int fill_memory_blocks(argon2_instance_t *instance) {
 #endif
 }
 
+void fill_memory_blocks_batch(const argon2_instance_t *instances, size_t count) {
+    uint32_t r, s, l;
+
+    for (r = 0; r < instances->passes; ++r) {
+        for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
+            for (l = 0; l < instances->lanes; ++l) {
+                argon2_position_t position = {r, l, (uint8_t)s, 0};
+                fill_segment_batch(instances, count, position);
+            }
+        }
+    }
+}
+
 int validate_inputs(const argon2_context *context) {
     if (NULL == context) {
         return ARGON2_INCORRECT_PARAMETER;
@@ -62,6 +62,31 @@ void copy_block(block *dst, const block *src);
 /* XOR @src onto @dst bytewise */
 void xor_block(block *dst, const block *src);
 
+/*
+ * Compression function G shared by all block fill kernels: XORs @ref_block
+ * into @state, applies the BlaMka permutation and XORs the input back, then
+ * stores the result in both @state and @next_block.
+ * @pre @state must not alias @ref_block or @next_block
+ */
+typedef void (*argon2_fill_block_fn)(block *state, const block *ref_block,
+                                     block *next_block);
+
+/* Portable kernel, always available */
+void fill_block_ref(block *state, const block *ref_block, block *next_block);
+
+/* Vectorized kernels, see argon2_kernel_available() before calling them */
+void fill_block_sse2(block *state, const block *ref_block, block *next_block);
+#ifdef ENABLE_SSSE3
+void fill_block_ssse3(block *state, const block *ref_block, block *next_block);
+#endif
+#ifdef ENABLE_AVX2
+void fill_block_avx2(block *state, const block *ref_block, block *next_block);
+#endif
+#ifdef ENABLE_AVX512F
+void fill_block_avx512f(block *state, const block *ref_block,
+                        block *next_block);
+#endif
+
 /*
  * Argon2 instance: memory pointer, number of passes, amount of memory, type,
  * and derived values.
@@ -81,6 +106,7 @@ typedef struct Argon2_instance_t {
     argon2_type type;
     int print_internals; /* whether to print the memory blocks */
     argon2_context *context_ptr; /* points back to original context */
+    argon2_fill_block_fn fill_block; /* kernel used by fill_segment */
 } argon2_instance_t;
 
 /*
@@ -218,6 +244,15 @@ void finalize(const argon2_context *context, argon2_instance_t *instance);
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position);
 
+/*
+ * Same as fill_segment for @count instances of identical geometry, one block
+ * of each instance at a time, prefetching the reference blocks of all
+ * instances before compressing any of them
+ * @pre @count must not exceed ARGON2_BATCH_MAX
+ */
+void fill_segment_batch(const argon2_instance_t *instances, size_t count,
+                        argon2_position_t position);
+
 /*
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
@@ -226,4 +261,11 @@ void fill_segment(const argon2_instance_t *instance,
  */
 int fill_memory_blocks(argon2_instance_t *instance);
 
+/*
+ * Single threaded fill of the memory of @count instances with the same
+ * geometry, see fill_segment_batch
+ * @param instances Array of @count initialized instances
+ */
+void fill_memory_blocks_batch(const argon2_instance_t *instances, size_t count);
+
 #endif
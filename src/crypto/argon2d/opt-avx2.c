@@ -0,0 +1,129 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0 
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : http://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+/*
+ * AVX2 block fill kernel, compiled with -mavx2. One BLAKE2 round is done per
+ * set of four 256-bit registers, holding the 4x4 matrix of 64-bit words row by
+ * row, so the diagonal step is a lane permutation of the rows.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "core.h"
+
+#include <immintrin.h>
+
+#define ROR32_AVX2(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROR24_AVX2(x)                                                          \
+    _mm256_shuffle_epi8((x), _mm256_setr_epi8(                                 \
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,                  \
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define ROR16_AVX2(x)                                                          \
+    _mm256_shuffle_epi8((x), _mm256_setr_epi8(                                 \
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,                  \
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define ROR63_AVX2(x)                                                          \
+    _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+/* x + y + 2 * lo32(x) * lo32(y) */
+#define FBLAMKA_AVX2(x, y)                                                     \
+    _mm256_add_epi64(_mm256_add_epi64((x), (y)),                               \
+        _mm256_add_epi64(_mm256_mul_epu32((x), (y)),                           \
+                         _mm256_mul_epu32((x), (y))))
+
+#define G_AVX2(A, B, C, D)                                                     \
+    do {                                                                       \
+        A = FBLAMKA_AVX2(A, B);                                                \
+        D = ROR32_AVX2(_mm256_xor_si256(D, A));                                \
+        C = FBLAMKA_AVX2(C, D);                                                \
+        B = ROR24_AVX2(_mm256_xor_si256(B, C));                                \
+        A = FBLAMKA_AVX2(A, B);                                                \
+        D = ROR16_AVX2(_mm256_xor_si256(D, A));                                \
+        C = FBLAMKA_AVX2(C, D);                                                \
+        B = ROR63_AVX2(_mm256_xor_si256(B, C));                                \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND_AVX2(A, B, C, D)                                          \
+    do {                                                                       \
+        G_AVX2(A, B, C, D);                                                    \
+        B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(0, 3, 2, 1));              \
+        C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));              \
+        D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(2, 1, 0, 3));              \
+        G_AVX2(A, B, C, D);                                                    \
+        B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(2, 1, 0, 3));              \
+        C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));              \
+        D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(0, 3, 2, 1));              \
+    } while ((void)0, 0)
+
+/* Two 128-bit words of the block as one 256-bit register, and back */
+#define LOAD_PAIR_AVX2(p, lo, hi)                                              \
+    _mm256_inserti128_si256(_mm256_castsi128_si256(                            \
+        _mm_load_si128((p) + (lo))), _mm_load_si128((p) + (hi)), 1)
+#define STORE_PAIR_AVX2(p, lo, hi, x)                                          \
+    do {                                                                       \
+        _mm_store_si128((p) + (lo), _mm256_castsi256_si128(x));                \
+        _mm_store_si128((p) + (hi), _mm256_extracti128_si256((x), 1));         \
+    } while ((void)0, 0)
+
+void fill_block_avx2(block *state_block, const block *ref_block,
+                     block *next_block) {
+    __m256i state[ARGON2_QWORDS_IN_BLOCK / 4];
+    __m256i block_XY[ARGON2_QWORDS_IN_BLOCK / 4];
+    __m128i *owords = (__m128i *)state;
+    __m256i A, B, C, D;
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_QWORDS_IN_BLOCK / 4; i++) {
+        block_XY[i] = state[i] = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)state_block->v + i),
+            _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+    }
+
+    /* Columns: 64-bit words 16 * i ... 16 * i + 15 */
+    for (i = 0; i < 8; ++i) {
+        A = state[4 * i + 0];
+        B = state[4 * i + 1];
+        C = state[4 * i + 2];
+        D = state[4 * i + 3];
+        BLAKE2_ROUND_AVX2(A, B, C, D);
+        state[4 * i + 0] = A;
+        state[4 * i + 1] = B;
+        state[4 * i + 2] = C;
+        state[4 * i + 3] = D;
+    }
+
+    /* Rows: 128-bit words i, 8 + i, ..., 56 + i */
+    for (i = 0; i < 8; ++i) {
+        A = LOAD_PAIR_AVX2(owords, 8 * 0 + i, 8 * 1 + i);
+        B = LOAD_PAIR_AVX2(owords, 8 * 2 + i, 8 * 3 + i);
+        C = LOAD_PAIR_AVX2(owords, 8 * 4 + i, 8 * 5 + i);
+        D = LOAD_PAIR_AVX2(owords, 8 * 6 + i, 8 * 7 + i);
+        BLAKE2_ROUND_AVX2(A, B, C, D);
+        STORE_PAIR_AVX2(owords, 8 * 0 + i, 8 * 1 + i, A);
+        STORE_PAIR_AVX2(owords, 8 * 2 + i, 8 * 3 + i, B);
+        STORE_PAIR_AVX2(owords, 8 * 4 + i, 8 * 5 + i, C);
+        STORE_PAIR_AVX2(owords, 8 * 6 + i, 8 * 7 + i, D);
+    }
+
+    for (i = 0; i < ARGON2_QWORDS_IN_BLOCK / 4; i++) {
+        state[i] = _mm256_xor_si256(state[i], block_XY[i]);
+        _mm256_storeu_si256((__m256i *)state_block->v + i, state[i]);
+        _mm256_storeu_si256((__m256i *)next_block->v + i, state[i]);
+    }
+}
@@ -0,0 +1,132 @@
+/*
+ * Argon2 reference source code package - reference C implementations
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0 
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : http://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+/*
+ * AVX-512F block fill kernel, compiled with -mavx512f. Same layout as the
+ * AVX2 kernel, with two independent BLAKE2 rounds packed in the two 256-bit
+ * halves of each register.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "core.h"
+
+#include <immintrin.h>
+
+/* x + y + 2 * lo32(x) * lo32(y) */
+#define FBLAMKA_AVX512(x, y)                                                   \
+    _mm512_add_epi64(_mm512_add_epi64((x), (y)),                               \
+        _mm512_add_epi64(_mm512_mul_epu32((x), (y)),                           \
+                         _mm512_mul_epu32((x), (y))))
+
+#define G_AVX512(A, B, C, D)                                                   \
+    do {                                                                       \
+        A = FBLAMKA_AVX512(A, B);                                              \
+        D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 32);                      \
+        C = FBLAMKA_AVX512(C, D);                                              \
+        B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 24);                      \
+        A = FBLAMKA_AVX512(A, B);                                              \
+        D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 16);                      \
+        C = FBLAMKA_AVX512(C, D);                                              \
+        B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 63);                      \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND_AVX512(A, B, C, D)                                        \
+    do {                                                                       \
+        G_AVX512(A, B, C, D);                                                  \
+        B = _mm512_permutex_epi64(B, _MM_SHUFFLE(0, 3, 2, 1));                 \
+        C = _mm512_permutex_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));                 \
+        D = _mm512_permutex_epi64(D, _MM_SHUFFLE(2, 1, 0, 3));                 \
+        G_AVX512(A, B, C, D);                                                  \
+        B = _mm512_permutex_epi64(B, _MM_SHUFFLE(2, 1, 0, 3));                 \
+        C = _mm512_permutex_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));                 \
+        D = _mm512_permutex_epi64(D, _MM_SHUFFLE(0, 3, 2, 1));                 \
+    } while ((void)0, 0)
+
+/* Two 256-bit words of the block as one 512-bit register, and back */
+#define LOAD_PAIR_AVX512(p, lo, hi)                                            \
+    _mm512_inserti64x4(_mm512_castsi256_si512(                                 \
+        _mm256_load_si256((p) + (lo))), _mm256_load_si256((p) + (hi)), 1)
+#define STORE_PAIR_AVX512(p, lo, hi, x)                                        \
+    do {                                                                       \
+        _mm256_store_si256((p) + (lo), _mm512_castsi512_si256(x));             \
+        _mm256_store_si256((p) + (hi), _mm512_extracti64x4_epi64((x), 1));     \
+    } while ((void)0, 0)
+
+/* Four 128-bit words of the block as one 512-bit register, and back */
+#define LOAD_QUAD_AVX512(p, i0, i1, i2, i3)                                    \
+    _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(                  \
+        _mm512_castsi128_si512(_mm_load_si128((p) + (i0))),                    \
+        _mm_load_si128((p) + (i1)), 1), _mm_load_si128((p) + (i2)), 2),        \
+        _mm_load_si128((p) + (i3)), 3)
+#define STORE_QUAD_AVX512(p, i0, i1, i2, i3, x)                                \
+    do {                                                                       \
+        _mm_store_si128((p) + (i0), _mm512_castsi512_si128(x));                \
+        _mm_store_si128((p) + (i1), _mm512_extracti32x4_epi32((x), 1));        \
+        _mm_store_si128((p) + (i2), _mm512_extracti32x4_epi32((x), 2));        \
+        _mm_store_si128((p) + (i3), _mm512_extracti32x4_epi32((x), 3));        \
+    } while ((void)0, 0)
+
+void fill_block_avx512f(block *state_block, const block *ref_block,
+                        block *next_block) {
+    __m512i state[ARGON2_QWORDS_IN_BLOCK / 8];
+    __m512i block_XY[ARGON2_QWORDS_IN_BLOCK / 8];
+    __m256i *ywords = (__m256i *)state;
+    __m128i *owords = (__m128i *)state;
+    __m512i A, B, C, D;
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_QWORDS_IN_BLOCK / 8; i++) {
+        block_XY[i] = state[i] = _mm512_xor_si512(
+            _mm512_loadu_si512((const __m512i *)state_block->v + i),
+            _mm512_loadu_si512((const __m512i *)ref_block->v + i));
+    }
+
+    /* Columns: 64-bit words 16 * i ... 16 * i + 15, two rounds at a time */
+    for (i = 0; i < 8; i += 2) {
+        A = LOAD_PAIR_AVX512(ywords, 4 * i + 0, 4 * i + 4);
+        B = LOAD_PAIR_AVX512(ywords, 4 * i + 1, 4 * i + 5);
+        C = LOAD_PAIR_AVX512(ywords, 4 * i + 2, 4 * i + 6);
+        D = LOAD_PAIR_AVX512(ywords, 4 * i + 3, 4 * i + 7);
+        BLAKE2_ROUND_AVX512(A, B, C, D);
+        STORE_PAIR_AVX512(ywords, 4 * i + 0, 4 * i + 4, A);
+        STORE_PAIR_AVX512(ywords, 4 * i + 1, 4 * i + 5, B);
+        STORE_PAIR_AVX512(ywords, 4 * i + 2, 4 * i + 6, C);
+        STORE_PAIR_AVX512(ywords, 4 * i + 3, 4 * i + 7, D);
+    }
+
+    /* Rows: 128-bit words i, 8 + i, ..., 56 + i, two rounds at a time */
+    for (i = 0; i < 8; i += 2) {
+        A = LOAD_QUAD_AVX512(owords, i, 8 + i, i + 1, 9 + i);
+        B = LOAD_QUAD_AVX512(owords, 16 + i, 24 + i, 17 + i, 25 + i);
+        C = LOAD_QUAD_AVX512(owords, 32 + i, 40 + i, 33 + i, 41 + i);
+        D = LOAD_QUAD_AVX512(owords, 48 + i, 56 + i, 49 + i, 57 + i);
+        BLAKE2_ROUND_AVX512(A, B, C, D);
+        STORE_QUAD_AVX512(owords, i, 8 + i, i + 1, 9 + i, A);
+        STORE_QUAD_AVX512(owords, 16 + i, 24 + i, 17 + i, 25 + i, B);
+        STORE_QUAD_AVX512(owords, 32 + i, 40 + i, 33 + i, 41 + i, C);
+        STORE_QUAD_AVX512(owords, 48 + i, 56 + i, 49 + i, 57 + i, D);
+    }
+
+    for (i = 0; i < ARGON2_QWORDS_IN_BLOCK / 8; i++) {
+        state[i] = _mm512_xor_si512(state[i], block_XY[i]);
+        _mm512_storeu_si512((__m512i *)state_block->v + i, state[i]);
+        _mm512_storeu_si512((__m512i *)next_block->v + i, state[i]);
+    }
+}
@@ -5,12 +5,17 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/zumy-config.h"
+#endif
+
 #include "dbwrapper.h"
 
 #include "random.h"
 #include "util.h"
 
 #include <memenv.h>
+#include <assert.h>
 #include <stdint.h>
 
 #include <leveldb/cache.h>
@@ -18,6 +23,7 @@
 #include <leveldb/filter_policy.h>
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 
 void HandleError(const leveldb::Status& status) throw(dbwrapper_error)
 {
@@ -33,14 +39,71 @@ void HandleError(const leveldb::Status& status) throw(dbwrapper_error)
     throw dbwrapper_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+bool ParseDBProfile(const std::string& strName, DBProfile& profile)
+{
+    if (strName == "default")
+        profile = DBPROFILE_DEFAULT;
+    else if (strName == "index")
+        profile = DBPROFILE_INDEX;
+    else
+        return false;
+    return true;
+}
+
+std::string GetDBProfileName(DBProfile profile)
+{
+    switch (profile) {
+    case DBPROFILE_DEFAULT: return "default";
+    case DBPROFILE_INDEX: return "index";
+    }
+    assert(false);
+    return "";
+}
+
+DBProfile GetDBProfile(const std::string& strDB, DBProfile defaultProfile)
+{
+    DBProfile profile = defaultProfile;
+    BOOST_FOREACH(const std::string& strArg, mapMultiArgs["-dbprofile"]) {
+        size_t nPos = strArg.find(':');
+        DBProfile parsed;
+        if (nPos != std::string::npos && strArg.substr(0, nPos) == strDB && ParseDBProfile(strArg.substr(nPos + 1), parsed))
+            profile = parsed;
+    }
+    return profile;
+}
+
+bool HaveDBCompression()
+{
+#ifdef USE_SNAPPY
+    return true;
+#else
+    return false;
+#endif
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, DBProfile profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    switch (profile) {
+    case DBPROFILE_DEFAULT:
+        options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
+        options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+        options.compression = leveldb::kNoCompression;
+        options.max_open_files = 64;
+        break;
+    case DBPROFILE_INDEX:
+        // Iterators read through the block cache too, so it gets the bulk of
+        // the cache. Index entries compress well, and bigger blocks compress
+        // better and need fewer entries in the table indexes. Whether a
+        // database is compressed is settled when it is opened.
+        options.block_cache = leveldb::NewLRUCache(nCacheSize * 3 / 4);
+        options.write_buffer_size = nCacheSize / 8;
+        options.compression = HaveDBCompression() ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+        options.block_size = 32 * 1024;
+        options.max_open_files = 256;
+        break;
+    }
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -49,14 +112,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, DBProfile profile)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
-    iteroptions.fill_cache = false;
+    iteroptions.fill_cache = profile == DBPROFILE_INDEX;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -68,7 +131,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
             HandleError(result);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (profile %s)\n", path.string(), GetDBProfileName(profile));
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
@@ -77,6 +140,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
 
+    const bool fNew = IsEmpty();
     bool key_exists = Read(OBFUSCATE_KEY_KEY, obfuscate_key);
 
     if (!key_exists && obfuscate && IsEmpty()) {
@@ -92,6 +156,28 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), GetObfuscateKeyHex());
+
+    // Compression is recorded when a database is created and kept from then
+    // on, a database is never compressed by one build and read by another
+    // that lacks Snappy.
+    fCompressed = false;
+    if (fNew) {
+        fCompressed = options.compression == leveldb::kSnappyCompression;
+        if (fCompressed)
+            Write(COMPRESSION_KEY, fCompressed);
+    } else {
+        Read(COMPRESSION_KEY, fCompressed);
+    }
+    if (fCompressed && !HaveDBCompression())
+        throw dbwrapper_error(strprintf("Database %s is compressed with Snappy, which this build does not support", path.string()));
+    if (fCompressed != (options.compression == leveldb::kSnappyCompression)) {
+        delete pdb;
+        pdb = NULL;
+        options.compression = fCompressed ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+        status = leveldb::DB::Open(options, path.string(), &pdb);
+        HandleError(status);
+    }
+    LogPrintf("Using %s tables for %s\n", fCompressed ? "Snappy compressed" : "uncompressed", path.string());
 }
 
 CDBWrapper::~CDBWrapper()
@@ -121,6 +207,8 @@ const std::string CDBWrapper::OBFUSCATE_KEY_KEY("\000obfuscate_key", 14);
 
 const unsigned int CDBWrapper::OBFUSCATE_KEY_NUM_BYTES = 8;
 
+const std::string CDBWrapper::COMPRESSION_KEY("\000compression", 12);
+
 /**
  * Returns a string (consisting of 8 random bytes) suitable for use as an
  * obfuscating XOR key.
@@ -28,6 +28,32 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(dbwrapper_error);
 
+/** How a database is used, which decides how its LevelDB instance is tuned */
+enum DBProfile
+{
+    //! Point lookups of small, random records, like the chain state
+    DBPROFILE_DEFAULT,
+    //! Large indexes that are mostly appended to and read by iterating over key
+    //! ranges, like the address and spent indexes. Tables are compressed (when
+    //! configured --with-snappy, for databases created by such a build) in
+    //! bigger blocks, more of them are kept open, and iterators fill the block
+    //! cache, which gets most of the cache.
+    DBPROFILE_INDEX,
+};
+
+/** Whether LevelDB is built with Snappy, so that new index databases are compressed */
+bool HaveDBCompression();
+
+/** Parse a profile name as given to -dbprofile */
+bool ParseDBProfile(const std::string& strName, DBProfile& profile);
+std::string GetDBProfileName(DBProfile profile);
+
+/**
+ * The profile of the database strDB: the last -dbprofile=<db>:<profile>
+ * naming it, or defaultProfile, the one for its role.
+ */
+DBProfile GetDBProfile(const std::string& strDB, DBProfile defaultProfile);
+
 /** Batch of changes queued to be written to a CDBWrapper */
 class CDBBatch
 {
@@ -164,6 +190,12 @@ private:
     //! the length of the obfuscate key in number of bytes
     static const unsigned int OBFUSCATE_KEY_NUM_BYTES;
 
+    //! the key under which a compressed database records that it is
+    static const std::string COMPRESSION_KEY;
+
+    //! whether the tables are compressed with Snappy
+    bool fCompressed;
+
     std::vector<unsigned char> CreateObfuscateKey() const;
 
 public:
@@ -174,8 +206,9 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] profile     How the LevelDB options are tuned, see DBProfile.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, DBProfile profile = DBPROFILE_DEFAULT);
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -263,6 +296,46 @@ public:
      */
     bool IsEmpty();
 
+    /**
+     * Return true if the tables of the database are compressed with Snappy.
+     */
+    bool IsCompressed() const { return fCompressed; }
+
+    /**
+     * The approximate size on disk of the keys from key_begin up to key_end.
+     */
+    template<typename K>
+    size_t EstimateSize(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        uint64_t size = 0;
+        leveldb::Range range(slKey1, slKey2);
+        pdb->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
+    /**
+     * Compact the keys from key_begin up to key_end into tables.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
+
     /**
      * Accessor for obfuscate_key.
      */
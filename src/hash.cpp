@@ -12,6 +12,14 @@
 
 #include "pubkey.h"
 
+#include <stdlib.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 
 inline uint32_t ROTL32(uint32_t x, int8_t r)
 {
@@ -86,3 +94,125 @@ void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char he
     num[3] = (nChild >>  0) & 0xFF;
     CHMAC_SHA512(chainCode.begin(), chainCode.size()).Write(&header, 1).Write(data, 32).Write(num, 4).Finalize(output);
 }
+
+namespace {
+
+/** Per-thread scratch memory for the Argon2d matrix */
+class CArgon2dArena
+{
+private:
+    static const size_t ALIGNMENT = 64;
+
+    uint8_t* pmemory;
+    size_t nCapacity;
+    bool fInUse;
+
+    static void FreeAligned(uint8_t* p)
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+public:
+    CArgon2dArena() : pmemory(NULL), nCapacity(0), fInUse(false) {}
+
+    ~CArgon2dArena()
+    {
+        FreeAligned(pmemory);
+    }
+
+    uint8_t* Acquire(size_t nSize)
+    {
+        if (fInUse)
+            return NULL;
+        if (nSize > nCapacity) {
+            FreeAligned(pmemory);
+            pmemory = NULL;
+            nCapacity = 0;
+#ifdef _WIN32
+            pmemory = (uint8_t*)_aligned_malloc(nSize, ALIGNMENT);
+#else
+            void* p = NULL;
+            if (posix_memalign(&p, ALIGNMENT, nSize) == 0)
+                pmemory = (uint8_t*)p;
+#endif
+            if (pmemory == NULL)
+                return NULL;
+            nCapacity = nSize;
+        }
+        fInUse = true;
+        return pmemory;
+    }
+
+    bool Release(uint8_t* p)
+    {
+        if (!fInUse || p != pmemory)
+            return false;
+        fInUse = false;
+        return true;
+    }
+};
+
+/** One arena per matrix that can be live at once, see hash_Argon2d_batch */
+thread_local CArgon2dArena argon2dArenas[ARGON2_BATCH_MAX];
+
+}
+
+int Argon2dThreadArenaAllocate(uint8_t **memory, size_t bytes_to_allocate)
+{
+    *memory = NULL;
+    for (unsigned int i = 0; i < ARGON2_BATCH_MAX && *memory == NULL; i++)
+        *memory = argon2dArenas[i].Acquire(bytes_to_allocate);
+    // Deeper nesting on the same thread falls back to the heap
+    if (*memory == NULL)
+        *memory = (uint8_t*)malloc(bytes_to_allocate);
+    return *memory == NULL ? ARGON2_MEMORY_ALLOCATION_ERROR : ARGON2_OK;
+}
+
+void Argon2dThreadArenaFree(uint8_t *memory, size_t bytes_to_allocate)
+{
+    for (unsigned int i = 0; i < ARGON2_BATCH_MAX; i++) {
+        if (argon2dArenas[i].Release(memory))
+            return;
+    }
+    free(memory);
+}
+
+void hash_Argon2d_batch(const unsigned char* pinput, size_t nCount, uint256* phashes)
+{
+    argon2_context contexts[ARGON2_BATCH_MAX];
+    while (nCount > 0) {
+        size_t nBatch = std::min<size_t>(nCount, ARGON2_BATCH_MAX);
+        for (size_t i = 0; i < nBatch; i++) {
+            // Phase 1 parameters, see Argon2d_Phase1_Hash
+            argon2_context& context = contexts[i];
+            context.out = phashes[i].begin();
+            context.outlen = (uint32_t)OUTPUT_BYTES;
+            context.pwd = (uint8_t *)(pinput + i * INPUT_BYTES);
+            context.pwdlen = (uint32_t)INPUT_BYTES;
+            context.salt = (uint8_t *)(pinput + i * INPUT_BYTES);
+            context.saltlen = (uint32_t)INPUT_BYTES;
+            context.secret = NULL;
+            context.secretlen = 0;
+            context.ad = NULL;
+            context.adlen = 0;
+            context.allocate_cbk = Argon2dThreadArenaAllocate;
+            context.free_cbk = Argon2dThreadArenaFree;
+            context.flags = DEFAULT_ARGON2_FLAG;
+            context.m_cost = 250;
+            context.lanes = 4;
+            context.threads = 1;
+            context.t_cost = 1;
+        }
+        if (argon2d_ctx_batch(contexts, nBatch) != ARGON2_OK) {
+            for (size_t i = 0; i < nBatch; i++)
+                phashes[i].SetNull();
+        }
+        pinput += nBatch * INPUT_BYTES;
+        phashes += nBatch;
+        nCount -= nBatch;
+    }
+}
@@ -235,6 +235,16 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 
+/**
+ * Argon2 allocator callbacks handing out this thread's reusable Argon2d
+ * matrices, up to ARGON2_BATCH_MAX of them live at once. The memory is
+ * aligned, grows to the largest matrix requested on the thread and is only
+ * returned to the system when the thread exits, so hashing does not cost a
+ * malloc/free pair per header.
+ */
+int Argon2dThreadArenaAllocate(uint8_t **memory, size_t bytes_to_allocate);
+void Argon2dThreadArenaFree(uint8_t *memory, size_t bytes_to_allocate);
+
     /* ----------- Zumy Hash ------------------------------------------------ */
     /// Argon2i, Argon2d, and Argon2id are parametrized by:
     /// A time cost, which defines the amount of computation realized and therefore the execution time, given in number of iterations
@@ -268,8 +278,8 @@ inline int Argon2d_Phase1_Hash(const void *in, void *out) {
     context.secretlen = 0;
     context.ad = NULL;
     context.adlen = 0;
-    context.allocate_cbk = NULL;
-    context.free_cbk = NULL;
+    context.allocate_cbk = Argon2dThreadArenaAllocate;
+    context.free_cbk = Argon2dThreadArenaFree;
     context.flags = DEFAULT_ARGON2_FLAG; // = ARGON2_DEFAULT_FLAGS
     // main configurable Argon2 hash parameters
     context.m_cost = 250; // Memory in KiB (~256KB)
@@ -317,8 +327,8 @@ inline int Argon2d_Phase2_Hash(const void *in, void *out) {
     context.secretlen = 0;
     context.ad = NULL;
     context.adlen = 0;
-    context.allocate_cbk = NULL;
-    context.free_cbk = NULL;
+    context.allocate_cbk = Argon2dThreadArenaAllocate;
+    context.free_cbk = Argon2dThreadArenaFree;
     context.flags = DEFAULT_ARGON2_FLAG; // = ARGON2_DEFAULT_FLAGS
     // main configurable Argon2 hash parameters
     context.m_cost = 250; // Memory in KiB (~250KB)
@@ -348,6 +358,13 @@ inline uint256 hash_Argon2d(const void* input, const unsigned int& hashPhase) {
     return hashResult;
 }
 
+/**
+ * Phase 1 Argon2d of nCount consecutive INPUT_BYTES long inputs, same results
+ * as hash_Argon2d(..., 1). Up to ARGON2_BATCH_MAX of them are hashed together
+ * to hide the latency of the data dependent memory reads of each one.
+ */
+void hash_Argon2d_batch(const unsigned char* pinput, size_t nCount, uint256* phashes);
+
 #ifdef __AVX2__
 
 inline uint256 hash_Argon2d_ctx(const void* input, void *Matrix, const unsigned int& hashPhase) {
@@ -595,12 +595,22 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  * this cannot be done from worker threads.
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
+{
+    WriteReply(nStatus, strReply.data(), strReply.size());
+}
+
+void HTTPRequest::WriteReply(int nStatus, const std::vector<unsigned char>& vchReply)
+{
+    WriteReply(nStatus, vchReply.data(), vchReply.size());
+}
+
+void HTTPRequest::WriteReply(int nStatus, const void* pReply, size_t nSize)
 {
     assert(!replySent && req);
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
-    evbuffer_add(evb, strReply.data(), strReply.size());
+    evbuffer_add(evb, pReply, nSize);
     HTTPEvent* ev = new HTTPEvent(eventBase, true,
         std::bind(evhttp_send_reply, req, nStatus, (const char*)NULL, (struct evbuffer *)NULL));
     ev->trigger(0);
@@ -11,6 +11,7 @@
 #include <string>
 #include <stdint.h>
 #include <functional>
+#include <vector>
 
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
@@ -60,6 +61,8 @@ private:
     struct evhttp_request* req;
     bool replySent;
 
+    void WriteReply(int nStatus, const void* pReply, size_t nSize);
+
 public:
     HTTPRequest(struct evhttp_request* req);
     ~HTTPRequest();
@@ -114,6 +117,9 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /** Write HTTP reply with a binary body, copied once into the output buffer. */
+    void WriteReply(int nStatus, const std::vector<unsigned char>& vchReply);
 };
 
 /** Event handler closure.
@@ -13,6 +13,7 @@
 
 #include "activemasternode.h"
 #include "addrman.h"
+#include "blockfilemap.h"
 #include "amount.h"
 #include "chain.h"
 #include "chainparams.h"
@@ -49,6 +50,7 @@
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
 #include "consensus/validation.h"
+#include "crypto/argon2d/argon2.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "wallet/db.h"
@@ -163,9 +165,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -258,6 +260,8 @@ void PrepareShutdown()
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete pheaderhashdb;
+        pheaderhashdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -368,6 +372,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the chainstate to disk from a separate thread, except on shutdown and when pruning (default: %u)"), DEFAULT_BACKGROUNDFLUSH));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), ZUMY_CONF_FILENAME));
@@ -378,7 +384,10 @@ std::string HelpMessage(HelpMessageMode mode)
 #endif
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
+    strUsage += HelpMessageOpt("-blockcachesize=<n>", strprintf(_("Keep up to <n> megabytes of recently used blocks in memory for serving them (0 to disable, default: %u)"), DEFAULT_BLOCK_CACHE_SIZE));
+    strUsage += HelpMessageOpt("-blockfilemaps=<n>", strprintf(_("Keep up to <n> finished block and undo files memory mapped for reading blocks (0 to disable, default: %u)"), DEFAULT_BLOCKFILE_MAPS));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbprofile=<db>:<profile>", _("Tune the LevelDB database <db> (chainstate, blockindex or blockhashes) for <profile>: default for point lookups, index for large iterated indexes, with tables compressed in new databases when built --with-snappy. Can be specified multiple times (default: index for blockindex, which holds the address, spent and timestamp indexes, default for the others)"));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
@@ -393,6 +402,7 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-verifyheaderhashes", strprintf(_("Recompute the proof of work hash of every stored block header on startup, reindex and block reads instead of trusting the block index and the header hash journal (default: %u)"), DEFAULT_VERIFYHEADERHASHES));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -526,6 +536,8 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-nodebug", "Turn off debugging messages, same as -debug=0");
     strUsage += HelpMessageOpt("-gen", strprintf(_("Generate coins (default: %u)"), DEFAULT_GENERATE));
     strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads for coin generation if enabled (-1 = all cores, default: %d)"), DEFAULT_GENERATE_THREADS));
+    strUsage += HelpMessageOpt("-genbatchsize=<n>", strprintf(_("Nonces each coin generation thread hashes together, 1 to %u (default: %u)"), ARGON2_BATCH_MAX, DEFAULT_GENBATCHSIZE));
+    strUsage += HelpMessageOpt("-genpincores", strprintf(_("Pin each coin generation thread to its own core (default: %u)"), DEFAULT_GENPINCORES));
     strUsage += HelpMessageOpt("-help-debug", _("Show all debugging options (usage: --help -help-debug)"));
     strUsage += HelpMessageOpt("-logips", strprintf(_("Include IP addresses in debug output (default: %u)"), DEFAULT_LOGIPS));
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), DEFAULT_LOGTIMESTAMPS));
@@ -579,6 +591,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-datacarrier", strprintf(_("Relay and mine data carrier transactions (default: %u)"), DEFAULT_ACCEPT_DATACARRIER));
     strUsage += HelpMessageOpt("-datacarriersize", strprintf(_("Maximum size of data in data carrier transactions we relay and mine (default: %u)"), MAX_OP_RETURN_RELAY));
     strUsage += HelpMessageOpt("-mempoolreplacement", strprintf(_("Enable transaction replacement in the memory pool (default: %u)"), DEFAULT_ENABLE_REPLACEMENT));
+    strUsage += HelpMessageOpt("-txprecheck", strprintf(_("Verify the scripts of relayed transactions on the script verification threads before locking the chain state to accept them (default: %u)"), DEFAULT_TXPRECHECK));
+    strUsage += HelpMessageOpt("-txbatchsize=<n>", strprintf(_("Validate relayed transactions on a separate thread in batches of up to <n>, taken from all peers in turn, 0 to validate each as it arrives (default: %u)"), DEFAULT_TX_INGEST_BATCH));
 
     strUsage += HelpMessageGroup(_("Block creation options:"));
     strUsage += HelpMessageOpt("-blockminsize=<n>", strprintf(_("Set minimum block size in bytes (default: %u)"), DEFAULT_BLOCK_MIN_SIZE));
@@ -785,6 +799,10 @@ bool InitSanityCheck(void)
     }
     if (!glibc_sanity_test() || !glibcxx_sanity_test())
         return false;
+    if (argon2_kernel_selftest(ARGON2_KERNEL_REF) != ARGON2_OK) {
+        InitError("Argon2d proof of work sanity check failure. Aborting.");
+        return false;
+    }
 
     return true;
 }
@@ -1052,6 +1070,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    fVerifyHeaderHashes = GetBoolArg("-verifyheaderhashes", DEFAULT_VERIFYHEADERHASHES);
+    fBackgroundFlush = GetBoolArg("-backgroundflush", DEFAULT_BACKGROUNDFLUSH);
+    blockfilemaps.SetMaxFiles(std::max(0, (int)GetArg("-blockfilemaps", DEFAULT_BLOCKFILE_MAPS)));
+    blockcache.SetMaxUsage((size_t)std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)) << 20);
 
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
@@ -1088,6 +1110,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
 #endif
 
+    BOOST_FOREACH(const std::string& strProfile, mapMultiArgs["-dbprofile"]) {
+        size_t nPos = strProfile.find(':');
+        std::string strDB = strProfile.substr(0, nPos);
+        DBProfile profile;
+        if (nPos == std::string::npos || (strDB != "chainstate" && strDB != "blockindex" && strDB != "blockhashes") ||
+            !ParseDBProfile(strProfile.substr(nPos + 1), profile))
+            return InitError(strprintf(_("Invalid -dbprofile=<db>:<profile>: '%s'"), strProfile));
+    }
+
     nConnectTimeout = GetArg("-timeout", DEFAULT_CONNECT_TIMEOUT);
     if (nConnectTimeout <= 0)
         nConnectTimeout = DEFAULT_CONNECT_TIMEOUT;
@@ -1193,6 +1224,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         boost::split(vstrReplacementModes, strReplacementModeList, boost::is_any_of(","));
         fEnableReplacement = (std::find(vstrReplacementModes.begin(), vstrReplacementModes.end(), "fee") != vstrReplacementModes.end());
     }
+    fTxPrecheck = GetBoolArg("-txprecheck", DEFAULT_TXPRECHECK);
+    nTxIngestBatch = (unsigned int)std::max((int64_t)0, GetArg("-txbatchsize", DEFAULT_TX_INGEST_BATCH));
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log, seed insecure_rand()
 
@@ -1204,6 +1237,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. Zumy is shutting down."));
 
+    // Pick the fastest Argon2d kernel that agrees with the reference one,
+    // before any thread starts hashing
+    argon2_select_kernel();
+
     std::string strDataDir = GetDataDir().string();
 #ifdef ENABLE_WALLET
     // Wallet file must be a plain filename without a directory
@@ -1244,11 +1281,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
+    LogPrintf("Using %s kernel for Argon2d\n", argon2_kernel2string(argon2_get_kernel()));
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCheckWorker);
     }
+    if (nTxIngestBatch)
+        threadGroup.create_thread(&ThreadTxIngest);
 
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
@@ -1484,12 +1526,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nHeaderHashDBCache = std::min(nTotalCache / 16, nMaxHeaderHashDBCache << 20);
+    nTotalCache -= nHeaderHashDBCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for header hash journal\n", nHeaderHashDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
@@ -1508,12 +1553,21 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete pheaderhashdb;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                // Not wiped on reindex, the journaled hashes are what makes it cheap
+                pheaderhashdb = new CHeaderHashDB(nHeaderHashDBCache);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                // If necessary, upgrade from the per-transaction coins format.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1521,11 +1575,24 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                         CleanupBlockRevFiles();
                 }
 
+                // A rebuilt chain state starts from genesis again, not from a UTXO snapshot
+                if (fReindexChainState) {
+                    pblocktree->EraseSnapshotBase();
+                    pblocktree->WriteFlag("txoutsetloading", false);
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
                 }
 
+                bool fSnapshotLoading = false;
+                pblocktree->ReadFlag("txoutsetloading", fSnapshotLoading);
+                if (fSnapshotLoading) {
+                    strLoadError = _("Loading a UTXO snapshot was interrupted. You need to rebuild the chain state using -reindex-chainstate");
+                    break;
+                }
+
                 // If the loaded chain has a wrong genesis, bail out immediately
                 // (we're likely using a testnet datadir, or the other way around).
                 if (!mapBlockIndex.empty() && mapBlockIndex.count(chainparams.GetConsensus().hashGenesisBlock) == 0)
@@ -1754,7 +1821,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             //We can't rescan beyond non-pruned blocks, stop and throw an error
             //this might happen if a user uses a old wallet within a pruned node
             // or if he ran -disablewallet for a longer time, then decided to re-enable
-            if (fPruneMode)
+            if (fPruneMode || pindexSnapshot)
             {
                 CBlockIndex *block = chainActive.Tip();
                 while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
@@ -1805,6 +1872,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 9: data directory maintenance
 
+    // a chain state loaded from a UTXO snapshot has no blocks below it to serve
+    if (pindexSnapshot) {
+        LogPrintf("Unsetting NODE_NETWORK, the chain state was loaded from a UTXO snapshot\n");
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
     // if pruning, unset the service bit and perform the initial blockstore prune
     // after any wallet rescanning has taken place.
     if (fPruneMode) {
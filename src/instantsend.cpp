@@ -533,10 +533,7 @@ bool CInstantSend::ResolveConflicts(const CTxLockCandidate& txLockCandidate)
     }
     // Not in block yet, make sure all its inputs are still unspent
     BOOST_FOREACH(const CTxIn& txin, txLockCandidate.txLockRequest.vin) {
-        CCoins coins;
-        if(!pcoinsTip->GetCoins(txin.prevout.hash, coins) ||
-           (unsigned int)txin.prevout.n>=coins.vout.size() ||
-           coins.vout[txin.prevout.n].IsNull()) {
+        if(!pcoinsTip->HaveCoin(txin.prevout)) {
             // Not in UTXO anymore? Either this lock or conflicting tx was mined while we were waiting for votes.
             // Reprocess tip to make sure tx for this lock was included.
             //
@@ -869,13 +866,11 @@ bool CTxLockRequest::IsValid(bool fRequireUnspent) const
 
     BOOST_FOREACH(const CTxIn& txin, vin) {
 
-        CCoins coins;
+        Coin coin;
         int nPrevoutHeight = 0;
         CAmount nValue = 0;
 
-        if(!pcoinsTip->GetCoins(txin.prevout.hash, coins) ||
-           (unsigned int)txin.prevout.n>=coins.vout.size() ||
-           coins.vout[txin.prevout.n].IsNull()) {
+        if(!pcoinsTip->GetCoin(txin.prevout, coin)) {
             LogPrint("instantsend", "CTxLockRequest::IsValid -- Failed to find UTXO %s\n", txin.prevout.ToStringShort());
             // Normally above sould be enough, but in case we are reprocessing this because of
             // a lot of legit orphan votes we should also check already spent outpoints.
@@ -895,8 +890,8 @@ bool CTxLockRequest::IsValid(bool fRequireUnspent) const
             nPrevoutHeight = mi->second->nHeight;
             nValue = txOutpointCreated.vout[txin.prevout.n].nValue;
         } else {
-            nPrevoutHeight = coins.nHeight;
-            nValue = coins.vout[txin.prevout.n].nValue;
+            nPrevoutHeight = coin.nHeight;
+            nValue = coin.out.nValue;
         }
 
 
@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockfilemap.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -35,10 +36,12 @@
 #include "script/standard.h"
 #include "tinyformat.h"
 #include "txdb.h"
+#include "txingest.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
+#include "utxosnapshot.h"
 #include "spork.h"
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
@@ -70,6 +73,7 @@ CCriticalSection cs_main;
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
+CBlockIndex *pindexSnapshot = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
@@ -87,10 +91,16 @@ bool fRequireStandard = true;
 unsigned int nBytesPerSigOp = DEFAULT_BYTES_PER_SIGOP;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+bool fVerifyHeaderHashes = DEFAULT_VERIFYHEADERHASHES;
+bool fBackgroundFlush = DEFAULT_BACKGROUNDFLUSH;
+CBlockFileMapCache blockfilemaps;
+CBlockCache blockcache;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
+bool fTxPrecheck = DEFAULT_TXPRECHECK;
+unsigned int nTxIngestBatch = 0;
 
 /** Fees smaller than this (in satoshis) are considered zero fee (for relaying, mining and transaction creation) */
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
@@ -547,7 +557,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 return;
             }
             if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
-                if (pindex->nChainTx)
+                // Blocks below a UTXO snapshot are in the active chain
+                // without ever having been processed
+                if (pindex->nChainTx || (pindexSnapshot && chainActive.Contains(pindex)))
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
@@ -623,6 +635,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CHeaderHashDB *pheaderhashdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -905,15 +918,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -969,7 +982,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
@@ -979,13 +992,10 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
 int GetUTXOHeight(const COutPoint& outpoint)
 {
     LOCK(cs_main);
-    CCoins coins;
-    if(!pcoinsTip->GetCoins(outpoint.hash, coins) ||
-       (unsigned int)outpoint.n>=coins.vout.size() ||
-       coins.vout[outpoint.n].IsNull()) {
+    Coin coin;
+    if(!pcoinsTip->GetCoin(outpoint, coin))
         return -1;
-    }
-    return coins.nHeight;
+    return coin.nHeight;
 }
 
 int GetInputAge(const CTxIn &txin)
@@ -997,11 +1007,10 @@ int GetInputAge(const CTxIn &txin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        const Coin& coin = view.AccessCoin(txin.prevout);
 
-        if (coins) {
-            if(coins->nHeight < 0) return 0;
-            return chainActive.Height() - coins->nHeight + 1;
+        if (!coin.IsSpent()) {
+            return chainActive.Height() - (int)coin.nHeight + 1;
         } else {
             return -1;
         }
@@ -1081,9 +1090,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1098,7 +1107,7 @@ std::string FormatStateMessage(const CValidationState &state)
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache, bool fDryRun)
+                              std::vector<COutPoint>& coins_to_uncache, bool fDryRun)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1218,31 +1227,26 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
-        }
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                coins_to_uncache.push_back(txin.prevout);
+            }
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
+                        return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+                    }
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -1281,8 +1285,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1389,20 +1393,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                 // Save these to avoid repeated lookups
                 setIterConflicting.insert(mi);
 
-                // If this entry is "dirty", then we don't have descendant
-                // state for this transaction, which means we probably have
-                // lots of in-mempool descendants.
-                // Don't allow replacements of dirty transactions, to ensure
-                // that we don't spend too much time walking descendants.
-                // This should be rare.
-                if (mi->IsDirty()) {
-                    return state.DoS(0,
-                            error("AcceptToMemoryPool: rejecting replacement %s; cannot replace tx %s with untracked descendants",
-                                hash.ToString(),
-                                mi->GetTx().GetHash().ToString()),
-                            REJECT_NONSTANDARD, "too many potential replacements");
-                }
-
                 // Don't allow the replacement to reduce the feerate of the
                 // mempool.
                 //
@@ -1533,7 +1523,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
         }
-        pool.RemoveStaged(allConflicting);
+        pool.RemoveStaged(allConflicting, false);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
@@ -1564,16 +1554,129 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, fDryRun);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, coins_to_uncache, fDryRun);
     if (!res || fDryRun) {
         if(!res) LogPrint("mempool", "%s: %s %s\n", __func__, tx.GetHash().ToString(), state.GetRejectReason());
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, coins_to_uncache)
+            pcoinsTip->Uncache(outpoint);
     }
     return res;
 }
 
+/**
+ * Workers shared by the header, prefetch, decode, block and transaction
+ * check queues. Those are only busy now and then, and mostly not while
+ * blocks are connected, so one pool of -par threads serves them all and
+ * leaves the script checks a pool of their own.
+ */
+static CCheckQueueWorkers checkworkers;
+
+void ThreadCheckWorker() {
+    RenameThread("zumy-checkwork");
+    checkworkers.Thread();
+}
+
+static CCheckQueue<CTxInputPrecheck> txprecheckqueue(128, &checkworkers);
+/** Callers prechecking at the same time (message handler, RPC) take turns on the queue */
+static CCriticalSection cs_txprecheckqueue;
+
+unsigned int PrecheckTransactions(const std::vector<const CTransaction*>& vtx)
+{
+    if (!fTxPrecheck)
+        return 0;
+
+    std::vector<const CTransaction*> vtxChecked;
+    vtxChecked.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction* ptx, vtx) {
+        CValidationState state;
+        std::string reason;
+        if (ptx->IsCoinBase() || !CheckTransaction(*ptx, state))
+            continue;
+        if (fRequireStandard && !IsStandardTx(*ptx, reason))
+            continue;
+        vtxChecked.push_back(ptx);
+    }
+    if (vtxChecked.empty())
+        return 0;
+
+    // Looking up the spent outputs is the only part that needs the locks.
+    // The policy checks AcceptToMemoryPool would reject a transaction on
+    // before it verifies any script are run on the looked up coins as well,
+    // so that scripts are only verified for what stands a chance. Coins read
+    // in here are dropped from the tip cache again, as AcceptToMemoryPool
+    // does for transactions it rejects, so that junk transactions cannot
+    // grow the cache.
+    std::vector<CTxInputPrecheck> vChecks;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        const int nHeight = chainActive.Height();
+        const CFeeRate mempoolMinFee = mempool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        const bool fRelayPriority = GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY);
+        BOOST_FOREACH(const CTransaction* ptx, vtxChecked) {
+            const CTransaction& tx = *ptx;
+            const uint256& hash = tx.GetHash();
+            if (mempool.exists(hash) || (recentRejects && recentRejects->contains(hash)))
+                continue;
+            CCoinsViewCache view(&viewMemPool);
+            bool fMissingInputs = false;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                bool fCached = pcoinsTip->HaveCoinInCache(txin.prevout);
+                bool fFound = view.HaveCoin(txin.prevout);
+                if (!fCached)
+                    pcoinsTip->Uncache(txin.prevout);
+                if (!fFound) {
+                    fMissingInputs = true;
+                    break;
+                }
+            }
+            // Missing inputs, an orphan for AcceptToMemoryPool to deal with
+            if (fMissingInputs)
+                continue;
+
+            if (fRequireStandard && !AreInputsStandard(tx, view))
+                continue;
+            unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+            if (nSigOps > MAX_STANDARD_TX_SIGOPS || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
+                continue;
+            CAmount nValueIn = view.GetValueIn(tx);
+            CAmount nValueOut = tx.GetValueOut();
+            if (nValueIn < nValueOut)
+                continue;
+            CAmount nModifiedFees = nValueIn - nValueOut;
+            double nPriorityDummy = 0;
+            mempool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
+            CAmount nMempoolRejectFee = mempoolMinFee.GetFee(nSize);
+            if (nMempoolRejectFee > 0 && nModifiedFees < nMempoolRejectFee)
+                continue;
+            if (fRelayPriority && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+                CAmount inChainInputValue;
+                if (!AllowFree(view.GetPriority(tx, nHeight + 1, inChainInputValue)))
+                    continue;
+            }
+
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                vChecks.push_back(CTxInputPrecheck(view.AccessCoin(tx.vin[i].prevout).out, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS));
+        }
+    }
+    unsigned int nChecks = vChecks.size();
+    if (vChecks.empty())
+        return 0;
+
+    TRY_LOCK(cs_txprecheckqueue, lockQueue);
+    if (!nScriptCheckThreads || vChecks.size() < 2 || !lockQueue) {
+        BOOST_FOREACH(CTxInputPrecheck& check, vChecks)
+            check();
+        return nChecks;
+    }
+    CCheckQueueControl<CTxInputPrecheck> control(&txprecheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+    return nChecks;
+}
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes)
 {
     if (!fTimestampIndex)
@@ -1623,6 +1726,18 @@ bool GetAddressUnspent(uint160 addressHash, int type,
     return true;
 }
 
+/**
+ * The mapping of the block or undo file pos is in. Only files that are no
+ * longer appended to are mapped, the last block file is read with stdio.
+ */
+static CMappedBlockFileRef MapDiskFile(const CDiskBlockPos& pos, const char* prefix)
+{
+    LOCK(cs_LastBlockFile);
+    if (pos.IsNull() || pos.nFile >= nLastBlockFile)
+        return CMappedBlockFileRef();
+    return blockfilemaps.Get(prefix, pos.nFile, GetBlockPosFilename(pos, prefix), pos.nPos);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1638,14 +1753,22 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fTxIndex) {
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
             try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
+                CMappedBlockFileRef mapped = MapDiskFile(postx, "blk");
+                if (mapped) {
+                    CSpanReader reader(mapped->begin() + postx.nPos, mapped->end(), SER_DISK, CLIENT_VERSION);
+                    reader >> header;
+                    reader.ignore(postx.nTxOffset);
+                    reader >> txOut;
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    file >> header;
+                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file >> txOut;
+                }
             } catch (const std::exception& e) {
                 return error("%s: Deserialize or I/O error - %s", __func__, e.what());
             }
@@ -1659,19 +1782,18 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
     }
 
     if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        CBlockRef pblock = ReadBlockFromDiskCached(pindexSlow, consensusParams);
+        if (pblock) {
+            BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1715,10 +1837,38 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+/**
+ * Seed the memoized hash of a header read back from our block files from the
+ * header hash journal. Returns false if the header has to be hashed.
+ */
+static bool ReadJournaledHeaderHash(const CBlockHeader& header)
+{
+    return pheaderhashdb && !fVerifyHeaderHashes && pheaderhashdb->ReadHeaderHash(header);
+}
+
+/** Journal the hash of a header whose proof of work was just verified */
+static void JournalHeaderHash(const CBlockHeader& header)
+{
+    if (pheaderhashdb && !pheaderhashdb->WriteHeaderHash(header))
+        LogPrintf("%s: failed to journal hash of block %s\n", __func__, header.GetHash().ToString());
+}
+
+static bool ReadBlockDataFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
+    CMappedBlockFileRef mapped = MapDiskFile(pos, "blk");
+    if (mapped) {
+        try {
+            CSpanReader reader(mapped->begin() + pos.nPos, mapped->end(), SER_DISK, CLIENT_VERSION);
+            reader >> block;
+            return true;
+        } catch (const std::exception&) {
+            // The file read below reports what is wrong
+            block.SetNull();
+        }
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1732,20 +1882,45 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockDataFromDisk(block, pos))
+        return false;
+
     // Check the header
+    bool fJournaled = ReadJournaledHeaderHash(block);
     if (!CheckProofOfWork(block.GetHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
+    if (!fJournaled)
+        JournalHeaderHash(block);
 
     return true;
 }
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    if (fVerifyHeaderHashes) {
+        if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+            return false;
+        if (block.GetHash() != pindex->GetBlockHash())
+            return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
+                    pindex->ToString(), pindex->GetBlockPos().ToString());
+        return true;
+    }
+
+    // The index entry was proof of work checked when its header was accepted.
+    // A block on disk whose header is byte for byte the indexed header has
+    // the indexed hash, so the memory hard hash does not need to be redone.
+    if (!ReadBlockDataFromDisk(block, pindex->GetBlockPos()))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
+    const CBlockHeader header = pindex->GetBlockHeader();
+    if (memcmp(UBEGIN(block.nVersion), UBEGIN(header.nVersion), CBlockHeader::HEADER_SIZE) != 0)
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): header doesn't match index for %s at %s",
                 pindex->ToString(), pindex->GetBlockPos().ToString());
+    block.SetCachedHash(pindex->GetBlockHash());
     return true;
 }
 
@@ -1754,6 +1929,72 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return ReadBlockFromDisk(block, pindex, Params().GetConsensus());
 }
 
+CBlockRef ReadBlockFromDiskCached(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    CBlockRef pblock = blockcache.Get(pindex->GetBlockHash());
+    if (pblock)
+        return pblock;
+    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblockRead, pindex, consensusParams))
+        return CBlockRef();
+    blockcache.Insert(pblockRead);
+    return pblockRead;
+}
+
+/** Read the index header in front of a block and the block's bytes */
+template <typename Stream>
+static bool ReadRawBlock(Stream& s, std::vector<unsigned char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CMessageHeader::MessageStartChars blk_start;
+    unsigned int nSize;
+    s >> FLATDATA(blk_start) >> nSize;
+    if (memcmp(blk_start, messageStart, MESSAGE_START_SIZE))
+        return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+    if (nSize < CBlockHeader::HEADER_SIZE || nSize > MAX_BLOCK_SIZE)
+        return error("%s: Bad block size %u at %s", __func__, nSize, pos.ToString());
+    vchBlock.resize(nSize);
+    s.read((char*)vchBlock.data(), nSize);
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // Step back to the index header written in front of the block
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("ReadRawBlockFromDisk: bad block position %s", pos.ToString());
+    pos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    try {
+        CMappedBlockFileRef mapped = MapDiskFile(pos, "blk");
+        if (mapped) {
+            CSpanReader reader(mapped->begin() + pos.nPos, mapped->end(), SER_DISK, CLIENT_VERSION);
+            if (!ReadRawBlock(reader, vchBlock, pos, messageStart))
+                return false;
+        } else {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadRawBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            if (!ReadRawBlock(filein, vchBlock, pos, messageStart))
+                return false;
+        }
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    // Same trust in the index as ReadBlockFromDisk(CBlock&, CBlockIndex*)
+    const CBlockHeader header = pindex->GetBlockHeader();
+    if (memcmp(vchBlock.data(), UBEGIN(header.nVersion), CBlockHeader::HEADER_SIZE) != 0)
+        return error("ReadRawBlockFromDisk: header doesn't match index for %s at %s",
+                pindex->ToString(), pindex->GetBlockPos().ToString());
+    if (fVerifyHeaderHashes && hash_Argon2d(vchBlock.data(), 1) != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk: hash doesn't match index for %s at %s",
+                pindex->ToString(), pindex->GetBlockPos().ToString());
+
+    return true;
+}
+
 CAmount GetPoWBlockPayment(const int& nHeight, CAmount nFees)
 {
     // TODO: The next version should use the nHeight parameter rather than chainActive.Height().
@@ -1999,32 +2240,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
-        // add outputs
-        inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
-    }
-    else {
-        // add outputs for coinbase tx
-        // In this case call the full ModifyCoins which will do a database
-        // lookup to be sure the coins do not already exist otherwise we do not
-        // know whether to mark them fresh or not.  We want the duplicate coinbases
-        // before BIP30 to still be properly overwritten.
-        inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
     }
+    // add outputs
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight)
@@ -2061,20 +2283,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2114,11 +2336,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2130,7 +2352,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2182,19 +2404,36 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenBlockFile failed", __func__);
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> blockundo;
-        filein >> hashChecksum;
+    bool fRead = false;
+    CMappedBlockFileRef mapped = MapDiskFile(pos, "rev");
+    if (mapped) {
+        try {
+            CSpanReader reader(mapped->begin() + pos.nPos, mapped->end(), SER_DISK, CLIENT_VERSION);
+            reader >> blockundo;
+            reader >> hashChecksum;
+            fRead = true;
+        } catch (const std::exception&) {
+            // Undo files of old block files still grow, the data may have
+            // been written after the file was mapped
+            blockundo = CBlockUndo();
+        }
     }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+
+    if (!fRead) {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+
+        // Read block
+        try {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -2228,38 +2467,58 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(const Coin& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+    if (view.HaveCoin(out)) fClean = false; // overwriting transaction output
+
+    Coin coin = undo;
+    if (coin.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            coin.nHeight = alternate.nHeight;
+            coin.fCoinBase = alternate.fCoinBase;
+        } else {
+            return error("%s: undo data adding output to missing transaction", __func__);
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(coin), !fClean);
 
     return fClean;
 }
 
+/**
+ * Store the UTXO set commitment after pindex. Commitments are a function of
+ * the chain alone, so they need not be written atomically with the
+ * chainstate. Those deeper than any reorganization we could still undo in
+ * prune mode are dropped.
+ */
+static bool WriteCoinsCommitment(const CBlockIndex* pindex, const CCoinsCommitment& commitment)
+{
+    if (!pblocktree->WriteCoinsCommitment(pindex->GetBlockHash(), commitment))
+        return false;
+    if (pindex->nHeight >= MIN_BLOCKS_TO_KEEP) {
+        const CBlockIndex* pindexOld = pindex->GetAncestor(pindex->nHeight - MIN_BLOCKS_TO_KEEP);
+        if (!pblocktree->EraseCoinsCommitment(pindexOld->GetBlockHash()))
+            return false;
+    }
+    return true;
+}
+
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, const bool fWriteNames)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -2283,6 +2542,12 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
+    // The commitment of the previous block is normally still around, derive
+    // it only when the chain of commitments was seeded at this block.
+    CCoinsCommitment commitment;
+    bool fCommitment = !pfClean && !pblocktree->HaveCoinsCommitment(pindex->pprev->GetBlockHash()) &&
+                       pblocktree->ReadCoinsCommitment(pindex->GetBlockHash(), commitment);
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
@@ -2321,21 +2586,18 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        bool is_coinbase = tx.IsCoinBase();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || is_coinbase != coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+                if (fCommitment && is_spent)
+                    commitment.RemoveCoin(out, coin);
+            }
         }
 
         // restore inputs
@@ -2345,9 +2607,11 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
+                const Coin &undo = txundo.vprevout[j];
                 if (!ApplyTxInUndo(undo, view, out))
                     fClean = false;
+                if (fCommitment && view.HaveCoin(out))
+                    commitment.AddCoin(out, view.AccessCoin(out));
 
                 const CTxIn input = tx.vin[j];
 
@@ -2357,7 +2621,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 }
 
                 if (fAddressIndex) {
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
+                    const CTxOut &prevout = view.AccessCoin(tx.vin[j].prevout).out;
                     if (prevout.scriptPubKey.IsPayToScriptHash()) {
                         std::vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
 
@@ -2365,7 +2629,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                         addressIndex.push_back(std::make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
 
                         // restore unspent index
-                        addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                        addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, view.AccessCoin(input.prevout).nHeight)));
 
 
                     } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
@@ -2375,7 +2639,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                         addressIndex.push_back(std::make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
 
                         // restore unspent index
-                        addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                        addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, view.AccessCoin(input.prevout).nHeight)));
 
                     } else {
                         continue;
@@ -2404,6 +2668,14 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         }
     }
 
+    if (fCommitment && fClean && !WriteCoinsCommitment(pindex->pprev, commitment))
+        return AbortNode(state, "Failed to write UTXO set commitment");
+
+    // The block leaves the active chain, along which alone old commitments
+    // are pruned. Connecting it again rolls its commitment forward anew.
+    if (!pfClean && fClean && !pblocktree->EraseCoinsCommitment(pindex->GetBlockHash()))
+        return AbortNode(state, "Failed to erase UTXO set commitment");
+
     return fClean;
 }
 
@@ -2413,6 +2685,11 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Reads past the end of a truncated file fault through a mapping. The
+    // last file is not mapped, unless a reindex went back to it.
+    if (fFinalize)
+        blockfilemaps.Erase(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -2439,6 +2716,110 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CHeaderPoWCheck> headercheckqueue(16, &checkworkers);
+/** Headers hashed in parallel before their continuity is checked */
+static const size_t HEADERS_POW_CHECK_CHUNK = 128;
+
+bool CHeaderPoWCheck::operator()() {
+    return CheckProofOfWork(pheader->GetHash(), pheader->nBits, *pparams);
+}
+
+static CCheckQueue<CCoinPrefetch> coinprefetchqueue(16, &checkworkers);
+
+static CCheckQueue<CBlockDecodeCheck> blockdecodequeue(1, &checkworkers);
+
+bool CCoinPrefetch::operator()() {
+    // A miss is not a failure: the input may be created by a block not
+    // connected yet, or the block may be invalid. ConnectBlock decides.
+    if (!pview->GetCoin(*poutpoint, *pcoin))
+        pcoin->Clear();
+    return true;
+}
+
+void PrefetchBlockCoins(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    // Outputs created by the block itself are never in the database
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+    std::vector<COutPoint> vOutpoints;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!setBlockTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+    if (vOutpoints.size() < 2)
+        return;
+
+    // pcoinsTip is not touched while the reads run, cs_main keeps everybody
+    // else out and the view below it is safe to read from several threads.
+    std::vector<Coin> vCoins(vOutpoints.size());
+    {
+        const CCoinsView& viewBase = *pcoinsTip->GetBackend();
+        CCheckQueueControl<CCoinPrefetch> control(&coinprefetchqueue);
+        std::vector<CCoinPrefetch> vChecks;
+        vChecks.reserve(vOutpoints.size());
+        for (unsigned int i = 0; i < vOutpoints.size(); i++)
+            vChecks.push_back(CCoinPrefetch(viewBase, vOutpoints[i], vCoins[i]));
+        control.Add(vChecks);
+        control.Wait();
+    }
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vOutpoints.size(); i++) {
+        if (vCoins[i].IsSpent())
+            continue;
+        pcoinsTip->CacheCoin(vOutpoints[i], std::move(vCoins[i]));
+        nFound++;
+    }
+    LogPrint("bench", "    - Prefetch %u/%u coins of block %s: %.2fms\n", nFound, (unsigned int)vOutpoints.size(), block.GetHash().ToString(), (GetTimeMicros() - nTimeStart) * 0.001);
+}
+
+size_t CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, const Consensus::Params& consensusParams)
+{
+    // A header's hashPrevBlock is the hash its predecessor claims to have,
+    // which has to meet the predecessor's target. That costs no hashing and
+    // bounds how far into the message hashing can be of any use.
+    size_t nLinked = headers.size();
+    for (size_t i = 1; i < headers.size(); i++) {
+        if (!CheckProofOfWork(headers[i].hashPrevBlock, headers[i - 1].nBits, consensusParams)) {
+            nLinked = i;
+            break;
+        }
+    }
+
+    // Hash a chunk at a time, and stop at the first header that does not
+    // connect to the one before it or fails its proof of work
+    size_t nValid = 0;
+    while (nValid < nLinked) {
+        size_t nEnd = std::min(nLinked, nValid + HEADERS_POW_CHECK_CHUNK);
+        if (nScriptCheckThreads && nEnd - nValid > 1) {
+            CCheckQueueControl<CHeaderPoWCheck> control(&headercheckqueue);
+            std::vector<CHeaderPoWCheck> vChecks;
+            vChecks.reserve(nEnd - nValid);
+            for (size_t i = nValid; i < nEnd; i++)
+                vChecks.push_back(CHeaderPoWCheck(headers[i], consensusParams));
+            control.Add(vChecks);
+            control.Wait();
+        }
+        for (; nValid < nEnd; nValid++) {
+            const CBlockHeader& header = headers[nValid];
+            if (nValid > 0 && header.hashPrevBlock != headers[nValid - 1].GetHash())
+                return nValid;
+            if (!CheckProofOfWork(header.GetHash(), header.nBits, consensusParams))
+                return nValid;
+        }
+    }
+    return nValid;
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2605,8 +2986,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            if (!WriteCoinsCommitment(pindex, CCoinsCommitment()))
+                return AbortNode(state, "Failed to write UTXO set commitment");
+        }
         return true;
     }
 
@@ -2650,10 +3034,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }*/
 
@@ -2711,7 +3096,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             // Which orphan pool entries must we evict?
@@ -2735,7 +3120,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 for (size_t j = 0; j < tx.vin.size(); j++) {
 
                     const CTxIn input = tx.vin[j];
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
+                    const CTxOut &prevout = view.AccessCoin(tx.vin[j].prevout).out;
                     uint160 hashBytes;
                     int addressType;
 
@@ -2920,6 +3305,25 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
             return AbortNode(state, "Failed to write timestamp index");
 
+    // Roll the UTXO set commitment forward, if there is one to start from
+    CCoinsCommitment commitment;
+    if (pblocktree->ReadCoinsCommitment(hashPrevBlock, commitment)) {
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTransaction &tx = block.vtx[i];
+            if (i > 0) {
+                const CTxUndo &txundo = blockundo.vtxundo[i-1];
+                for (unsigned int j = 0; j < tx.vin.size(); j++)
+                    commitment.RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+            }
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (!tx.vout[o].scriptPubKey.IsUnspendable())
+                    commitment.AddCoin(COutPoint(tx.GetHash(), o), Coin(tx.vout[o], pindex->nHeight, i == 0));
+            }
+        }
+        if (!WriteCoinsCommitment(pindex, commitment))
+            return AbortNode(state, "Failed to write UTXO set commitment");
+    }
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -3033,15 +3437,19 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Unless the caller needs it on disk now, or block files are about
+        // to be pruned away from under an older chainstate, let the coin
+        // database commit it while we go on validating.
+        bool fBackground = fBackgroundFlush && mode != FLUSH_STATE_ALWAYS && !fFlushForPrune;
+        if (!pcoinsTip->Flush(fBackground))
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
@@ -3134,9 +3542,10 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
     // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete, consensusParams))
+    CBlockRef pblock = ReadBlockFromDiskCached(pindexDelete, consensusParams);
+    if (!pblock)
         return AbortNode(state, "Failed to read block");
+    const CBlock& block = *pblock;
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
@@ -3192,11 +3601,15 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
-    CBlock block;
+    CBlockRef pblockRead;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
+        pblockRead = ReadBlockFromDiskCached(pindexNew, chainparams.GetConsensus());
+        if (!pblockRead)
             return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblock = pblockRead.get();
+        // Its coins were prefetched on arrival, if at all, and may have been
+        // flushed out of the cache since
+        PrefetchBlockCoins(*pblock);
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
@@ -3212,6 +3625,10 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(pindexNew->GetBlockHash());
+        // A new tip is what peers, RPC and ZMQ ask for next. Blocks read from
+        // disk above are cached already.
+        if (!pblockRead && blockcache.IsEnabled())
+            blockcache.Insert(std::make_shared<const CBlock>(*pblock));
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
@@ -3656,10 +4073,41 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
+/** Mark pindexNew, all of whose parents have had transactions, and any descendants waiting on it as candidates to connect. */
+static void LinkBlockTransactions(CBlockIndex *pindexNew)
+{
+    std::deque<CBlockIndex*> queue;
+    queue.push_back(pindexNew);
+
+    // Recursively process any descendant blocks that now may be eligible to be connected.
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        // The snapshot block's count came with the snapshot, its parents have none
+        if (pindex != pindexSnapshot)
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
     pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainTx = 0;
+    if (pindexNew != pindexSnapshot)
+        pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
@@ -3669,30 +4117,8 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
 
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
-        std::deque<CBlockIndex*> queue;
-        queue.push_back(pindexNew);
-
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex *pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            {
-                LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
-            }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
-            while (range.first != range.second) {
-                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
-                range.first++;
-                mapBlocksUnlinked.erase(it);
-            }
-        }
-    } else {
+        LinkBlockTransactions(pindexNew);
+    } else if (pindexNew != pindexSnapshot) {
         if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
             mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
         }
@@ -3799,6 +4225,115 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
+/** Transactions per CBlockTxCheck, a power of two so that every run is a subtree of the merkle tree */
+static const unsigned int BLOCK_CHECK_BATCH = 64;
+
+/**
+ * CheckBlock runs outside cs_main, for instance on a block from a peer while
+ * ConnectBlock has the script check queue busy with another block, and a
+ * check queue only has one controller at a time. So the block checks get a
+ * queue of their own instead of waiting for the script checks.
+ */
+static CCheckQueue<CBlockTxCheck> blockcheckqueue(1, &checkworkers);
+/** Blocks checked on several threads at once (peers, RPC, import) take turns on the queue */
+static CCriticalSection cs_blockcheckqueue;
+
+struct CBlockTxRange
+{
+    const CBlock* pblock;
+    unsigned int nBegin;
+    unsigned int nEnd;
+    bool fMerkle;
+    //! Height of the subtree of a full run. The last run of a block may be
+    //! short and is padded up to it, as the whole tree pads its right edge.
+    unsigned int nLevels;
+    uint256 hashRoot;
+    bool fMutated;
+    unsigned int nSigOps;
+    //! First transaction that failed CheckTransaction, nEnd if none did
+    unsigned int nFailed;
+    CValidationState state;
+
+    CBlockTxRange(const CBlock& blockIn, unsigned int nBeginIn, unsigned int nEndIn, bool fMerkleIn, unsigned int nLevelsIn = 0) :
+        pblock(&blockIn), nBegin(nBeginIn), nEnd(nEndIn), fMerkle(fMerkleIn), nLevels(nLevelsIn), fMutated(false), nSigOps(0), nFailed(nEndIn) {}
+};
+
+bool CBlockTxCheck::operator()() {
+    CBlockTxRange& range = *prange;
+    const std::vector<CTransaction>& vtx = range.pblock->vtx;
+    if (range.fMerkle) {
+        std::vector<uint256> leaves;
+        leaves.reserve(range.nEnd - range.nBegin);
+        for (unsigned int i = range.nBegin; i < range.nEnd; i++)
+            leaves.push_back(vtx[i].GetHash());
+        range.hashRoot = ComputeMerkleRoot(leaves, &range.fMutated);
+        unsigned int nHeight = 0;
+        while (((size_t)1 << nHeight) < leaves.size())
+            nHeight++;
+        for (; nHeight < range.nLevels; nHeight++)
+            CHash256().Write(range.hashRoot.begin(), 32).Write(range.hashRoot.begin(), 32).Finalize(range.hashRoot.begin());
+    }
+    for (unsigned int i = range.nBegin; i < range.nEnd; i++) {
+        if (!CheckTransaction(vtx[i], range.state)) {
+            range.nFailed = i;
+            break;
+        }
+        range.nSigOps += GetLegacySigOpCount(vtx[i]);
+    }
+    return true;
+}
+
+/**
+ * Run CBlockTxCheck over all transactions of a block, given as one run. A
+ * big block is split into runs of BLOCK_CHECK_BATCH spread over the block
+ * check threads, and the run results are combined into what the single run
+ * would have come out with.
+ */
+static void CheckBlockTransactions(CBlockTxRange& result)
+{
+    TRY_LOCK(cs_blockcheckqueue, lockQueue);
+    if (!nScriptCheckThreads || result.nEnd - result.nBegin <= BLOCK_CHECK_BATCH || !lockQueue) {
+        CBlockTxCheck check(result);
+        check();
+        return;
+    }
+
+    unsigned int nLevels = 0;
+    while ((1U << nLevels) < BLOCK_CHECK_BATCH)
+        nLevels++;
+    std::vector<CBlockTxRange> vRanges;
+    for (unsigned int nBegin = result.nBegin; nBegin < result.nEnd; nBegin += BLOCK_CHECK_BATCH)
+        vRanges.push_back(CBlockTxRange(*result.pblock, nBegin, std::min(nBegin + BLOCK_CHECK_BATCH, result.nEnd), result.fMerkle, nLevels));
+    {
+        CCheckQueueControl<CBlockTxCheck> control(&blockcheckqueue);
+        std::vector<CBlockTxCheck> vChecks;
+        vChecks.reserve(vRanges.size());
+        BOOST_FOREACH(CBlockTxRange& range, vRanges)
+            vChecks.push_back(CBlockTxCheck(range));
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    std::vector<uint256> vRoots;
+    vRoots.reserve(vRanges.size());
+    BOOST_FOREACH(const CBlockTxRange& range, vRanges) {
+        vRoots.push_back(range.hashRoot);
+        result.fMutated |= range.fMutated;
+        if (result.nFailed == result.nEnd) {
+            result.nSigOps += range.nSigOps;
+            if (range.nFailed < range.nEnd) {
+                result.nFailed = range.nFailed;
+                result.state = range.state;
+            }
+        }
+    }
+    if (result.fMerkle) {
+        bool fMutated;
+        result.hashRoot = ComputeMerkleRoot(vRoots, &fMutated);
+        result.fMutated |= fMutated;
+    }
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
@@ -3811,10 +4346,16 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
+    // The per transaction checks and the merkle tree of the txids are run up
+    // front, in parallel for a big block. Their results are reported below
+    // in the order the checks have always been made in.
+    CBlockTxRange txchecks(block, 0, block.vtx.size(), fCheckMerkleRoot);
+    CheckBlockTransactions(txchecks);
+
     // Check the merkle root.
     if (fCheckMerkleRoot) {
-        bool mutated;
-        uint256 hashMerkleRoot2 = BlockMerkleRoot(block, &mutated);
+        bool mutated = txchecks.fMutated;
+        const uint256& hashMerkleRoot2 = txchecks.hashRoot;
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock(): hashMerkleRoot mismatch"),
                              REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3879,18 +4420,14 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // END ZUMY
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock(): CheckTransaction of %s failed with %s",
-                tx.GetHash().ToString(),
-                FormatStateMessage(state));
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-    {
-        nSigOps += GetLegacySigOpCount(tx);
+    if (txchecks.nFailed < block.vtx.size()) {
+        state = txchecks.state;
+        return error("CheckBlock(): CheckTransaction of %s failed with %s",
+            block.vtx[txchecks.nFailed].GetHash().ToString(),
+            FormatStateMessage(state));
     }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
+
+    if (txchecks.nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops");
 
@@ -4083,11 +4620,16 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
             blockPos = *dbp;
         if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL))
             return error("AcceptBlock(): FindBlockPos failed");
-        if (dbp == NULL)
+        if (dbp == NULL) {
             if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
                 AbortNode(state, "Failed to write block");
+            JournalHeaderHash(block);
+        }
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
+        // Blocks that may become the tip will be connected soon
+        if (fHasMoreWork)
+            PrefetchBlockCoins(block);
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error: ") + e.what());
     }
@@ -4223,6 +4765,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockfilemaps.Erase(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4352,6 +4895,17 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
+    // A chain state loaded from a snapshot is linked from its block on
+    uint256 hashSnapshot;
+    uint64_t nSnapshotChainTx = 0;
+    if (pblocktree->ReadSnapshotBase(hashSnapshot, nSnapshotChainTx)) {
+        BlockMap::iterator mi = mapBlockIndex.find(hashSnapshot);
+        if (mi == mapBlockIndex.end())
+            return error("%s: UTXO snapshot block %s not in the block index", __func__, hashSnapshot.ToString());
+        pindexSnapshot = mi->second;
+        LogPrintf("%s: chain state loaded from a UTXO snapshot at height %d\n", __func__, pindexSnapshot->nHeight);
+    }
+
     // Calculate nChainWork
     std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -4367,7 +4921,9 @@ bool static LoadBlockIndexDB()
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
-        if (pindex->nTx > 0) {
+        if (pindex == pindexSnapshot) {
+            pindex->nChainTx = nSnapshotChainTx;
+        } else if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -4500,8 +5056,8 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
-        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
-            // If pruning, only go back as far as we have data.
+        if ((fPruneMode || pindexSnapshot) && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, or loaded from a snapshot, only go back as far as we have data.
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
@@ -4566,6 +5122,7 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexSnapshot = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
@@ -4573,6 +5130,8 @@ void UnloadBlockIndex()
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    blockfilemaps.Clear();
+    blockcache.Clear();
     nBlockSequenceId = 1;
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
@@ -4601,10 +5160,137 @@ bool LoadBlockIndex()
     return true;
 }
 
-bool InitBlockIndex(const CChainParams& chainparams)
+/** Erase every coin stored in view, without changing its best block */
+static bool EraseAllCoins(CCoinsView* view)
 {
-    LOCK(cs_main);
-
+    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    if (!pcursor)
+        return false;
+    CCoinsMap mapErase;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint outpoint;
+        if (!pcursor->GetKey(outpoint))
+            return false;
+        // A dirty spent entry erases the stored coin
+        mapErase[outpoint].flags = CCoinsCacheEntry::DIRTY;
+        if (mapErase.size() >= 100000 && !view->BatchWrite(mapErase, uint256()))
+            return false;
+    }
+    return view->BatchWrite(mapErase, uint256());
+}
+
+bool LoadUTXOSnapshot(CAutoFile& file, const CUTXOSnapshotHeader& header, const uint256& hashBlockExpected, const uint256& hashSetExpected, std::string& strError)
+{
+    const CChainParams& chainparams = Params();
+    long nCoinsPos = ftell(file.Get());
+
+    // The set hash covers the coins only, so a snapshot could otherwise be
+    // passed off as the state after any other block
+    if (header.hashBlock != hashBlockExpected) {
+        strError = "the snapshot is not of the expected block";
+        return false;
+    }
+    if (header.hashSet != hashSetExpected) {
+        strError = "the snapshot hash_set does not match the expected one";
+        return false;
+    }
+
+    // Read the whole file once before touching anything
+    {
+        CCoinsCommitment commitment;
+        if (!ReadUTXOSnapshot(file, header, commitment, NULL, 0, strError))
+            return false;
+    }
+    if (nCoinsPos < 0 || fseek(file.Get(), nCoinsPos, SEEK_SET) != 0) {
+        strError = "unable to rewind the snapshot file";
+        return false;
+    }
+
+    CValidationState state;
+    CBlockIndex* pindexBase = NULL;
+    {
+        LOCK(cs_main);
+        if (pindexSnapshot) {
+            strError = "the chain state was already loaded from a snapshot";
+            return false;
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            strError = "the snapshot block header is not known yet";
+            return false;
+        }
+        pindexBase = mi->second;
+        if (pindexBase->nStatus & BLOCK_FAILED_MASK) {
+            strError = "the snapshot block is invalid";
+            return false;
+        }
+        if (pindexBase->nHeight <= chainActive.Height() || pindexBase->GetAncestor(chainActive.Height()) != chainActive.Tip()) {
+            strError = "the snapshot block does not extend the active chain";
+            return false;
+        }
+        // Every block has a coinbase
+        if (header.nChainTx < (uint64_t)pindexBase->nHeight + 1) {
+            strError = "bad transaction count in the snapshot header";
+            return false;
+        }
+
+        // Empty the chain state. Until the snapshot is in, a crash leaves it
+        // inconsistent, which the flag tells the next start.
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+            strError = "unable to flush the chain state";
+            return false;
+        }
+        mempool.clear();
+        if (!pblocktree->WriteFlag("txoutsetloading", true)) {
+            strError = "unable to write the block index";
+            return false;
+        }
+        if (!EraseAllCoins(pcoinsTip->GetBackend())) {
+            strError = "unable to erase the chain state";
+            return AbortNode("Failed to erase the chain state");
+        }
+
+        LogPrintf("%s: loading %u coins at block %s\n", __func__, header.nCoins, header.hashBlock.ToString());
+        CCoinsCommitment commitment;
+        if (!ReadUTXOSnapshot(file, header, commitment, pcoinsTip, nCoinCacheUsage, strError))
+            return AbortNode(strprintf("Failed to load the UTXO snapshot: %s", strError), _("Loading the UTXO snapshot failed, the chain state must be rebuilt using -reindex-chainstate"));
+        pcoinsTip->SetBestBlock(header.hashBlock);
+
+        // Make the snapshot block the tip. It has no data, it is trusted for
+        // the set hash it was checked against.
+        pindexSnapshot = pindexBase;
+        pindexBase->nChainTx = header.nChainTx;
+        pindexBase->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindexBase);
+        chainActive.SetTip(pindexBase);
+        LinkBlockTransactions(pindexBase);
+        PruneBlockIndexCandidates();
+
+        // There are no blocks below it to serve
+        nLocalServices &= ~NODE_NETWORK;
+
+        if (!pblocktree->WriteSnapshotBase(header.hashBlock, header.nChainTx) || !WriteCoinsCommitment(pindexBase, commitment) ||
+            !FlushStateToDisk(state, FLUSH_STATE_ALWAYS) || !pblocktree->WriteFlag("txoutsetloading", false)) {
+            strError = "unable to write the loaded chain state";
+            return AbortNode("Failed to write the UTXO snapshot");
+        }
+        LogPrintf("%s: chain state loaded from UTXO snapshot at height %d\n", __func__, pindexBase->nHeight);
+    }
+
+    uiInterface.NotifyBlockTip(IsInitialBlockDownload(), pindexBase);
+    GetMainSignals().UpdatedBlockTip(pindexBase);
+    // Connect any blocks already there on top of it
+    if (!ActivateBestChain(state, chainparams)) {
+        strError = state.GetRejectReason();
+        return false;
+    }
+    return true;
+}
+
+bool InitBlockIndex(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
+
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
 
@@ -4654,31 +5340,123 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/**
+ * Bytes of blocks the importer reads before it hands them over as a batch.
+ * Batches of common blocks end at IMPORT_BATCH_BLOCKS well before this, it
+ * only cuts batches of big blocks short, and with them the rewind window.
+ */
+static const unsigned int IMPORT_BATCH_SIZE = MAX_BLOCK_SIZE;
+/** Most blocks in one import batch */
+static const unsigned int IMPORT_BATCH_BLOCKS = 256;
+/**
+ * How far back the reader can go in the file buffer. Blocks are copied out
+ * of the buffer when read, so only the batch being decoded may still send
+ * the reader back: its blocks up to IMPORT_BATCH_SIZE, the block that went
+ * over it and the message start and size in front of each.
+ */
+static const unsigned int IMPORT_REWIND_SIZE = IMPORT_BATCH_SIZE + MAX_BLOCK_SIZE + IMPORT_BATCH_BLOCKS * 8;
+/** Decoded batches the importer reads ahead of the blocks it accepts */
+static const unsigned int IMPORT_QUEUE_BATCHES = 2;
+
+/** A block found in a file being imported */
+struct CImportedBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    //! Where to scan on from if the block does not decode
+    uint64_t nRewind;
+    //! Position of the block data in the file
+    uint64_t nPos;
+    //! Size of the block data according to the file
+    unsigned int nSize;
+    CDataStream ssData;
+    CBlock block;
+    //! Bytes the block took up, 0 if it failed to deserialize
+    unsigned int nDecoded;
+    std::string strError;
+    bool fJournaled;
 
-    int nLoaded = 0;
+    CImportedBlock() : nRewind(0), nPos(0), nSize(0), ssData(SER_DISK, CLIENT_VERSION), nDecoded(0), fJournaled(false) {}
+};
+
+bool CBlockDecodeCheck::operator()() {
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        pimported->ssData >> pimported->block;
+        pimported->nDecoded = pimported->nSize - pimported->ssData.size();
+    } catch (const std::exception& e) {
+        pimported->nDecoded = 0;
+        pimported->strError = e.what();
+        return true;
+    }
+    // The block is all that is kept of it from here on
+    pimported->ssData = CDataStream(SER_DISK, CLIENT_VERSION);
+    pimported->fJournaled = ReadJournaledHeaderHash(pimported->block);
+    pimported->block.GetHash();
+    // A block that does not decode is not a failure of the batch, the
+    // reader scans the file again from where it was found
+    return true;
+}
+
+/**
+ * The reading and decoding stages of a block import. A thread scans the
+ * file for blocks and decodes them a batch at a time on the block decode
+ * threads, up to IMPORT_QUEUE_BATCHES ahead of the batches taken by Next().
+ */
+class CBlockFileReader
+{
+private:
+    CBufferedFile blkdat;
+    const CMessageHeader::MessageStartChars& messageStart;
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<std::vector<CImportedBlock> > queueBatches;
+    bool fDone;
+    bool fStop;
+    std::string strError;
+    boost::thread thread;
+
+    void Decode(std::vector<CImportedBlock>& vBatch)
+    {
+        if (!nScriptCheckThreads || vBatch.size() < 2) {
+            BOOST_FOREACH(CImportedBlock& imported, vBatch) {
+                CBlockDecodeCheck check(imported);
+                check();
+            }
+            return;
+        }
+        // Being interrupted while waiting for the decode threads would leave
+        // the queue busy, the batch is finished first
+        boost::this_thread::disable_interruption di;
+        CCheckQueueControl<CBlockDecodeCheck> control(&blockdecodequeue);
+        std::vector<CBlockDecodeCheck> vChecks;
+        vChecks.reserve(vBatch.size());
+        BOOST_FOREACH(CImportedBlock& imported, vBatch)
+            vChecks.push_back(CBlockDecodeCheck(imported));
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    /** Read blocks from nRewind on into vBatch until the batch is full. Returns false at the end of the file. */
+    bool ReadBatch(std::vector<CImportedBlock>& vBatch, uint64_t& nRewind)
+    {
+        uint64_t nBatchSize = 0;
+        vBatch.reserve(IMPORT_BATCH_BLOCKS);
+        while (vBatch.size() < IMPORT_BATCH_BLOCKS && nBatchSize < IMPORT_BATCH_SIZE) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
+            // Reading ahead may have gone past the rewind window of the buffer
+            if (!blkdat.SetPos(nRewind) && !blkdat.Seek(nRewind))
+                LogPrintf("%s: cannot go back to position %u, skipping ahead\n", __func__, nRewind);
+            if (blkdat.eof())
+                return false;
+            nRewind = blkdat.GetPos() + 1; // start one byte further next time, in case of failure
             unsigned int nSize = 0;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
+                blkdat.FindByte(messageStart[0]);
                 nRewind = blkdat.GetPos()+1;
                 blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                if (memcmp(buf, messageStart, MESSAGE_START_SIZE))
                     continue;
                 // read size
                 blkdat >> nSize;
@@ -4686,18 +5464,132 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
             } catch (const std::exception&) {
                 // no valid block header found; don't complain
-                break;
+                return false;
             }
+            vBatch.push_back(CImportedBlock());
+            CImportedBlock& imported = vBatch.back();
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
+                imported.nRewind = nRewind;
+                imported.nPos = blkdat.GetPos();
+                imported.nSize = nSize;
+                imported.ssData.resize(nSize);
+                blkdat.read(&imported.ssData[0], nSize);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                vBatch.pop_back();
+                continue;
+            }
+            nRewind = blkdat.GetPos();
+            nBatchSize += nSize;
+        }
+        return true;
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("zumy-loadread");
+        try {
+            uint64_t nRewind = blkdat.GetPos();
+            bool fMore = true;
+            while (fMore) {
+                std::vector<CImportedBlock> vBatch;
+                fMore = ReadBatch(vBatch, nRewind);
+                Decode(vBatch);
+
+                // Blocks after one that did not decode the way it was read
+                // are dropped and the file is scanned again from there
+                for (unsigned int i = 0; i < vBatch.size(); i++) {
+                    const CImportedBlock& imported = vBatch[i];
+                    if (imported.nDecoded == imported.nSize)
+                        continue;
+                    if (imported.nDecoded == 0) {
+                        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, imported.strError);
+                        nRewind = imported.nRewind;
+                    } else {
+                        // Shorter than its size says, carry on right after it
+                        nRewind = imported.nPos + imported.nDecoded;
+                        i++;
+                    }
+                    vBatch.resize(i);
+                    fMore = true;
+                    break;
+                }
+
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (queueBatches.size() >= IMPORT_QUEUE_BATCHES && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                queueBatches.push_back(std::vector<CImportedBlock>());
+                queueBatches.back().swap(vBatch);
+                cond.notify_all();
+            }
+        } catch (const boost::thread_interrupted&) {
+            return;
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(cs);
+            strError = e.what();
+        }
+        boost::unique_lock<boost::mutex> lock(cs);
+        fDone = true;
+        cond.notify_all();
+    }
+
+public:
+    //! Takes over fileIn and calls fclose() on it when done
+    CBlockFileReader(FILE* fileIn, const CMessageHeader::MessageStartChars& messageStartIn) :
+        blkdat(fileIn, IMPORT_REWIND_SIZE + MAX_BLOCK_SIZE + 8, IMPORT_REWIND_SIZE, SER_DISK, CLIENT_VERSION),
+        messageStart(messageStartIn), fDone(false), fStop(false)
+    {
+        thread = boost::thread(boost::bind(&CBlockFileReader::ThreadRead, this));
+    }
+
+    ~CBlockFileReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+            cond.notify_all();
+        }
+        thread.interrupt();
+        thread.join();
+    }
+
+    /** Take the next batch of decoded blocks, in file order. Returns false when the file is done. */
+    bool Next(std::vector<CImportedBlock>& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (queueBatches.empty() && !fDone)
+            cond.wait(lock);
+        if (queueBatches.empty()) {
+            if (!strError.empty())
+                throw std::runtime_error(strError);
+            return false;
+        }
+        vBatch.swap(queueBatches.front());
+        queueBatches.pop_front();
+        cond.notify_all();
+        return true;
+    }
+};
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        CBlockFileReader reader(fileIn, chainparams.MessageStart());
+        std::vector<CImportedBlock> vBatch;
+        bool fAbort = false;
+        while (!fAbort && reader.Next(vBatch)) {
+            BOOST_FOREACH(CImportedBlock& imported, vBatch) {
+                boost::this_thread::interruption_point();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    dbp->nPos = imported.nPos;
+                CBlock& block = imported.block;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
@@ -4713,10 +5605,15 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     LOCK(cs_main);
                     CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp))
+                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp)) {
                         nLoaded++;
-                    if (state.IsError())
+                        if (!imported.fJournaled)
+                            JournalHeaderHash(block);
+                    }
+                    if (state.IsError()) {
+                        fAbort = true;
                         break;
+                    }
                 } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
                     LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
                 }
@@ -4725,6 +5622,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 if (hash == chainparams.GetConsensus().hashGenesisBlock) {
                     CValidationState state;
                     if (!ActivateBestChain(state, chainparams)) {
+                        fAbort = true;
                         break;
                     }
                 }
@@ -4740,15 +5638,16 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
                         std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+                        CBlock blockChild;
+                        if (ReadBlockFromDisk(blockChild, it->second, chainparams.GetConsensus()))
                         {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
                                     head.ToString());
                             CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second))
+                            if (AcceptBlock(blockChild, dummy, chainparams, NULL, true, &it->second))
                             {
                                 nLoaded++;
-                                queue.push_back(block.GetHash());
+                                queue.push_back(blockChild.GetHash());
                             }
                         }
                         range.first++;
@@ -4756,8 +5655,6 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                         NotifyHeaderTip();
                     }
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
     } catch (const std::runtime_error& e) {
@@ -4774,6 +5671,12 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
         return;
     }
 
+    // Blocks below a UTXO snapshot were never processed, which the checks
+    // below take for an unlinked chain.
+    if (pindexSnapshot) {
+        return;
+    }
+
     LOCK(cs_main);
 
     // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
@@ -5046,10 +5949,13 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
+            // Only the coins cache is consulted: a per-outpoint database
+            // lookup for every announced txid would be far too expensive.
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
 
     case MSG_BLOCK:
@@ -5158,13 +6064,26 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    CBlockRef pblockCached;
+                    if (inv.type == MSG_BLOCK && (pblockCached = blockcache.Get(inv.hash)))
+                    {
+                        pfrom->PushMessage(NetMsgType::BLOCK, *pblockCached);
+                    }
+                    else if (inv.type == MSG_BLOCK)
+                    {
+                        // Full blocks go out as stored, without a round
+                        // trip through CBlock
+                        std::vector<unsigned char> vchBlock;
+                        if (!ReadRawBlockFromDisk(vchBlock, (*mi).second, Params().MessageStart()))
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData(vchBlock));
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlockRef pblock = ReadBlockFromDiskCached((*mi).second, consensusParams);
+                        if (!pblock)
+                            assert(!"cannot load block from disk");
+                        const CBlock& block = *pblock;
                         bool sendMerkleBlock = false;
                         CMerkleBlock merkleBlock;
                         {
@@ -5398,6 +6317,222 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+namespace {
+
+CTxIngestQueue txingestqueue(MAX_TX_INGEST_QUEUE_BYTES_PER_PEER);
+
+/**
+ * Validate a batch of relayed transactions. The scripts of all of them are
+ * prechecked together, then they go to AcceptToMemoryPool under a single
+ * cs_main. The orphans waiting on anything the batch accepted are resolved
+ * in one pass at the end, and everything accepted is announced together.
+ */
+void ProcessTxBatch(std::vector<CTxIngestEntry>& vBatch, const CPrivatesendBroadcastTx* ppstx = NULL)
+{
+    std::vector<const CTransaction*> vtx;
+    vtx.reserve(vBatch.size());
+    BOOST_FOREACH(const CTxIngestEntry& entry, vBatch)
+        vtx.push_back(entry.tx.get());
+    PrecheckTransactions(vtx);
+
+    LOCK(cs_main);
+
+    std::deque<COutPoint> vWorkQueue;
+    std::vector<uint256> vEraseQueue;
+    std::vector<CTransaction> vRelay;
+    CValidationState state;
+
+    BOOST_FOREACH(CTxIngestEntry& entry, vBatch) {
+        CNode* pfrom = entry.pfrom;
+        const std::string& strCommand = entry.strCommand;
+        const CTransaction& tx = *entry.tx;
+        int nInvType = strCommand == NetMsgType::TXLOCKREQUEST ? MSG_TXLOCK_REQUEST :
+                       (strCommand == NetMsgType::PSTX ? MSG_PSTX : MSG_TX);
+        CInv inv(nInvType, tx.GetHash());
+
+        bool fMissingInputs = false;
+        state = CValidationState();
+
+        // The ingestion thread asks peers for orphan parents, so the peer's
+        // requests are only touched under cs_main
+        pfrom->setAskFor.erase(inv.hash);
+        mapAlreadyAskedFor.erase(inv.hash);
+
+        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        {
+            // Process custom txes, this changes AlreadyHave to "true"
+            if (strCommand == NetMsgType::PSTX) {
+                LogPrintf("PSTX -- Masternode transaction accepted, txid=%s, peer=%d\n",
+                        tx.GetHash().ToString(), pfrom->id);
+                assert(ppstx);
+                mapPrivatesendBroadcastTxes.insert(std::make_pair(tx.GetHash(), *ppstx));
+            } else if (strCommand == NetMsgType::TXLOCKREQUEST) {
+                LogPrintf("TXLOCKREQUEST -- Transaction Lock Request accepted, txid=%s, peer=%d\n",
+                        tx.GetHash().ToString(), pfrom->id);
+                instantsend.AcceptLockRequest(static_cast<const CTxLockRequest&>(tx));
+            }
+
+            mempool.check(pcoinsTip);
+            vRelay.push_back(tx);
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                vWorkQueue.emplace_back(inv.hash, i);
+            }
+
+            LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
+                pfrom->id,
+                tx.GetHash().ToString(),
+                mempool.size(), mempool.ZumyMemoryUsage() / 1000);
+        }
+        else if (fMissingInputs)
+        {
+            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (recentRejects->contains(txin.prevout.hash)) {
+                    fRejectedParents = true;
+                    break;
+                }
+            }
+            if (!fRejectedParents) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    CInv inv(MSG_TX, txin.prevout.hash);
+                    pfrom->AddInventoryKnown(inv);
+                    if (!AlreadyHave(inv)) pfrom->AskFor(inv);
+                }
+                AddOrphanTx(tx, pfrom->GetId());
+
+                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                if (nEvicted > 0)
+                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+            } else {
+                LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
+            }
+        } else {
+            assert(recentRejects);
+            recentRejects->insert(tx.GetHash());
+
+            if (strCommand == NetMsgType::TXLOCKREQUEST && !AlreadyHave(inv)) {
+                // i.e. AcceptToMemoryPool failed, probably because it's conflicting
+                // with existing normal tx or tx lock for another tx. For the same tx lock
+                // AlreadyHave would have return "true" already.
+                // It's the first time we failed for this tx lock request,
+                // this should switch AlreadyHave to "true".
+                instantsend.RejectLockRequest(static_cast<const CTxLockRequest&>(tx));
+                // this lets other nodes to create lock request candidate i.e.
+                // this allows multiple conflicting lock requests to compete for votes
+                vRelay.push_back(tx);
+            }
+
+            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they were already in the mempool or rejected from it due
+                // to policy, allowing the node to function as a gateway for
+                // nodes hidden behind it.
+                //
+                // Never relay transactions that we would assign a non-zero DoS
+                // score for, as we expect peers to do the same with us in that
+                // case.
+                int nDoS = 0;
+                if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                    vRelay.push_back(tx);
+                } else {
+                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, FormatStateMessage(state));
+                }
+            }
+        }
+
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS))
+        {
+            LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
+                pfrom->id,
+                FormatStateMessage(state));
+            if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
+                pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+
+    // Recursively process any orphan transactions that depended on the accepted ones
+    std::set<NodeId> setMisbehaving;
+    while (!vWorkQueue.empty()) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+        vWorkQueue.pop_front();
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin();
+             mi != itByPrev->second.end();
+             ++mi)
+        {
+            const CTransaction& orphanTx = (*mi)->second.tx;
+            const uint256& orphanHash = orphanTx.GetHash();
+            NodeId fromPeer = (*mi)->second.fromPeer;
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+
+            if (setMisbehaving.count(fromPeer))
+                continue;
+            if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+            {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                vRelay.push_back(orphanTx);
+                for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
+                    vWorkQueue.emplace_back(orphanHash, i);
+                }
+                vEraseQueue.push_back(orphanHash);
+            }
+            else if (!fMissingInputs2)
+            {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                vEraseQueue.push_back(orphanHash);
+                assert(recentRejects);
+                recentRejects->insert(orphanHash);
+            }
+            mempool.check(pcoinsTip);
+        }
+    }
+
+    BOOST_FOREACH(uint256 hash, vEraseQueue)
+        EraseOrphanTx(hash);
+
+    RelayTransactions(vRelay);
+    FlushStateToDisk(state, FLUSH_STATE_PERIODIC);
+}
+
+}
+
+void ThreadTxIngest()
+{
+    RenameThread("zumy-txingest");
+    std::vector<CTxIngestEntry> vBatch;
+    while (true) {
+        txingestqueue.TakeBatch(vBatch, nTxIngestBatch);
+        ProcessTxBatch(vBatch);
+        BOOST_FOREACH(CTxIngestEntry& entry, vBatch)
+            entry.pfrom->Release();
+        vBatch.clear();
+        boost::this_thread::interruption_point();
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5866,8 +7001,6 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             return true;
         }
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransaction tx;
         CTxLockRequest txLockRequest;
         CPrivatesendBroadcastTx pstx;
@@ -5888,7 +7021,6 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 
         CInv inv(nInvType, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
-        pfrom->setAskFor.erase(inv.hash);
 
         // Process custom logic, no matter if tx will be accepted to mempool later or not
         if (strCommand == NetMsgType::TXLOCKREQUEST) {
@@ -5928,166 +7060,36 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             pmn->fAllowMixingTx = false;
         }
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        mapAlreadyAskedFor.erase(inv.hash);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
-        {
-            // Process custom txes, this changes AlreadyHave to "true"
-            if (strCommand == NetMsgType::PSTX) {
-                LogPrintf("PSTX -- Masternode transaction accepted, txid=%s, peer=%d\n",
-                        tx.GetHash().ToString(), pfrom->id);
-                mapPrivatesendBroadcastTxes.insert(std::make_pair(tx.GetHash(), pstx));
-            } else if (strCommand == NetMsgType::TXLOCKREQUEST) {
-                LogPrintf("TXLOCKREQUEST -- Transaction Lock Request accepted, txid=%s, peer=%d\n",
-                        tx.GetHash().ToString(), pfrom->id);
-                instantsend.AcceptLockRequest(txLockRequest);
-            }
-
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
-                pfrom->id,
-                tx.GetHash().ToString(),
-                mempool.size(), mempool.ZumyMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
-            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
-                }
-            }
-            if (!fRejectedParents) {
-                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                    CInv inv(MSG_TX, txin.prevout.hash);
-                    pfrom->AddInventoryKnown(inv);
-                    if (!AlreadyHave(inv)) pfrom->AskFor(inv);
-                }
-                AddOrphanTx(tx, pfrom->GetId());
-
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-            } else {
-                LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
-            }
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (strCommand == NetMsgType::TXLOCKREQUEST && !AlreadyHave(inv)) {
-                // i.e. AcceptToMemoryPool failed, probably because it's conflicting
-                // with existing normal tx or tx lock for another tx. For the same tx lock
-                // AlreadyHave would have return "true" already.
-                // It's the first time we failed for this tx lock request,
-                // this should switch AlreadyHave to "true".
-                instantsend.RejectLockRequest(txLockRequest);
-                // this lets other nodes to create lock request candidate i.e.
-                // this allows multiple conflicting lock requests to compete for votes
-                RelayTransaction(tx);
-            }
+        std::shared_ptr<const CTransaction> ptx;
+        if (strCommand == NetMsgType::TXLOCKREQUEST)
+            ptx = std::make_shared<const CTxLockRequest>(txLockRequest);
+        else
+            ptx = std::make_shared<const CTransaction>(tx);
+        CTxIngestEntry entry(pfrom, strCommand, ptx);
 
-            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, FormatStateMessage(state));
-                }
-            }
+        // PrivateSend transactions are few and wanted in the pool right away
+        if (nTxIngestBatch == 0 || strCommand == NetMsgType::PSTX) {
+            std::vector<CTxIngestEntry> vBatch(1, entry);
+            ProcessTxBatch(vBatch, &pstx);
+            return true;
         }
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
+        // Drop what is already queued or known before it takes a place in the
+        // queue. Whitelisted peers may have what we already have relayed
+        // again, see ProcessTxBatch. A lock request for a transaction we have
+        // still goes through, to be rejected there.
+        bool fForceRelay = pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY);
+        if (!fForceRelay && strCommand == NetMsgType::TX && txingestqueue.Contains(inv.hash))
+            return true;
         {
-            LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
-                pfrom->id,
-                FormatStateMessage(state));
-            if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
-                pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            LOCK(cs_main);
+            pfrom->setAskFor.erase(inv.hash);
+            mapAlreadyAskedFor.erase(inv.hash);
+            if (!fForceRelay && AlreadyHave(inv))
+                return true;
         }
-        FlushStateToDisk(state, FLUSH_STATE_PERIODIC);
+        if (!txingestqueue.Push(entry))
+            LogPrint("net", "too many transactions queued from peer=%d, dropping %s\n", pfrom->id, inv.hash.ToString());
     }
 
 
@@ -6113,6 +7115,25 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             return true;
         }
 
+        // Hash the message in parallel before taking cs_main, as far as it
+        // connects. The hashes stay cached in the headers, so
+        // AcceptBlockHeader below only does the index lookups and contextual
+        // checks. Whatever follows the first header that does not connect or
+        // fails its proof of work is dropped unhashed; the headers before it
+        // are still accepted below and the peer is scored for that one there.
+        bool fConnects;
+        {
+            LOCK(cs_main);
+            fConnects = mapBlockIndex.count(headers[0].hashPrevBlock) > 0;
+        }
+        if (fConnects) {
+            size_t nValid = CheckHeadersProofOfWork(headers, chainparams.GetConsensus());
+            if (nValid < headers.size()) {
+                LogPrint("net", "headers message from peer=%d breaks off after %u of %u headers\n", pfrom->id, nValid, headers.size());
+                headers.resize(nValid + 1);
+            }
+        }
+
         // If we already know the last header in the message, then it contains
         // no new information for us.  In this case, we do not request
         // more headers later.  This prevents multiple chains of redundant
@@ -6576,6 +7597,11 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Leave the rest unread while the peer's transactions wait for
+        // validation, its socket is not read from once this backs up
+        if (nTxIngestBatch && txingestqueue.IsFull(pfrom->GetId()))
+            break;
+
         // get next message
         CNetMessage& msg = *it;
 
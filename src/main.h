@@ -13,6 +13,7 @@
 #endif
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "coins.h"
 #include "net.h"
@@ -31,13 +32,17 @@
 #include <utility>
 #include <vector>
 
+class CAutoFile;
 class CBloomFilter;
+class CBlockFileMapCache;
 class CBlockIndex;
 class CBlockTreeDB;
+class CHeaderHashDB;
 class CChainParams;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
+class CUTXOSnapshotHeader;
 class CValidationInterface;
 class CValidationState;
 
@@ -121,6 +126,14 @@ static const bool DEFAULT_RELAYPRIORITY = true;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const unsigned int DEFAULT_BYTES_PER_SIGOP = 20;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+/** Default for -verifyheaderhashes, rehash headers instead of trusting the header hash journal */
+static const bool DEFAULT_VERIFYHEADERHASHES = false;
+/** Default for -backgroundflush, write the chainstate from a separate thread */
+static const bool DEFAULT_BACKGROUNDFLUSH = true;
+/** Default for -blockfilemaps, block and undo files kept mapped (none on 32 bit systems, for the address space) */
+static const int DEFAULT_BLOCKFILE_MAPS = sizeof(void*) >= 8 ? 64 : 0;
+/** Default for -blockcachesize, memory for recently used blocks in megabytes */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 32;
 static const bool DEFAULT_TXINDEX = true;
 static const bool DEFAULT_ADDRESSINDEX = false;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
@@ -130,6 +143,12 @@ static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 static const bool DEFAULT_TESTSAFEMODE = false;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = false;
+/** Default for -txprecheck */
+static const bool DEFAULT_TXPRECHECK = false;
+/** Default for -txbatchsize, the number of relayed transactions validated under one cs_main */
+static const unsigned int DEFAULT_TX_INGEST_BATCH = 100;
+/** Bytes of relayed transactions a peer can have waiting for validation before no more of its messages are read */
+static const unsigned int MAX_TX_INGEST_QUEUE_BYTES_PER_PEER = 2000000;
 
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 12;
@@ -163,15 +182,27 @@ extern bool fRequireStandard;
 extern unsigned int nBytesPerSigOp;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+extern bool fVerifyHeaderHashes;
+extern bool fBackgroundFlush;
+/** Read-only mappings of the block and undo files that are no longer appended to */
+extern CBlockFileMapCache blockfilemaps;
+/** Recently used and connected blocks */
+extern CBlockCache blockcache;
 extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fEnableReplacement;
+/** Verify the scripts of incoming transactions before AcceptToMemoryPool takes cs_main */
+extern bool fTxPrecheck;
+/** Relayed transactions validated per batch by the ingestion thread, 0 to validate them as they arrive */
+extern unsigned int nTxIngestBatch;
 
 extern std::map<uint256, int64_t> mapRejectedBlocks;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
+/** Block the chain state was loaded at from a UTXO snapshot, NULL if it was built from genesis. We have no data below it. */
+extern CBlockIndex *pindexSnapshot;
 
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
@@ -221,12 +252,25 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
-/** Import blocks from an external file */
+/**
+ * Import blocks from an external file. A reader thread scans the file and
+ * hands batches of blocks to the block decode threads, which deserialize
+ * them and compute their proof-of-work hashes, while the calling thread
+ * accepts the previous batch in file order.
+ */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/**
+ * Replace the chain state with the coins of a UTXO snapshot file positioned
+ * right after header, and make its block the tip. The block's header must be
+ * known and descend from the current tip. The snapshot must be of
+ * hashBlockExpected with set hash hashSetExpected; that, every chunk and the
+ * set hash of the coins are checked before the chain state is touched.
+ */
+bool LoadUTXOSnapshot(CAutoFile& file, const CUTXOSnapshotHeader& header, const uint256& hashBlockExpected, const uint256& hashSetExpected, std::string& strError);
 /** Unload database information */
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
@@ -239,6 +283,42 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Run an instance of the thread shared by the header proof-of-work, coin
+ * prefetch, block import decoding, block transaction and transaction
+ * precheck queues
+ */
+void ThreadCheckWorker();
+/**
+ * Run the transaction ingestion thread. It takes the transactions queued by
+ * the message handler a batch at a time, one from each peer in turn, and
+ * validates, relays and resolves the orphans of each batch together.
+ */
+void ThreadTxIngest();
+/**
+ * With -txprecheck, run the context-free checks and verify the input scripts
+ * of transactions about to go to AcceptToMemoryPool, on the precheck threads
+ * and without holding cs_main during the verification. Signatures that check
+ * out land in the signature cache, so the following AcceptToMemoryPool only
+ * has the serial part left: the conflict and ancestor checks and the
+ * insertion. Transactions AcceptToMemoryPool would turn down before
+ * verifying their scripts (nonstandard, too many sigops, too low a fee or
+ * priority) are not verified. Nothing is decided here; transactions that
+ * fail, are already known or have missing inputs are left for
+ * AcceptToMemoryPool to handle. Returns the number of input scripts
+ * verified. Must be called without cs_main held.
+ */
+unsigned int PrecheckTransactions(const std::vector<const CTransaction*>& vtx);
+/**
+ * Compute and check the proof of work of a batch of headers, spread over the
+ * header checking threads (or inline when -par disables them), and check that
+ * every header connects to the one before it. Returns the number of leading
+ * headers that pass; the headers after the first one failing are not hashed.
+ * The hashes are left in the headers' hash caches, so validating the same
+ * header objects afterwards does not run Argon2d again. Does not require
+ * cs_main.
+ */
+size_t CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, const Consensus::Params& consensusParams);
 
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
@@ -702,8 +782,8 @@ private:
 
 public:
     CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+        scriptPubKey(outIn.scriptPubKey),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
 
     bool operator()();
@@ -720,6 +800,129 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure verifying one input script of a transaction ahead of
+ * AcceptToMemoryPool. Failures are not reported, so that one bad transaction
+ * does not stop the checks of the others in the same batch.
+ */
+class CTxInputPrecheck
+{
+private:
+    CScriptCheck check;
+
+public:
+    CTxInputPrecheck() {}
+    CTxInputPrecheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn) :
+        check(outIn, txToIn, nInIn, nFlagsIn, true) { }
+
+    bool operator()() { check(); return true; }
+
+    void swap(CTxInputPrecheck &other) {
+        check.swap(other.check);
+    }
+};
+
+/**
+ * Closure representing the context-free proof-of-work check of one header.
+ * The header is only touched by the thread running the check.
+ */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader *pheader;
+    const Consensus::Params *pparams;
+
+public:
+    CHeaderPoWCheck(): pheader(NULL), pparams(NULL) {}
+    CHeaderPoWCheck(const CBlockHeader& headerIn, const Consensus::Params& paramsIn) :
+        pheader(&headerIn), pparams(&paramsIn) { }
+
+    bool operator()();
+
+    void swap(CHeaderPoWCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pparams, check.pparams);
+    }
+};
+
+/**
+ * Closure reading the coin of one block input from the view below the tip
+ * cache. The outpoint and coin slot are only touched by the thread running
+ * the read.
+ */
+class CCoinPrefetch
+{
+private:
+    const CCoinsView *pview;
+    const COutPoint *poutpoint;
+    Coin *pcoin;
+
+public:
+    CCoinPrefetch(): pview(NULL), poutpoint(NULL), pcoin(NULL) {}
+    CCoinPrefetch(const CCoinsView& viewIn, const COutPoint& outpointIn, Coin& coinIn) :
+        pview(&viewIn), poutpoint(&outpointIn), pcoin(&coinIn) { }
+
+    bool operator()();
+
+    void swap(CCoinPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(poutpoint, check.poutpoint);
+        std::swap(pcoin, check.pcoin);
+    }
+};
+
+struct CImportedBlock;
+
+/**
+ * Closure deserializing one block read by the block importer and computing
+ * its hash. The block is only touched by the thread running the check.
+ */
+class CBlockDecodeCheck
+{
+private:
+    CImportedBlock *pimported;
+
+public:
+    CBlockDecodeCheck(): pimported(NULL) {}
+    CBlockDecodeCheck(CImportedBlock& importedIn) : pimported(&importedIn) { }
+
+    bool operator()();
+
+    void swap(CBlockDecodeCheck &check) {
+        std::swap(pimported, check.pimported);
+    }
+};
+
+struct CBlockTxRange;
+
+/**
+ * Closure running the context-free checks of a run of transactions of a
+ * block: CheckTransaction, the legacy sigop count and the merkle subtree of
+ * their txids. The run is only touched by the thread running the check.
+ */
+class CBlockTxCheck
+{
+private:
+    CBlockTxRange *prange;
+
+public:
+    CBlockTxCheck(): prange(NULL) {}
+    CBlockTxCheck(CBlockTxRange& rangeIn) : prange(&rangeIn) { }
+
+    bool operator()();
+
+    void swap(CBlockTxCheck &check) {
+        std::swap(prange, check.prange);
+    }
+};
+
+/**
+ * Warm pcoinsTip with the coins block spends, reading those it does not
+ * have from the coin database on the script check threads, so connecting
+ * the block finds them in memory. Does nothing without -par threads.
+ */
+void PrefetchBlockCoins(const CBlock& block);
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(uint160 addressHash, int type,
@@ -731,8 +934,25 @@ bool GetAddressUnspent(uint160 addressHash, int type,
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
+/**
+ * Read the block of an index entry. Unless -verifyheaderhashes is set, the
+ * header read is compared with the indexed one and takes the indexed hash
+ * rather than being hashed again.
+ */
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/**
+ * The block of an index entry from the decoded block cache, read from disk
+ * as by ReadBlockFromDisk and cached on a miss. NULL if it cannot be read.
+ * The block is shared, it must not be changed.
+ */
+CBlockRef ReadBlockFromDiskCached(const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/**
+ * Read the serialized block of an index entry as stored, without
+ * deserializing it. The header bytes are checked against the index like
+ * ReadBlockFromDisk(CBlock&, CBlockIndex*) does.
+ */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -841,6 +1061,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the header hash journal */
+extern CHeaderHashDB *pheaderhashdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -181,10 +181,7 @@ void CMasternode::Check(bool fForce)
         TRY_LOCK(cs_main, lockMain);
         if(!lockMain) return;
 
-        CCoins coins;
-        if(!pcoinsTip->GetCoins(vin.prevout.hash, coins) ||
-           (unsigned int)vin.prevout.n>=coins.vout.size() ||
-           coins.vout[vin.prevout.n].IsNull()) {
+        if(!pcoinsTip->HaveCoin(vin.prevout)) {
             nActiveState = MASTERNODE_OUTPOINT_SPENT;
             LogPrint("Masternode", "CMasternode::Check -- Failed to find Masternode UTXO, Masternode=%s\n", vin.prevout.ToStringShort());
             return;
@@ -379,13 +376,13 @@ void CMasternode::UpdateLastPaid(const CBlockIndex *pindex, int nMaxBlocksToScan
         if(mnpayments.mapMasternodeBlocks.count(BlockReading->nHeight) &&
             mnpayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2))
         {
-            CBlock block;
-            if(!ReadBlockFromDisk(block, BlockReading, Params().GetConsensus())) // shouldn't really happen
+            CBlockRef pblock = ReadBlockFromDiskCached(BlockReading, Params().GetConsensus());
+            if (!pblock) // shouldn't really happen
                 continue;
 
             CAmount nMasternodePayment = GetMasternodePayment();
 
-            BOOST_FOREACH(CTxOut txout, block.vtx[0].vout)
+            BOOST_FOREACH(const CTxOut& txout, pblock->vtx[0].vout)
                 if(mnpayee == txout.scriptPubKey && nMasternodePayment == txout.nValue) {
                     nBlockLastPaid = BlockReading->nHeight;
                     nTimeLastPaid = BlockReading->nTime;
@@ -627,20 +624,18 @@ bool CMasternodeBroadcast::CheckOutpoint(int& nDos)
             return false;
         }
 
-        CCoins coins;
-        if(!pcoinsTip->GetCoins(vin.prevout.hash, coins) ||
-           (unsigned int)vin.prevout.n>=coins.vout.size() ||
-           coins.vout[vin.prevout.n].IsNull()) {
+        Coin coin;
+        if(!pcoinsTip->GetCoin(vin.prevout, coin)) {
             LogPrint("Masternode", "CMasternodeBroadcast::CheckOutpoint -- Failed to find Masternode UTXO, Masternode=%s\n", vin.prevout.ToStringShort());
             return false;
         }
 
-        if(coins.vout[vin.prevout.n].nValue != 2000 * COIN) {
+        if(coin.out.nValue != 2000 * COIN) {
             LogPrint("Masternode", "CMasternodeBroadcast::CheckOutpoint -- Masternode UTXO should have 2000 ZMY, Masternode=%s\n", vin.prevout.ToStringShort());
             return false;
         }
 
-        if(chainActive.Height() - coins.nHeight + 1 < Params().GetConsensus().nMasternodeMinimumConfirmations) {
+        if(chainActive.Height() - (int)coin.nHeight + 1 < Params().GetConsensus().nMasternodeMinimumConfirmations) {
             LogPrintf("CMasternodeBroadcast::CheckOutpoint -- Masternode UTXO must have at least %d confirmations, Masternode=%s\n",
                     Params().GetConsensus().nMasternodeMinimumConfirmations, vin.prevout.ToStringShort());
             // maybe we miss few blocks, let this mnb to be checked again later
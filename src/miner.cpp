@@ -30,11 +30,14 @@
 #include "validationinterface.h"
 #include "wallet/wallet.h"
 
+#include <algorithm>
+#include <limits>
 #include <queue>
 #include <utility>
 
 #include <openssl/sha.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -94,16 +97,7 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
-class ScoreCompare
-{
-public:
-    ScoreCompare() {}
-
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
-    {
-        return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
-    }
-};
+CBlockTemplateCache blocktemplatecache;
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
@@ -198,243 +192,719 @@ bool CheckWork(const CChainParams& chainparams, CBlock* pblock, CWallet& wallet,
     return true;
 }
 
-std::unique_ptr<CBlockTemplate> CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
+    : chainparams(_chainparams)
 {
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return nullptr;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to between 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    // Collect memory pool transactions into the block
-    CTxMemPool::setEntries inBlock;
-    CTxMemPool::setEntries waitSet;
+    fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+}
 
-    // This vector will be sorted into a priority queue:
-    std::vector<TxCoinAgePriority> vecPriority;
-    TxCoinAgePriorityCompare pricomparer;
-    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
-    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
-    double actualPriority = -1;
+void BlockAssembler::resetBlock()
+{
+    inBlock.clear();
+
+    // Reserve space for coinbase tx
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+
+    // These counters do not include coinbase tx
+    nBlockTx = 0;
+    nFees = 0;
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::SelectTransactions(int nHeightIn, int64_t nLockTimeCutoffIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    resetBlock();
+
+    pblocktemplate.reset(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return nullptr;
+    pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.push_back(CTransaction());
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+
+    nHeight = nHeightIn;
+    nLockTimeCutoff = nLockTimeCutoffIn;
+
+    addPriorityTxs();
+    addPackageTxs();
+
+    pblocktemplate->nBlockSize = nBlockSize;
+    pblocktemplate->nBlockSigOps = nBlockSigOps;
+    return std::move(pblocktemplate);
+}
+
+int64_t BlockAssembler::GetLockTimeCutoff(const CBlockIndex* pindexPrev, int64_t nTime)
+{
+    return (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+           ? pindexPrev->GetMedianTimePast()
+           : nTime;
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const int64_t nTime = GetAdjustedTime();
+
+    pblocktemplate = SelectTransactions(pindexPrev->nHeight + 1, GetLockTimeCutoff(pindexPrev, nTime));
+    if(!pblocktemplate.get())
+        return nullptr;
+    pblock = &pblocktemplate->block; // pointer for convenience
+
+    pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (chainparams.MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+    pblock->nTime = nTime;
+
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
 
-    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
-    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
-    uint64_t nBlockSize = 1000;
-    uint64_t nBlockTx = 0;
-    unsigned int nBlockSigOps = 100;
-    int lastFewTxs = 0;
-    CAmount nFees = 0;
+    CAmount blockReward = GetPoWBlockPayment(nHeight, nFees);
 
+    // Compute regular coinbase transaction.
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = blockReward;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    // Update coinbase transaction with additional info about masternode and governance payments,
+    // get some info back to pass to getblocktemplate
+    FillBlockPayments(txNew, nHeight, blockReward, pblock->txoutMasternode, pblock->voutSuperblock);
+    // LogPrintf("CreateNewBlock -- nBlockHeight %d blockReward %lld txoutMasternode %s txNew %s",
+    //             nHeight, blockReward, pblock->txoutMasternode.ToString(), txNew.ToString());
+
+    // Update block coinbase
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+    pblock->nNonce         = 0;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    }
+
+    return std::move(pblocktemplate);
+}
+
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-
-        // Add our coinbase tx as first transaction
-        pblock->vtx.push_back(txNew);
-        pblocktemplate->vTxFees.push_back(-1); // updated at end
-        pblocktemplate->vTxSigOps.push_back(-1); // updated at end
-        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
-        // -regtest only: allow overriding block.nVersion with
-        // -blockversion=N to test forking scenarios
-        if (chainparams.MineBlocksOnDemand())
-            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
-
-        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                ? nMedianTimePast
-                                : pblock->GetBlockTime();
-
-
-        bool fPriorityBlock = nBlockPrioritySize > 0;
-        if (fPriorityBlock) {
-            vecPriority.reserve(mempool.mapTx.size());
-            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                 mi != mempool.mapTx.end(); ++mi)
-            {
-                double dPriority = mi->GetPriority(nHeight);
-                CAmount dummy;
-                mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
-                vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
-            }
-            std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        if (!inBlock.count(parent)) {
+            return true;
         }
+    }
+    return false;
+}
 
-        CTxMemPool::indexed_transaction_set::nth_index<3>::type::iterator mi = mempool.mapTx.get<3>().begin();
-        CTxMemPool::txiter iter;
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit)) {
+            testSet.erase(iit++);
+        }
+        else {
+            iit++;
+        }
+    }
+}
 
-        while (mi != mempool.mapTx.get<3>().end() || !clearedTxs.empty())
-        {
-            bool priorityTx = false;
-            if (fPriorityBlock && !vecPriority.empty()) { // add a tx from priority queue to fill the blockprioritysize
-                priorityTx = true;
-                iter = vecPriority.front().second;
-                actualPriority = vecPriority.front().first;
-                std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                vecPriority.pop_back();
-            }
-            else if (clearedTxs.empty()) { // add tx with next highest score
-                iter = mempool.mapTx.project<0>(mi);
-                mi++;
-            }
-            else {  // try to add a previously postponed child tx
-                iter = clearedTxs.top();
-                clearedTxs.pop();
-            }
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps)
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+    return true;
+}
+
+bool BlockAssembler::TestPackageFinality(const CTxMemPool::setEntries& package)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            return false;
+    }
+    return true;
+}
 
-            if (inBlock.count(iter))
-                continue; // could have been added to the priorityBlock
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize) {
+        // If the block is so close to full that no more txs will fit
+        // or if we've tried more than 50 times to fill remaining space
+        // then flag that the block is finished
+        if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
+             blockFinished = true;
+             return false;
+        }
+        // Once we're within 1000 bytes of a full block, only look at 50 more txs
+        // to try to fill the remaining space.
+        if (nBlockSize > nBlockMaxSize - 1000) {
+            lastFewTxs++;
+        }
+        return false;
+    }
 
-            const CTransaction& tx = iter->GetTx();
+    if (nBlockSigOps + iter->GetSigOpCount() >= MAX_BLOCK_SIGOPS) {
+        // If the block has room for no more sig ops then
+        // flag that the block is finished
+        if (nBlockSigOps > MAX_BLOCK_SIGOPS - 2) {
+            blockFinished = true;
+            return false;
+        }
+        // Otherwise attempt to find another tx with fewer sigops
+        // to put in the block.
+        return false;
+    }
 
-            bool fOrphan = false;
-            BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
-            {
-                if (!inBlock.count(parent)) {
-                    fOrphan = true;
-                    break;
-                }
-            }
-            if (fOrphan) {
-                if (priorityTx)
-                    waitPriMap.insert(std::make_pair(iter,actualPriority));
-                else
-                    waitSet.insert(iter);
+    // Must check that lock times are still valid
+    // This can be removed once MTP is always enforced
+    // as long as reorgs keep the mempool consistent.
+    if (!IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff))
+        return false;
+
+    return true;
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    pblock->vtx.push_back(iter->GetTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+                  dPriority,
+                  CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+                  iter->GetTx().GetHash().ToString());
+    }
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set &mapModifiedTx)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
                 continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
             }
+        }
+    }
+}
 
-            unsigned int nTxSize = iter->GetTxSize();
-            if (fPriorityBlock &&
-                (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(actualPriority))) {
-                fPriorityBlock = false;
-                waitPriMap.clear();
-            }
-            if (!priorityTx &&
-                (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize) && nBlockSize >= nBlockMinSize)) {
-                break;
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block)
+// Also skip transactions that we've already failed to add. This can happen if
+// we consider a transaction in mapModifiedTx and it fails: we can then
+// potentially consider it again while walking mapTx.  It's currently
+// guaranteed to fail again, but as a belt-and-suspenders check we put it in
+// failedTx and avoid re-evaluation, since the re-evaluation would be using
+// cached size/sigops/fee values that are not actually correct.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
+{
+    assert (it != mempool.mapTx.end());
+    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+        return true;
+    return false;
+}
+
+void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    // Sort package by ancestor count
+    // If a transaction A depends on transaction B, then A's ancestor count
+    // must be greater than B's.  So this is sufficient to validly order the
+    // transactions for block inclusion.
+    sortedEntries.clear();
+    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+}
+
+// This transaction selection algorithm orders the mempool based
+// on feerate of a transaction including all unconfirmed ancestors.
+// Since we don't remove transactions from the mempool as we select them
+// for block inclusion, we need an alternate method of updating the feerate
+// of a transaction with its not-yet-selected ancestors as we go.
+// This is accomplished by walking the in-mempool descendants of selected
+// transactions and storing a temporary modified state in mapModifiedTxs.
+// Each time through the loop, we compare the best transaction in
+// mapModifiedTxs with the next transaction in the mempool to decide what
+// transaction package to work on next.
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator mi = mempool.mapTx.get<4>().begin();
+    CTxMemPool::txiter iter;
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (mi != mempool.mapTx.get<4>().end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<4>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<1>().begin();
+        if (mi == mempool.mapTx.get<4>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<1>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
             }
-            if (nBlockSize + nTxSize >= nBlockMaxSize) {
-                if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
-                    break;
-                }
-                // Once we're within 1000 bytes of a full block, only look at 50 more txs
-                // to try to fill the remaining space.
-                if (nBlockSize > nBlockMaxSize - 1000) {
-                    lastFewTxs++;
-                }
-                continue;
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        if (!TestPackage(packageSize, packageSigOps)) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
             }
 
-            if (!IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
+            ++nConsecutiveFailed;
 
-            unsigned int nTxSigOps = iter->GetSigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
-                if (nBlockSigOps > MAX_BLOCK_SIGOPS - 2) {
-                    break;
-                }
-                continue;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
             }
+            continue;
+        }
 
-            CAmount nTxFees = iter->GetFee();
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                double dPriority = iter->GetPriority(nHeight);
-                CAmount dummy;
-                mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                          dPriority , CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        onlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
+
+        // Test if all tx's are Final
+        if (!TestPackageFinality(ancestors)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
             }
+            continue;
+        }
+
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
+        // Package can be added. Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, sortedEntries);
+
+        for (size_t i=0; i<sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
 
-            inBlock.insert(iter);
+void BlockAssembler::addPriorityTxs()
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    if (nBlockPrioritySize == 0) {
+        return;
+    }
 
-            // Add transactions that depend on this one to the priority queue
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    CTxMemPool::txiter iter;
+    lastFewTxs = 0;
+    blockFinished = false;
+    while (!vecPriority.empty() && !blockFinished) { // add a tx from priority queue to fill the blockprioritysize
+        iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx already in block, skip
+        if (inBlock.count(iter)) {
+            assert(false); // shouldn't happen for priority txs
+            continue;
+        }
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // If this tx fits in the block add it, otherwise keep looping
+        if (TestForBlock(iter)) {
+            AddToBlock(iter);
+
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority)) {
+                break;
+            }
+
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
             BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
             {
-                if (fPriorityBlock) {
-                    waitPriIter wpiter = waitPriMap.find(child);
-                    if (wpiter != waitPriMap.end()) {
-                        vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
-                        std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                        waitPriMap.erase(wpiter);
-                    }
-                }
-                else {
-                    if (waitSet.count(child)) {
-                        clearedTxs.push(child);
-                        waitSet.erase(child);
-                    }
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
                 }
             }
         }
+    }
+}
+
+void BlockAssembler::UpdateCoinbaseValue(CAmount nFeesPrev)
+{
+    // The payees do not depend on the fees, only the miner's own output does
+    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    txCoinbase.vout[0].nValue += GetPoWBlockPayment(nHeight, nFees) - GetPoWBlockPayment(nHeight, nFeesPrev);
+    pblock->vtx[0] = txCoinbase;
+    pblocktemplate->vTxFees[0] = -nFees;
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::UpdateTransactions(const CBlockTemplate& prev, const CBlockIndex* pindexPrev)
+{
+    LOCK2(cs_main, mempool.cs);
+    const int64_t nTime = GetAdjustedTime();
+
+    pblocktemplate = SelectTransactions(pindexPrev->nHeight + 1, GetLockTimeCutoff(pindexPrev, nTime));
+    if(!pblocktemplate.get())
+        return nullptr;
+    pblock = &pblocktemplate->block; // pointer for convenience
+
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrint("miner", "UpdateTransactions(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
+
+    // Same coinbase and payees
+    pblock->vtx[0] = prev.block.vtx[0];
+    pblock->txoutMasternode = prev.block.txoutMasternode;
+    pblock->voutSuperblock = prev.block.voutSuperblock;
+    pblocktemplate->vTxSigOps[0] = prev.vTxSigOps[0];
+    UpdateCoinbaseValue(-prev.vTxFees[0]);
+
+    pblock->nVersion       = prev.block.nVersion;
+    pblock->hashPrevBlock  = prev.block.hashPrevBlock;
+    pblock->nTime          = prev.block.nTime;
+    pblock->nBits          = prev.block.nBits;
+    pblock->nNonce         = 0;
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+
+    return std::move(pblocktemplate);
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::AppendTransactions(const CBlockTemplate& prev, const CBlockIndex* pindexPrev, const std::vector<uint256>& vHashes, std::set<uint256>& setInBlock)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    resetBlock();
+    pblocktemplate.reset(new CBlockTemplate(prev));
+    pblock = &pblocktemplate->block; // pointer for convenience
+    nBlockSize = prev.nBlockSize;
+    nBlockSigOps = prev.nBlockSigOps;
+    nBlockTx = prev.block.vtx.size() - 1;
+    nFees = -prev.vTxFees[0];
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = GetLockTimeCutoff(pindexPrev, GetAdjustedTime());
+
+    // Fewer ancestors first puts parents before their children
+    std::vector<CTxMemPool::txiter> vEntries;
+    BOOST_FOREACH(const uint256& hash, vHashes) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it != mempool.mapTx.end())
+            vEntries.push_back(it);
+    }
+    std::sort(vEntries.begin(), vEntries.end(), CompareTxIterByAncestorCount());
+
+    BOOST_FOREACH(CTxMemPool::txiter it, vEntries) {
+        const uint256& hash = it->GetTx().GetHash();
+        if (setInBlock.count(hash))
+            continue;
+        bool fParentsIn = true;
+        BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it)) {
+            if (!setInBlock.count(parent->GetTx().GetHash()))
+                fParentsIn = false;
+        }
+        if (!fParentsIn) {
+            // Its package with the parents the selection left out
+            if (it->GetModFeesWithAncestors() < ::minRelayTxFee.GetFee(it->GetSizeWithAncestors()))
+                continue;
+            return nullptr;
+        }
+        if (it->GetModifiedFee() < ::minRelayTxFee.GetFee(it->GetTxSize()) && nBlockSize >= nBlockMinSize)
+            continue;
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            continue;
+        // It may be worth more than what is in the block already
+        if (!TestPackage(it->GetTxSize(), it->GetSigOpCount()))
+            return nullptr;
+        AddToBlock(it);
+        setInBlock.insert(hash);
+    }
 
+    if (nFees != -prev.vTxFees[0])
+        UpdateCoinbaseValue(-prev.vTxFees[0]);
+    pblocktemplate->nBlockSize = nBlockSize;
+    pblocktemplate->nBlockSigOps = nBlockSigOps;
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
 
-        CAmount blockReward = GetPoWBlockPayment(nHeight, nFees);
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrint("miner", "AppendTransactions(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
+    return std::move(pblocktemplate);
+}
 
-        // Compute regular coinbase transaction.
-        txNew.vout[0].nValue = blockReward;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+std::unique_ptr<CBlockTemplate> CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    return BlockAssembler(chainparams).CreateNewBlock(scriptPubKeyIn);
+}
 
-        // Update coinbase transaction with additional info about masternode and governance payments,
-        // get some info back to pass to getblocktemplate
-        FillBlockPayments(txNew, nHeight, blockReward, pblock->txoutMasternode, pblock->voutSuperblock);
-        // LogPrintf("CreateNewBlock -- nBlockHeight %d blockReward %lld txoutMasternode %s txNew %s",
-        //             nHeight, blockReward, pblock->txoutMasternode.ToString(), txNew.ToString());
+//! Mempool changes collected for the block template before it is selected again instead
+static const size_t BLOCK_TEMPLATE_MAX_PENDING = 10000;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOps);
+void CBlockTemplateCache::EntryAdded(const CTransaction& tx)
+{
+    LOCK(csPending);
+    if (fReselect)
+        return;
+    vAdded.push_back(tx.GetHash());
+    if (vAdded.size() > BLOCK_TEMPLATE_MAX_PENDING)
+        fReselect = true;
+}
 
-        // Update block coinbase
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
+void CBlockTemplateCache::EntryRemoved(const CTransaction& tx)
+{
+    LOCK(csPending);
+    if (fReselect)
+        return;
+    setRemoved.insert(tx.GetHash());
+    if (setRemoved.size() > BLOCK_TEMPLATE_MAX_PENDING)
+        fReselect = true;
+}
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+void CBlockTemplateCache::EntryPrioritised(const uint256& hash)
+{
+    LOCK(csPending);
+    fReselect = true;
+}
 
-        CValidationState state;
-        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+void CBlockTemplateCache::SetTemplate(const std::shared_ptr<const CBlockTemplate>& ptemplateIn, bool fAppended, unsigned int nTransactionsUpdatedIn, int64_t nNow)
+{
+    AssertLockHeld(mempool.cs);
+    ptemplate = ptemplateIn;
+    nTransactionsUpdated = nTransactionsUpdatedIn;
+    nTimeUpdated = nNow;
+    if (!fAppended) {
+        setInTemplate.clear();
+        for (unsigned int i = 1; i < ptemplate->block.vtx.size(); i++)
+            setInTemplate.insert(ptemplate->block.vtx[i].GetHash());
+    }
+
+    LOCK(csPending);
+    vAdded.clear();
+    setRemoved.clear();
+    fReselect = false;
+}
+
+std::shared_ptr<const CBlockTemplate> CBlockTemplateCache::Get(const CChainParams& chainparams, const CBlockIndex*& pindexPrevRet, unsigned int& nTransactionsUpdatedRet)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+    // The changes are only needed once a template is asked for
+    if (!connAdded.connected()) {
+        connAdded = mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::EntryAdded, this, _1));
+        connRemoved = mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::EntryRemoved, this, _1));
+        connPrioritised = mempool.NotifyPrioritised.connect(boost::bind(&CBlockTemplateCache::EntryPrioritised, this, _1));
+    }
+
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    int64_t nNow = GetTime();
+    if (ptemplate && pindexPrev == pindexTip) {
+        if (nNow - nTimeUpdated >= BLOCK_TEMPLATE_REFRESH_INTERVAL) {
+            LOCK(mempool.cs);
+            std::vector<uint256> vAddedNow;
+            bool fReselectNow;
+            {
+                LOCK(csPending);
+                vAddedNow.swap(vAdded);
+                fReselectNow = fReselect;
+                BOOST_FOREACH(const uint256& hash, setRemoved) {
+                    if (setInTemplate.count(hash))
+                        fReselectNow = true;
+                }
+                setRemoved.clear();
+                fReselect = false;
+            }
+            if (fReselectNow || !vAddedNow.empty()) {
+                BlockAssembler assembler(chainparams);
+                std::shared_ptr<const CBlockTemplate> ptemplateNew;
+                if (!fReselectNow)
+                    ptemplateNew = assembler.AppendTransactions(*ptemplate, pindexTip, vAddedNow, setInTemplate);
+                bool fAppended = ptemplateNew.get() != NULL;
+                if (!fAppended)
+                    ptemplateNew = assembler.UpdateTransactions(*ptemplate, pindexTip);
+                if (!ptemplateNew) {
+                    // The changes are gone, build from scratch on the next call
+                    ptemplate.reset();
+                    pindexPrev = NULL;
+                    return nullptr;
+                }
+                SetTemplate(ptemplateNew, fAppended, mempool.GetTransactionsUpdated(), nNow);
+            } else {
+                // Nothing that changes the template, it is current as of now
+                nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            }
         }
+    } else {
+        // Drop the old template first so a failure here is retried on the next call
+        ptemplate.reset();
+        pindexPrev = NULL;
+
+        // Changes from here on are on top of the new template
+        LOCK(mempool.cs);
+        CScript scriptDummy = CScript() << OP_TRUE;
+        std::shared_ptr<const CBlockTemplate> ptemplateNew(CreateNewBlock(chainparams, scriptDummy));
+        if (!ptemplateNew)
+            return nullptr;
+        SetTemplate(ptemplateNew, false, mempool.GetTransactionsUpdated(), nNow);
+        pindexPrev = pindexTip;
     }
 
-    return std::move(pblocktemplate);
+    pindexPrevRet = pindexPrev;
+    nTransactionsUpdatedRet = nTransactionsUpdated;
+    return ptemplate;
 }
 
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -460,41 +930,140 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
 //
 // Internal miner
 //
+// One template thread builds the block template and publishes it as a
+// CMinerJob; every worker thread hashes its own slice of the nonce space of
+// that job. The template is rebuilt when the validation interface reports a
+// new tip, or a mempool change once the job is older than a minute.
 //
-double dHashesPerSec = 0.0;
-int64_t nHPSTimerStart = 0;
+std::atomic<double> dHashesPerSec(0.0);
+std::atomic<int64_t> nHPSTimerStart(0);
 
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// The nonce is usually preserved between calls, but periodically or if the
-// nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
-// zero.
-//
-//bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
-//{
-    // Write the first 76 bytes of the block header to a double-SHA256 state.
-//    CHash256 hasher;
-//    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-//    ss << *pblock;
-//    assert(ss.size() == 80);
-//    hasher.Write((unsigned char*)&ss[0], 76);
-
-//    while (true) {
-//        nNonce++;
-
-        // Write the last 4 bytes of the block header (the nonce) to a copy of
-        // the double-SHA256 state, and compute the result.
-//        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-//        if (((uint16_t*)phash)[15] == 0)
-//            return true;
-
-        // If nothing found after trying for a while, return -1
-//        if ((nNonce & 0xfff) == 0)
-//            return false;
-//    }/
-//}
+/** Hashes computed by all miner threads, only ever incremented */
+static std::atomic<uint64_t> nMinerHashesDone(0);
+
+/** Block template shared by all miner threads */
+struct CMinerJob
+{
+    uint64_t nJobId;
+    std::shared_ptr<const CBlockTemplate> pblocktemplate;
+    /** Header to mine, nTime moves ahead of the template's */
+    CBlockHeader header;
+    const CBlockIndex* pindexPrev;
+    unsigned int nExtraNonce;
+    /** Merkle branch of the coinbase, to roll the extranonce in workers */
+    std::vector<uint256> vMerkleBranch;
+    arith_uint256 hashTarget;
+    int64_t nCreated;
+    boost::shared_ptr<CReserveScript> coinbaseScript;
+};
+
+static CWaitableCriticalSection csMinerJob;
+static CConditionVariable cvMinerJob;
+static std::shared_ptr<const CMinerJob> pMinerJob;
+/** Id of the current job, read by workers without taking csMinerJob */
+static std::atomic<uint64_t> nMinerJobId(0);
+static bool fMinerNewTip = false;
+static bool fMinerMempoolChanged = false;
+/** Set once a block is found on regtest, ends all miner threads */
+static bool fMinerStopped = false;
+/** Keeps workers finding blocks at the same time off the wallet's reserve key */
+static CCriticalSection cs_minerCoinbaseScript;
+
+/** Wakes the template thread when the template may be stale */
+class CMinerNotifier : public CValidationInterface
+{
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(csMinerJob);
+        fMinerNewTip = true;
+        cvMinerJob.notify_all();
+    }
+
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+    {
+        // Transactions of connected blocks are covered by UpdatedBlockTip
+        if (pblock)
+            return;
+        boost::unique_lock<boost::mutex> lock(csMinerJob);
+        fMinerMempoolChanged = true;
+    }
+};
+
+static CMinerNotifier minerNotifier;
+
+CMinerHasher::CMinerHasher(unsigned int nBatchSizeIn) :
+    nBatchSize(std::max(1U, std::min<unsigned int>(nBatchSizeIn, ARGON2_BATCH_MAX)))
+{
+#ifdef __AVX2__
+    WolfArgon2dAllocateCtx(&Ctx);
+#endif
+}
+
+CMinerHasher::~CMinerHasher()
+{
+#ifdef __AVX2__
+    WolfArgon2dFreeCtx(Ctx);
+#endif
+}
+
+uint256 CMinerHasher::Hash(const CBlockHeader& header)
+{
+#ifdef __AVX2__
+    return header.GetHashWithCtx(Ctx);
+#else
+    return header.GetHash();
+#endif
+}
+
+bool CMinerHasher::ScanNonces(CBlockHeader& header, uint32_t nNonceEnd, const arith_uint256& hashTarget, uint32_t& nHashesDone)
+{
+    const uint32_t nNonceStart = header.nNonce;
+    const uint64_t nNonceLast = std::max<uint64_t>(nNonceStart, (uint64_t)nNonceEnd - 1);
+
+    nHashesDone = 0;
+    if (nBatchSize == 1) {
+        for (uint64_t nNonce = nNonceStart; nNonce <= nNonceLast; nNonce++) {
+            header.nNonce = nNonce;
+            uint256 hash = Hash(header);
+            nHashesDone++;
+            if (UintToArith256(hash) <= hashTarget)
+                return true;
+        }
+        return false;
+    }
+
+    // Consecutive nonces are hashed nBatchSize at a time so the memory fills
+    // of the batch overlap; the headers differ only in their last word.
+    unsigned char vchHeaders[ARGON2_BATCH_MAX * CBlockHeader::HEADER_SIZE];
+    uint256 vHashes[ARGON2_BATCH_MAX];
+    for (uint64_t nNonce = nNonceStart; nNonce <= nNonceLast; ) {
+        size_t nCount = std::min<uint64_t>(nBatchSize, nNonceLast - nNonce + 1);
+        for (size_t i = 0; i < nCount; i++) {
+            header.nNonce = nNonce + i;
+            memcpy(&vchHeaders[i * CBlockHeader::HEADER_SIZE], UBEGIN(header.nVersion), CBlockHeader::HEADER_SIZE);
+        }
+        hash_Argon2d_batch(vchHeaders, nCount, vHashes);
+        nHashesDone += nCount;
+        for (size_t i = 0; i < nCount; i++) {
+            if (UintToArith256(vHashes[i]) <= hashTarget) {
+                header.nNonce = nNonce + i;
+                header.SetCachedHash(vHashes[i]);
+                return true;
+            }
+        }
+        nNonce += nCount;
+    }
+    return false;
+}
+
+/** Nonces [nBegin, nEnd) of the 2^32 space scanned by miner thread nThread */
+static void GetMinerNonceRange(int nThread, int nThreads, uint32_t& nBegin, uint32_t& nEnd)
+{
+    uint64_t nRange = ((uint64_t)1 << 32) / nThreads;
+    nBegin = nThread * nRange;
+    nEnd = (nThread + 1 == nThreads) ? std::numeric_limits<uint32_t>::max() : (nThread + 1) * nRange;
+}
 
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
@@ -519,26 +1088,81 @@ static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainpar
     return true;
 }
 
-// ***TODO*** that part changed in bitcoin, we are using a mix with old one here for now
-void static ZumyMiner(const CChainParams& chainparams)
+static std::shared_ptr<CMinerJob> CreateMinerJob(const CChainParams& chainparams, const boost::shared_ptr<CReserveScript>& coinbaseScript, unsigned int& nExtraNonce)
 {
-    LogPrintf("ZumyMiner -- started\n");
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("zumy-miner");
+    std::shared_ptr<CMinerJob> job(new CMinerJob());
+    job->coinbaseScript = coinbaseScript;
+
+    // Hold cs_main so that the template is built on pindexPrev
+    LOCK(cs_main);
+    job->pindexPrev = chainActive.Tip();
+    if (!job->pindexPrev)
+        return std::shared_ptr<CMinerJob>();
+    std::shared_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(chainparams, coinbaseScript->reserveScript));
+    if (!pblocktemplate)
+        return std::shared_ptr<CMinerJob>();
+
+    CBlock *pblock = &pblocktemplate->block;
+    IncrementExtraNonce(pblock, job->pindexPrev, nExtraNonce);
+    job->pblocktemplate = pblocktemplate;
+    job->header = pblock->GetBlockHeader();
+    job->nExtraNonce = nExtraNonce;
+    job->vMerkleBranch = BlockMerkleBranch(*pblock, 0);
+    job->hashTarget.SetCompact(pblock->nBits);
+    job->nCreated = GetTime();
+    return job;
+}
+
+static void PublishMinerJob(const std::shared_ptr<const CMinerJob>& job)
+{
+    boost::unique_lock<boost::mutex> lock(csMinerJob);
+    pMinerJob = fMinerStopped ? std::shared_ptr<const CMinerJob>() : job;
+    nMinerJobId.store(pMinerJob ? pMinerJob->nJobId : 0);
+    cvMinerJob.notify_all();
+}
+
+/** Withdraw the job and end the template and all worker threads */
+static void StopMinerJobs()
+{
+    boost::unique_lock<boost::mutex> lock(csMinerJob);
+    fMinerStopped = true;
+    pMinerJob.reset();
+    nMinerJobId.store(0);
+    cvMinerJob.notify_all();
+}
+
+/** Update the meter every few seconds from the total number of hashes */
+static void UpdateHashMeter(int64_t& nLastTime, uint64_t& nLastHashes, int64_t& nLogTime)
+{
+    int64_t nNow = GetTimeMillis();
+    if (nNow - nLastTime <= 4000)
+        return;
+    uint64_t nHashes = nMinerHashesDone.load(std::memory_order_relaxed);
+    dHashesPerSec = 1000.0 * (nHashes - nLastHashes) / (nNow - nLastTime);
+    nHPSTimerStart = nNow;
+    nLastTime = nNow;
+    nLastHashes = nHashes;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+    }
+}
+
+void static ZumyMinerTemplate(const CChainParams& chainparams)
+{
+    LogPrintf("ZumyMinerTemplate -- started\n");
+    RenameThread("zumy-minertpl");
 
     unsigned int nExtraNonce = 0;
+    uint64_t nJobId = 0;
+    int64_t nMeterTime = GetTimeMillis();
+    uint64_t nMeterHashes = nMinerHashesDone.load();
+    int64_t nLogTime = 0;
 
     boost::shared_ptr<CReserveScript> coinbaseScript;
     GetMainSignals().ScriptForMining(coinbaseScript);
-	
-	#ifdef __AVX2__
-	
-	void *Ctx;
-	
-	WolfArgon2dAllocateCtx(&Ctx);
-	
-	#endif
-	
+
     try {
         // Throw an error if no script was provided.  This can happen
         // due to some internal error but also if the keypool is empty.
@@ -546,140 +1170,170 @@ void static ZumyMiner(const CChainParams& chainparams)
         if (!coinbaseScript || coinbaseScript->reserveScript.empty())
             throw std::runtime_error("No coinbase script available (mining requires a wallet)");
 
+        std::shared_ptr<const CMinerJob> job;
         while (true) {
+            bool fNewTip, fMempoolChanged;
+            {
+                boost::unique_lock<boost::mutex> lock(csMinerJob);
+                if (job && !fMinerNewTip && !fMinerStopped)
+                    cvMinerJob.timed_wait(lock, boost::posix_time::seconds(1));
+                if (fMinerStopped)
+                    throw boost::thread_interrupted();
+                fNewTip = fMinerNewTip;
+                fMempoolChanged = fMinerMempoolChanged;
+            }
+            boost::this_thread::interruption_point();
+            UpdateHashMeter(nMeterTime, nMeterHashes, nLogTime);
+
             if (chainparams.MiningRequiresPeers()) {
-                // Busy-wait for the network to come online so we don't waste time mining
-                // on an obsolete chain. In regtest mode we expect to fly solo.
-                do {
-                    bool fvNodesEmpty;
-                    {
-                        LOCK(cs_vNodes);
-                        fvNodesEmpty = vNodes.empty();
+                // Don't waste time mining on an obsolete chain. In regtest
+                // mode we expect to fly solo.
+                bool fvNodesEmpty;
+                {
+                    LOCK(cs_vNodes);
+                    fvNodesEmpty = vNodes.empty();
+                }
+                if (fvNodesEmpty || IsInitialBlockDownload()) {
+                    if (job) {
+                        job.reset();
+                        PublishMinerJob(job);
                     }
-                    if (!fvNodesEmpty && !IsInitialBlockDownload())
-                        break;
                     MilliSleep(1000);
-                } while (true);
+                    continue;
+                }
             }
 
+            if (job && !fNewTip && !(fMempoolChanged && GetTime() - job->nCreated > 60)) {
+                // Update nTime every few seconds
+                std::shared_ptr<CMinerJob> jobNext(new CMinerJob(*job));
+                int64_t nTimeDelta = UpdateTime(&jobNext->header, chainparams.GetConsensus(), jobNext->pindexPrev);
+                if (nTimeDelta == 0)
+                    continue;
+                if (nTimeDelta > 0) {
+                    // Changing nTime can change work required on testnet
+                    jobNext->hashTarget.SetCompact(jobNext->header.nBits);
+                    jobNext->nJobId = ++nJobId;
+                    job = jobNext;
+                    PublishMinerJob(job);
+                    continue;
+                }
+                // Recreate the block if the clock has run backwards, so that
+                // we can use the correct time.
+            }
 
-            //
-            // Create new block
-            //
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-            std::unique_ptr<CBlockTemplate> pblocktemplate;
-            if(!pindexPrev) break;
-            
-#ifdef ENABLE_WALLET
-            pblocktemplate = std::unique_ptr<CBlockTemplate> (CreateNewBlock(chainparams, coinbaseScript->reserveScript));
-#else
-            pblocktemplate = std::unique_ptr<CBlockTemplate> (CreateNewBlock(chainparams));
-#endif
-            if (!pblocktemplate.get())
             {
-                LogPrintf("ZumyMiner -- Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                boost::unique_lock<boost::mutex> lock(csMinerJob);
+                fMinerNewTip = false;
+                fMinerMempoolChanged = false;
+            }
+            std::shared_ptr<CMinerJob> jobNext = CreateMinerJob(chainparams, coinbaseScript, nExtraNonce);
+            if (!jobNext) {
+                LogPrintf("ZumyMinerTemplate -- Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                PublishMinerJob(std::shared_ptr<const CMinerJob>());
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-            LogPrintf("ZumyMiner -- Running miner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-            
-            //
-            // Search
-            //
-            int64_t nStart = GetTime();
-            arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
-            uint256 hash;
-            while (true)
-            {
-                unsigned int nHashesDone = 0;
+            jobNext->nJobId = ++nJobId;
+            job = jobNext;
+            LogPrintf("ZumyMinerTemplate -- Running miner with %u transactions in block (%u bytes)\n", job->pblocktemplate->block.vtx.size(),
+                ::GetSerializeSize(job->pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+            PublishMinerJob(job);
+        }
+    }
+    catch (const boost::thread_interrupted&)
+    {
+        PublishMinerJob(std::shared_ptr<const CMinerJob>());
+        LogPrintf("ZumyMinerTemplate -- terminated\n");
+        throw;
+    }
+    catch (const std::runtime_error &e)
+    {
+        PublishMinerJob(std::shared_ptr<const CMinerJob>());
+        LogPrintf("ZumyMinerTemplate -- runtime error: %s\n", e.what());
+        return;
+    }
+}
 
-                uint256 hash;
-                while (true)
-                {
-					#ifdef __AVX2__
-                    hash = pblock->GetHashWithCtx(Ctx);
-                    #else
-                    hash = pblock->GetHash();
-                    #endif
-                    
-                    if (UintToArith256(hash) <= hashTarget)
-                    {
-                        // Found a solution
-                        //pblock->nNonce = nNonce;
-                        //assert(hash == pblock->GetHash());
+void static ZumyMiner(const CChainParams& chainparams, int nThread, int nThreads)
+{
+    LogPrintf("ZumyMiner -- started thread %d\n", nThread);
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("zumy-miner");
+    if (GetBoolArg("-genpincores", DEFAULT_GENPINCORES) && GetNumCores() > 0)
+        SetThreadAffinity(nThread % GetNumCores());
 
-                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                        LogPrintf("ZumyMiner:\n proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, chainparams);
-                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                        coinbaseScript->KeepScript();
+    CMinerHasher hasher(GetArg("-genbatchsize", DEFAULT_GENBATCHSIZE));
+    uint32_t nNonceBegin, nNonceEnd;
+    GetMinerNonceRange(nThread, nThreads, nNonceBegin, nNonceEnd);
+    // Job this thread found a block for, not to be mined again
+    uint64_t nJobIdFound = 0;
 
-                        // In regression test mode, stop mining after a block is found.
-                        if (chainparams.MineBlocksOnDemand())
-                            throw boost::thread_interrupted();
+    try {
+        while (true) {
+            std::shared_ptr<const CMinerJob> job;
+            {
+                boost::unique_lock<boost::mutex> lock(csMinerJob);
+                while (!fMinerStopped && (!pMinerJob || pMinerJob->nJobId == nJobIdFound))
+                    cvMinerJob.wait(lock);
+                if (fMinerStopped)
+                    throw boost::thread_interrupted();
+                job = pMinerJob;
+            }
 
-                        break;
+            const CBlock& blockTemplate = job->pblocktemplate->block;
+            CBlockHeader header = job->header;
+            header.nNonce = nNonceBegin;
+            // Extranonces rolled by this thread, disjoint from other threads
+            unsigned int nRolls = 0;
+            CMutableTransaction txCoinbase(blockTemplate.vtx[0]);
+
+            while (nMinerJobId.load(std::memory_order_relaxed) == job->nJobId) {
+                uint32_t nHashesDone;
+                uint32_t nBatchEnd = std::min<uint64_t>((uint64_t)header.nNonce + 256, nNonceEnd);
+                bool fFound = hasher.ScanNonces(header, nBatchEnd, job->hashTarget, nHashesDone);
+                nMinerHashesDone.fetch_add(nHashesDone, std::memory_order_relaxed);
+
+                if (fFound) {
+                    CBlock block(blockTemplate);
+                    if (nRolls)
+                        block.vtx[0] = txCoinbase;
+                    block.hashMerkleRoot = header.hashMerkleRoot;
+                    block.nTime = header.nTime;
+                    block.nBits = header.nBits;
+                    block.nNonce = header.nNonce;
+
+                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                    LogPrintf("ZumyMiner:\n proof-of-work found  \n  hash: %s  \ntarget: %s\n", block.GetHash().GetHex(), job->hashTarget.GetHex());
+                    ProcessBlockFound(&block, chainparams);
+                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    {
+                        LOCK(cs_minerCoinbaseScript);
+                        job->coinbaseScript->KeepScript();
                     }
-                    pblock->nNonce += 1;
-                    nHashesDone += 1;
-                    if ((pblock->nNonce & 0xFF) == 0)
-                        break;
-                }
-                
-                // Meter hashes/seconds
-                static int64_t nHashCounter = 0;
-                static int64_t nLogTime = 0;
 
-                if (nHPSTimerStart == 0)
-                {
-                    nHPSTimerStart = GetTimeMillis();
-                    nHashCounter = 0;
-                }
-                else
-                    nHashCounter += nHashesDone;
-                if (GetTimeMillis() - nHPSTimerStart > 4000)
-                {
-                    static CCriticalSection cs;        
-                    {
-                        LOCK(cs);
-                        if (GetTimeMillis() - nHPSTimerStart > 4000)
-                        {
-                            dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                            nHPSTimerStart = GetTimeMillis();
-                            nHashCounter = 0;
-                            if (GetTime() - nLogTime > 30 * 60)
-                            {
-                                nLogTime = GetTime();
-                                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                            }
-                        }
+                    // In regression test mode, stop mining after a block is found.
+                    if (chainparams.MineBlocksOnDemand()) {
+                        StopMinerJobs();
+                        throw boost::thread_interrupted();
                     }
+
+                    // Wait for the template thread to replace the job
+                    nJobIdFound = job->nJobId;
+                    break;
                 }
 
-                // Check for stop or if block needs to be rebuilt
                 boost::this_thread::interruption_point();
-                // Regtest mode doesn't require peers
-                if (vNodes.empty() && chainparams.MiningRequiresPeers())
-                    break;
-                if (pblock->nNonce >= 0xffff0000)
-                    break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (pindexPrev != chainActive.Tip())
-                    break;
 
-                // Update nTime every few seconds
-                if (UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev) < 0)
-                    break; // Recreate the block if the clock has run backwards,
-                           // so that we can use the correct time.
-                if (chainparams.GetConsensus().fPowAllowMinDifficultyBlocks)
-                {
-                    // Changing pblock->nTime can change work required on testnet:
-                    hashTarget.SetCompact(pblock->nBits);
+                if (header.nNonce + 1 >= nNonceEnd) {
+                    // Our nonce range is exhausted, roll to an extranonce no
+                    // other thread uses
+                    ++nRolls;
+                    CScript scriptSig = CScript() << (job->pindexPrev->nHeight + 1) << CScriptNum(job->nExtraNonce) << CScriptNum(nThread + (int64_t)nRolls * nThreads);
+                    txCoinbase.vin[0].scriptSig = scriptSig + COINBASE_FLAGS;
+                    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+                    header.hashMerkleRoot = ComputeMerkleRootFromBranch(txCoinbase.GetHash(), job->vMerkleBranch, 0);
+                    header.nNonce = nNonceBegin;
+                } else {
+                    ++header.nNonce;
                 }
             }
         }
@@ -687,24 +1341,13 @@ void static ZumyMiner(const CChainParams& chainparams)
     catch (const boost::thread_interrupted&)
     {
         LogPrintf("ZumyMiner -- terminated\n");
-        
-        #ifdef __AVX2__
-        WolfArgon2dFreeCtx(Ctx);
-        #endif
         throw;
     }
     catch (const std::runtime_error &e)
     {
         LogPrintf("ZumyMiner -- runtime error: %s\n", e.what());
-        #ifdef __AVX2__
-        WolfArgon2dFreeCtx(Ctx);
-        #endif
         return;
     }
-    
-    #ifdef __AVX2__
-    WolfArgon2dFreeCtx(Ctx);
-    #endif
 }
 
 void GenerateZumys(bool fGenerate, int nThreads, const CChainParams& chainparams)
@@ -718,14 +1361,24 @@ void GenerateZumys(bool fGenerate, int nThreads, const CChainParams& chainparams
     if (minerThreads != NULL)
     {
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
+        UnregisterValidationInterface(&minerNotifier);
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    {
+        boost::unique_lock<boost::mutex> lock(csMinerJob);
+        fMinerNewTip = false;
+        fMinerMempoolChanged = false;
+        fMinerStopped = false;
+    }
+    RegisterValidationInterface(&minerNotifier);
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&ZumyMinerTemplate, boost::cref(chainparams)));
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&ZumyMiner, boost::cref(chainparams)));
+        minerThreads->create_thread(boost::bind(&ZumyMiner, boost::cref(chainparams), i, nThreads));
 }
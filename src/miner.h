@@ -9,11 +9,17 @@
 #define ZUMY_MINER_H
 
 #include "primitives/block.h"
+#include "txmempool.h"
 
 #include <stdint.h>
+#include <atomic>
 #include <memory>
 #include <cstddef>
 
+#include "boost/multi_index_container.hpp"
+#include "boost/multi_index/ordered_index.hpp"
+
+class arith_uint256;
 class CBlockIndex;
 class CChainParams;
 class CReserveKey;
@@ -24,14 +30,302 @@ namespace Consensus { struct Params; };
 
 static const bool DEFAULT_GENERATE = false;
 static const int DEFAULT_GENERATE_THREADS = 1;
+static const bool DEFAULT_GENPINCORES = false;
+//! Nonces a miner thread hashes together. Batches of 250 KiB matrices outgrow
+//! the L2 cache and measured slower than single hashing on every kernel.
+static const unsigned int DEFAULT_GENBATCHSIZE = 1;
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+//! Seconds a served block template is kept after the mempool changed
+static const int64_t BLOCK_TEMPLATE_REFRESH_INTERVAL = 5;
 
 struct CBlockTemplate
 {
     CBlock block;
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOps;
+    //! Size and sigops of the block with the room kept for the coinbase
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+
+    CBlockTemplate() : nBlockSize(0), nBlockSigOps(0) {}
+};
+
+// Container for tracking updates to ancestor feerate as we include (parent)
+// transactions in a block
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+/** Comparator for CTxMemPool::txiter objects.
+ *  It simply compares the internal memory address of the CTxMemPoolEntry object
+ *  pointed to. This means it has no meaning, and is only useful for using them
+ *  as key in other indexes.
+ */
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+// This matches the calculation in CompareTxMemPoolEntryByAncestorFee,
+// except operating on CTxMemPoolModifiedEntry.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return a.iter->GetTx().GetHash() < b.iter->GetTx().GetHash();
+        }
+        return f1 > f2;
+    }
+};
+
+// A comparator that sorts transactions based on number of ancestors.
+// This is sufficient to sort an ancestor package in an order that is valid
+// to appear in a block.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::nth_index<1>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
+{
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+/**
+ * Fills a block template from the mempool: first the high priority
+ * transactions up to -blockprioritysize, then packages of a transaction and
+ * its unconfirmed ancestors by the feerate of the whole package, so a child
+ * paying for its parent (CPFP) gets both in. Packages whose ancestors are
+ * partly in the block already are kept in a side index with their ancestor
+ * state updated as those ancestors go in.
+ */
+class BlockAssembler
+{
+private:
+    // The constructed block template
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    // A convenience pointer that always refers to the CBlock in pblocktemplate
+    CBlock* pblock;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    const CChainParams& chainparams;
+
+    bool fPrintPriority;
+
+    // Variables used for addPriorityTxs
+    int lastFewTxs;
+    bool blockFinished;
+
+public:
+    BlockAssembler(const CChainParams& chainparams);
+    /** Construct a new block template with coinbase to scriptPubKeyIn */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
+    /**
+     * Select the mempool transactions of a block at nHeightIn, leaving the
+     * coinbase a placeholder and the header empty. CreateNewBlock finishes
+     * the template; cs_main and mempool.cs must be held.
+     */
+    std::unique_ptr<CBlockTemplate> SelectTransactions(int nHeightIn, int64_t nLockTimeCutoffIn);
+    /**
+     * Refill the transactions of prev, a template on top of pindexPrev, from
+     * the current mempool. The header, the coinbase script and the payees of
+     * prev are kept, only the coinbase value follows the fees. The result is
+     * not run through TestBlockValidity again.
+     */
+    std::unique_ptr<CBlockTemplate> UpdateTransactions(const CBlockTemplate& prev, const CBlockIndex* pindexPrev);
+    /**
+     * Append the mempool transactions vHashes names to prev, a template on top
+     * of pindexPrev, if they can go in without selecting the block again:
+     * their unconfirmed parents are in the block or appended before them, and
+     * they fit. Transactions below the relay fee are left out, as the
+     * selection leaves them. setInBlock holds the transactions of prev and
+     * gets those appended. Returns NULL if a transaction could only be placed
+     * by selecting the block again. cs_main and mempool.cs must be held.
+     */
+    std::unique_ptr<CBlockTemplate> AppendTransactions(const CBlockTemplate& prev, const CBlockIndex* pindexPrev, const std::vector<uint256>& vHashes, std::set<uint256>& setInBlock);
+
+private:
+    /** The lock time cutoff for transactions in a block on top of pindexPrev at nTime */
+    static int64_t GetLockTimeCutoff(const CBlockIndex* pindexPrev, int64_t nTime);
+    /** Set the coinbase value and fee of the template being built for fees of nFees instead of nFeesPrev */
+    void UpdateCoinbaseValue(CAmount nFeesPrev);
+
+    /** Clear the block's state and prepare for assembling a new block */
+    void resetBlock();
+    /** Add a tx to the block */
+    void AddToBlock(CTxMemPool::txiter iter);
+
+    /** Add transactions based on tx "priority" */
+    void addPriorityTxs();
+    /** Add transactions based on feerate including unconfirmed ancestors */
+    void addPackageTxs();
+
+    // helper functions for addPriorityTxs()
+    /** Test if tx will still "fit" in the block */
+    bool TestForBlock(CTxMemPool::txiter iter);
+    /** Test if tx still has unconfirmed parents not yet in block */
+    bool isStillDependent(CTxMemPool::txiter iter);
+
+    // helper functions for addPackageTxs()
+    /** Remove confirmed (inBlock) entries from given set */
+    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Test if a new package would "fit" in the block */
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps);
+    /** Test if a set of transactions are all final */
+    bool TestPackageFinality(const CTxMemPool::setEntries& package);
+    /** Return true if given transaction from mapTx has already been evaluated,
+      * or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
+    /** Sort the package in an order that is valid to appear in a block */
+    void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries);
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+      * state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+};
+
+/**
+ * The block template handed out by getblocktemplate. A new tip builds and
+ * validates a complete template, payees included. After that the mempool's
+ * notifications are collected, and at most once per
+ * BLOCK_TEMPLATE_REFRESH_INTERVAL the transactions added since are appended
+ * to the template. Only when one of its transactions left the pool, a fee
+ * delta changed, or an added transaction cannot simply be appended, are the
+ * transactions selected again. Templates are immutable once built, so every
+ * caller can share the same one.
+ */
+class CBlockTemplateCache
+{
+private:
+    CCriticalSection cs;
+    std::shared_ptr<const CBlockTemplate> ptemplate;
+    //! The tip ptemplate builds on
+    const CBlockIndex* pindexPrev;
+    //! The mempool's GetTransactionsUpdated() when ptemplate was filled
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeUpdated;
+    //! The transactions of ptemplate
+    std::set<uint256> setInTemplate;
+
+    //! Mempool changes since ptemplate was filled. csPending is taken after mempool.cs.
+    CCriticalSection csPending;
+    boost::signals2::scoped_connection connAdded, connRemoved, connPrioritised;
+    std::vector<uint256> vAdded;
+    std::set<uint256> setRemoved;
+    bool fReselect;
+
+    void EntryAdded(const CTransaction& tx);
+    void EntryRemoved(const CTransaction& tx);
+    void EntryPrioritised(const uint256& hash);
+    /**
+     * Set ptemplate, filled at nTransactionsUpdatedIn and nNow, and forget the
+     * changes before it. fAppended tells setInTemplate already has its
+     * transactions. mempool.cs must be held.
+     */
+    void SetTemplate(const std::shared_ptr<const CBlockTemplate>& ptemplateIn, bool fAppended, unsigned int nTransactionsUpdatedIn, int64_t nNow);
+
+public:
+    CBlockTemplateCache() : pindexPrev(NULL), nTransactionsUpdated(0), nTimeUpdated(0), fReselect(false) {}
+
+    /**
+     * Return the template for the current tip, building or refilling it if
+     * needed, with the tip it builds on and the mempool update count it was
+     * filled at, or NULL if no template could be built. cs_main must be held.
+     */
+    std::shared_ptr<const CBlockTemplate> Get(const CChainParams& chainparams, const CBlockIndex*& pindexPrevRet, unsigned int& nTransactionsUpdatedRet);
+};
+
+extern CBlockTemplateCache blocktemplatecache;
+
+/** Per-thread Argon2d hashing state of a miner thread */
+class CMinerHasher
+{
+private:
+#ifdef __AVX2__
+    void *Ctx;
+#endif
+    //! Nonces ScanNonces hashes together, 1 to ARGON2_BATCH_MAX
+    unsigned int nBatchSize;
+
+public:
+    explicit CMinerHasher(unsigned int nBatchSizeIn = DEFAULT_GENBATCHSIZE);
+    ~CMinerHasher();
+
+    uint256 Hash(const CBlockHeader& header);
+
+    /**
+     * Hash header with nonces from header.nNonce up to (excluding) nNonceEnd
+     * until one meets hashTarget. Returns true with header.nNonce set to the
+     * solution; otherwise header.nNonce is the last nonce tried. With a batch
+     * size above 1 nHashesDone may run past the solution.
+     */
+    bool ScanNonces(CBlockHeader& header, uint32_t nNonceEnd, const arith_uint256& hashTarget, uint32_t& nHashesDone);
 };
 
 /** ByteReverse Function used by GetWork */ // TODO: Shift to util
@@ -45,13 +339,13 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
 /** Run the miner threads */
 void GenerateZumys(bool fGenerate, int nThreads, const CChainParams& chainparams);
-/** Generate a new block, without valid proof-of-work */
+/** Generate a new block, without valid proof-of-work, with BlockAssembler */
 std::unique_ptr<CBlockTemplate> CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
-extern double dHashesPerSec;
-extern int64_t nHPSTimerStart;
+extern std::atomic<double> dHashesPerSec;
+extern std::atomic<int64_t> nHPSTimerStart;
 
 #endif // ZUMY_MINER_H
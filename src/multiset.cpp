@@ -0,0 +1,143 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "multiset.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+
+#include <assert.h>
+
+#include <secp256k1.h>
+
+namespace {
+
+/** Parsing, serializing and adding points needs no precomputed tables */
+class CMultisetContext
+{
+public:
+    secp256k1_context* ctx;
+
+    CMultisetContext() : ctx(secp256k1_context_create(SECP256K1_CONTEXT_NONE)) {}
+    ~CMultisetContext() { secp256k1_context_destroy(ctx); }
+};
+
+const secp256k1_context* GetContext()
+{
+    static CMultisetContext context;
+    return context.ctx;
+}
+
+bool IsZero(const unsigned char* vch, size_t nSize)
+{
+    for (size_t i = 0; i < nSize; i++) {
+        if (vch[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Map an element onto the curve, trying x = SHA256(element || n) for
+ * n = 0, 1, ... until x is on it. An element is the point with even y,
+ * its removal the negated point with the same x and odd y.
+ */
+void ElementToPoint(const secp256k1_context* ctx, const uint256& element, bool fNegate, secp256k1_pubkey& point)
+{
+    unsigned char vch[33];
+    vch[0] = fNegate ? 0x03 : 0x02;
+    unsigned char vchCounter[4];
+    uint256 x;
+    for (uint32_t n = 0; ; n++) {
+        WriteLE32(vchCounter, n);
+        CSHA256().Write(element.begin(), element.size()).Write(vchCounter, sizeof(vchCounter)).Finalize(x.begin());
+        memcpy(vch + 1, x.begin(), x.size());
+        if (secp256k1_ec_pubkey_parse(ctx, &point, vch, sizeof(vch)))
+            return;
+    }
+}
+
+/** Sum points, the empty set (point at infinity) comes out all zero */
+void SumPoints(const secp256k1_context* ctx, const std::vector<const secp256k1_pubkey*>& vpPoints, unsigned char* vchSum)
+{
+    secp256k1_pubkey sum;
+    // Valid points only fail to add up to a valid point at infinity
+    if (vpPoints.empty() || !secp256k1_ec_pubkey_combine(ctx, &sum, &vpPoints[0], vpPoints.size())) {
+        memset(vchSum, 0, 33);
+        return;
+    }
+    size_t nSize = 33;
+    secp256k1_ec_pubkey_serialize(ctx, vchSum, &nSize, &sum, SECP256K1_EC_COMPRESSED);
+    assert(nSize == 33);
+}
+
+}
+
+CECMultiset::CECMultiset()
+{
+    memset(vchSum, 0, sizeof(vchSum));
+}
+
+void CECMultiset::Queue(const uint256& element, bool fRemove)
+{
+    vPending.push_back(std::make_pair(element, fRemove));
+    if (vPending.size() >= MAX_PENDING)
+        Apply();
+}
+
+void CECMultiset::Apply() const
+{
+    if (vPending.empty())
+        return;
+    const secp256k1_context* ctx = GetContext();
+    std::vector<secp256k1_pubkey> vPoints(vPending.size() + 1);
+    std::vector<const secp256k1_pubkey*> vpPoints;
+    vpPoints.reserve(vPoints.size());
+    for (size_t i = 0; i < vPending.size(); i++) {
+        ElementToPoint(ctx, vPending[i].first, vPending[i].second, vPoints[i]);
+        vpPoints.push_back(&vPoints[i]);
+    }
+    vPending.clear();
+    if (!IsZero(vchSum, sizeof(vchSum))) {
+        bool fOk = secp256k1_ec_pubkey_parse(ctx, &vPoints.back(), vchSum, sizeof(vchSum));
+        assert(fOk);
+        vpPoints.push_back(&vPoints.back());
+    }
+    SumPoints(ctx, vpPoints, vchSum);
+}
+
+void CECMultiset::Combine(const CECMultiset& other)
+{
+    Apply();
+    other.Apply();
+    if (IsZero(other.vchSum, sizeof(other.vchSum)))
+        return;
+    const secp256k1_context* ctx = GetContext();
+    secp256k1_pubkey points[2];
+    std::vector<const secp256k1_pubkey*> vpPoints;
+    if (secp256k1_ec_pubkey_parse(ctx, &points[0], other.vchSum, sizeof(other.vchSum)))
+        vpPoints.push_back(&points[0]);
+    if (!IsZero(vchSum, sizeof(vchSum)) && secp256k1_ec_pubkey_parse(ctx, &points[1], vchSum, sizeof(vchSum)))
+        vpPoints.push_back(&points[1]);
+    SumPoints(ctx, vpPoints, vchSum);
+}
+
+bool CECMultiset::IsEmpty() const
+{
+    Apply();
+    return IsZero(vchSum, sizeof(vchSum));
+}
+
+uint256 CECMultiset::GetHash() const
+{
+    Apply();
+    return Hash(vchSum, vchSum + sizeof(vchSum));
+}
+
+bool CECMultiset::IsValidSum() const
+{
+    secp256k1_pubkey point;
+    return IsZero(vchSum, sizeof(vchSum)) || secp256k1_ec_pubkey_parse(GetContext(), &point, vchSum, sizeof(vchSum));
+}
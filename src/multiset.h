@@ -0,0 +1,81 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZUMY_MULTISET_H
+#define ZUMY_MULTISET_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Elliptic curve multiset hash. Every element is mapped onto a secp256k1
+ * point and a set is the sum of the points of its elements, so the result
+ * does not depend on the order of changes, and removing an element undoes
+ * adding it. Finding two different sets with the same sum is as hard as
+ * computing discrete logarithms.
+ *
+ * Changes are queued and summed in batches, as every sum costs a field
+ * inversion.
+ */
+class CECMultiset
+{
+private:
+    //! Compressed encoding of the sum, all zero for the empty set
+    mutable unsigned char vchSum[33];
+    //! Queued elements, flagged true when they are removed
+    mutable std::vector<std::pair<uint256, bool> > vPending;
+
+    void Queue(const uint256& element, bool fRemove);
+    //! Fold the queued elements into vchSum
+    void Apply() const;
+    bool IsValidSum() const;
+
+public:
+    //! Queue length at which changes are summed
+    static const size_t MAX_PENDING = 1024;
+
+    CECMultiset();
+
+    //! Add an element, given as a hash of its contents
+    void Add(const uint256& element) { Queue(element, false); }
+    //! Remove an element added before. Removing one that is not there is not detected.
+    void Remove(const uint256& element) { Queue(element, true); }
+    //! Add every element of another multiset
+    void Combine(const CECMultiset& other);
+
+    bool IsEmpty() const;
+    uint256 GetHash() const;
+
+    friend bool operator==(const CECMultiset& a, const CECMultiset& b) {
+        a.Apply();
+        b.Apply();
+        return memcmp(a.vchSum, b.vchSum, sizeof(a.vchSum)) == 0;
+    }
+    friend bool operator!=(const CECMultiset& a, const CECMultiset& b) { return !(a == b); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return sizeof(vchSum);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        Apply();
+        s.write((const char*)vchSum, sizeof(vchSum));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        vPending.clear();
+        s.read((char*)vchSum, sizeof(vchSum));
+        if (!IsValidSum())
+            throw std::ios_base::failure("CECMultiset::Unserialize: invalid point");
+    }
+};
+
+#endif // ZUMY_MULTISET_H
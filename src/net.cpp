@@ -2081,10 +2081,9 @@ void CExplicitNetCleanup::callCleanup()
     delete tmp; // Stroustrup's gonna kill me for that
 }
 
-void RelayTransaction(const CTransaction& tx)
+/** Serialize tx as the message it is relayed with: a PSTX, a lock request or a plain tx */
+static void SerializeRelayTransaction(const CTransaction& tx, CDataStream& ss)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
     uint256 hash = tx.GetHash();
     CTxLockRequest txLockRequest;
     if(mapPrivatesendBroadcastTxes.count(hash)) { // MSG_PSTX
@@ -2094,23 +2093,40 @@ void RelayTransaction(const CTransaction& tx)
     } else { // MSG_TX
         ss << tx;
     }
-    RelayTransaction(tx, ss);
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+static CInv RelayTransactionInv(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
     int nInv = mapPrivatesendBroadcastTxes.count(hash) ? MSG_PSTX :
                 (instantsend.HasTxLockRequest(hash) ? MSG_TXLOCK_REQUEST : MSG_TX);
-    CInv inv(nInv, hash);
+    return CInv(nInv, hash);
+}
+
+static void ExpireRelayMessages() EXCLUSIVE_LOCKS_REQUIRED(cs_mapRelay)
+{
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+    {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+}
+
+void RelayTransaction(const CTransaction& tx)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(10000);
+    SerializeRelayTransaction(tx, ss);
+    RelayTransaction(tx, ss);
+}
+
+void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+{
+    CInv inv = RelayTransactionInv(tx);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+        ExpireRelayMessages();
 
         // Save original serialized message so newer versions are preserved
         mapRelay.insert(std::make_pair(inv, ss));
@@ -2131,6 +2147,37 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     }
 }
 
+void RelayTransactions(const std::vector<CTransaction>& vtx)
+{
+    if (vtx.empty())
+        return;
+    std::vector<CInv> vInv;
+    vInv.reserve(vtx.size());
+    {
+        LOCK(cs_mapRelay);
+        ExpireRelayMessages();
+        int64_t nExpire = GetTime() + 15 * 60;
+        BOOST_FOREACH(const CTransaction& tx, vtx) {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            SerializeRelayTransaction(tx, ss);
+            vInv.push_back(RelayTransactionInv(tx));
+            mapRelay.insert(std::make_pair(vInv.back(), ss));
+            vRelayExpiration.push_back(std::make_pair(nExpire, vInv.back()));
+        }
+    }
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if(!pnode->fRelayTxes)
+            continue;
+        LOCK(pnode->cs_filter);
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            if (!pnode->pfilter || pnode->pfilter->IsRelevantAndUpdate(vtx[i]))
+                pnode->PushInventory(vInv[i]);
+        }
+    }
+}
+
 void RelayInv(CInv &inv, const int minProtoVersion) {
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
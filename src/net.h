@@ -837,6 +837,8 @@ public:
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+/** Relay a batch of transactions, taking the relay and node locks once for all of them */
+void RelayTransactions(const std::vector<CTransaction>& vtx);
 void RelayInv(CInv &inv, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
 
 /** Access to the (IP) address database (peers.dat) */
@@ -12,6 +12,8 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <string.h>
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -22,6 +24,10 @@
 class CBlockHeader
 {
 public:
+    //! Size of the serialized header, which is also its in-memory layout
+    //! starting at nVersion.
+    static const size_t HEADER_SIZE = 80;
+
     // header
     int32_t nVersion;
     uint256 hashPrevBlock;
@@ -30,6 +36,11 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
 
+    // memory only
+    mutable uint256 hashCached;
+    mutable unsigned char vchHashedHeader[HEADER_SIZE];
+    mutable bool fHashCached;
+
     CBlockHeader()
     {
         SetNull();
@@ -56,6 +67,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -63,20 +75,44 @@ public:
         return (nBits == 0);
     }
 
+    /**
+     * The Argon2d hash is memoized together with a copy of the 80 header
+     * bytes it was computed from. Any change to a header field (the miner's
+     * nonce loop, a new merkle root, deserialization over an existing object)
+     * makes the copy differ and the hash is recomputed on the next call.
+     */
     uint256 GetHash() const
     {
-        return hash_Argon2d(UVOIDBEGIN(nVersion), 1);
+        if (!HasCachedHash())
+            SetCachedHash(hash_Argon2d(UVOIDBEGIN(nVersion), 1));
+        return hashCached;
     }
     
     #ifdef __AVX2__
     
     uint256 GetHashWithCtx(void *Matrix) const
     {
-		return(hash_Argon2d_ctx(UVOIDBEGIN(nVersion), Matrix, 1));
+        if (!HasCachedHash())
+            SetCachedHash(hash_Argon2d_ctx(UVOIDBEGIN(nVersion), Matrix, 1));
+        return hashCached;
 	}
 	
 	#endif
 
+    //! Seed the hash cache with a hash known to belong to the current header
+    //! fields, e.g. the key of the block index entry the header was built from.
+    void SetCachedHash(const uint256& hash) const
+    {
+        hashCached = hash;
+        memcpy(vchHashedHeader, UBEGIN(nVersion), HEADER_SIZE);
+        fHashCached = true;
+    }
+
+    bool HasCachedHash() const
+    {
+        return fHashCached && memcmp(vchHashedHeader, UBEGIN(nVersion), HEADER_SIZE) == 0;
+    }
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -125,14 +161,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copies the header fields along with any memoized hash
+        return *static_cast<const CBlockHeader*>(this);
     }
 
     std::string ToString() const;
@@ -16,15 +16,20 @@
 #include "streams.h"
 #include "sync.h"
 #include "primitives/transaction.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utxosnapshot.h"
 #include "consensus/validation.h"
 
 #include <univalue.h>
 
+#include <memory>
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
 void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 
@@ -198,6 +203,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
             info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
             info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             std::set<std::string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -256,6 +264,9 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
             "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
             "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -529,14 +540,15 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+    CBlockRef pblock = ReadBlockFromDiskCached(pblockindex, Params().GetConsensus());
+    if (!pblock)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    const CBlock& block = *pblock;
 
     if (!fVerbose)
     {
@@ -551,42 +563,223 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( scan )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "They are kept up to date with every block. Only the first call after an upgrade,\n"
+            "or one asking for a scan, walks the whole set, which may take some time.\n"
+            "\nArguments:\n"
+            "1. scan    (boolean, optional, default=false) Walk the whole set to also report transactions and hash_serialized\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions, only with scan\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, only with scan\n"
+            "  \"hash_set\": \"hash\",   (string) Order independent hash of the set, comparable between nodes at the same block\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fScan = false;
+    if (params.size() > 0)
+        fScan = params[0].get_bool();
+
     UniValue ret(UniValue::VOBJ);
 
+    // Hold cs_main while seeding, so no block connects between the scan and
+    // writing its commitment and the chain of commitments starts unbroken.
+    LOCK(cs_main);
+    CCoinsCommitment commitment;
+    if (!fScan && pblocktree->ReadCoinsCommitment(chainActive.Tip()->GetBlockHash(), commitment)) {
+        ret.push_back(Pair("height", (int64_t)chainActive.Height()));
+        ret.push_back(Pair("bestblock", chainActive.Tip()->GetBlockHash().GetHex()));
+        ret.push_back(Pair("txouts", (int64_t)commitment.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", (int64_t)commitment.nSerializedSize));
+        ret.push_back(Pair("hash_set", commitment.multiset.GetHash().GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(commitment.nTotalAmount)));
+        return ret;
+    }
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (pcoinsTip->GetStats(stats)) {
+        CCoinsCommitment kept;
+        if (!pblocktree->ReadCoinsCommitment(stats.hashBlock, kept))
+            pblocktree->WriteCoinsCommitment(stats.hashBlock, stats.commitment);
+        else if (kept.multiset != stats.commitment.multiset || kept.nTotalAmount != stats.nTotalAmount)
+            LogPrintf("%s: kept UTXO set commitment of block %s does not match the chainstate\n", __func__, stats.hashBlock.ToString());
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("hash_set", stats.commitment.multiset.GetHash().GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+/** Snapshot paths are relative to the data directory */
+static boost::filesystem::path GetSnapshotPath(const UniValue& param)
+{
+    boost::filesystem::path path(param.get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw std::runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a snapshot file\n"
+            "other nodes can start from with loadtxoutset.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) The file to write, relative to the data directory if not absolute. It must not exist yet.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,           (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",   (string) The snapshot block hash\n"
+            "  \"txouts\": n,           (numeric) The number of outputs written\n"
+            "  \"hash_set\": \"hash\",   (string) Order independent hash of the set, as gettxoutsetinfo reports it\n"
+            "  \"path\": \"path\"        (string) The absolute path of the file\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = GetSnapshotPath(params[0]);
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    if (boost::filesystem::exists(path) || boost::filesystem::exists(pathTmp))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CUTXOSnapshotHeader header;
+    memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    int nHeight;
+    CCoinsCommitment commitment;
+    bool fCommitment;
+    {
+        // The cursor keeps seeing the set as of now, so blocks may connect
+        // while the file is written.
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        if (!pcursor)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read the chain state");
+        const CBlockIndex* pindex = mapBlockIndex.find(pcursor->GetBestBlock())->second;
+        header.hashBlock = pindex->GetBlockHash();
+        header.nChainTx = pindex->nChainTx;
+        nHeight = pindex->nHeight;
+        fCommitment = pblocktree->ReadCoinsCommitment(header.hashBlock, commitment);
+    }
+
+    CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open " + pathTmp.string() + " for writing");
+    std::string strError;
+    bool fOk = WriteUTXOSnapshot(file, pcursor.get(), header, strError);
+    file.fclose();
+    if (fOk && fCommitment && commitment.multiset.GetHash() != header.hashSet) {
+        fOk = false;
+        strError = "the coins do not match the UTXO set commitment kept for the block";
+    }
+    if (!fOk) {
+        boost::filesystem::remove(pathTmp);
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to write the snapshot: " + strError);
+    }
+    boost::filesystem::rename(pathTmp, path);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("txouts", (int64_t)header.nCoins));
+    ret.push_back(Pair("hash_set", header.hashSet.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || (params.size() != 1 && params.size() != 3))
+        throw std::runtime_error(
+            "loadtxoutset \"path\" ( \"blockhash\" \"hash_set\" )\n"
+            "\nReplaces the chain state with a snapshot written by dumptxoutset. The node goes on from\n"
+            "the snapshot block without downloading or validating any block before it, and does not\n"
+            "serve those blocks to peers. The header of the snapshot block must already be known, and\n"
+            "the active chain must not have reached it yet.\n"
+            "The snapshot must be of the block given and match the hash_set given, which the set hash\n"
+            "alone does not tie to a block. Only give them from a source you trust, for a block too deep\n"
+            "to be reorganized away. Without them the snapshot block and hash_set must be built into the\n"
+            "chain parameters, but no network has any built in yet.\n"
+            "\nArguments:\n"
+            "1. \"path\"       (string, required) The snapshot file, relative to the data directory if not absolute\n"
+            "2. \"blockhash\"  (string, optional) The hash of the block the snapshot must be of\n"
+            "3. \"hash_set\"   (string, optional) The hash_set gettxoutsetinfo reports at that block\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,           (numeric) The height of the snapshot block, now the tip\n"
+            "  \"bestblock\": \"hex\",   (string) The snapshot block hash\n"
+            "  \"txouts\": n,           (numeric) The number of outputs loaded\n"
+            "  \"hash_set\": \"hash\"    (string) Order independent hash of the set\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"blockhash\" \"hash_set\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"blockhash\", \"hash_set\"")
+        );
+
+    boost::filesystem::path path = GetSnapshotPath(params[0]);
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open " + path.string());
+
+    CUTXOSnapshotHeader header;
+    try {
+        file >> header;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Snapshot header decode failed");
+    }
+    if (!header.IsValid(Params().MessageStart()))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Not a UTXO snapshot of this network");
+
+    uint256 hashBlockExpected, hashSetExpected;
+    if (params.size() > 1) {
+        hashBlockExpected = ParseHashV(params[1], "blockhash");
+        hashSetExpected = ParseHashV(params[2], "hash_set");
+    } else {
+        MapUTXOSnapshots::const_iterator it = Params().UTXOSnapshots().find(header.hashBlock);
+        if (it == Params().UTXOSnapshots().end())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "No hash_set built in for block " + header.hashBlock.GetHex() + ", pass the expected blockhash and hash_set");
+        hashBlockExpected = it->first;
+        hashSetExpected = it->second;
+    }
+
+    std::string strError;
+    if (!LoadUTXOSnapshot(file, header, hashBlockExpected, hashSetExpected, strError))
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Loading the snapshot failed: " + strError);
+
+    UniValue ret(UniValue::VOBJ);
+    {
+        LOCK(cs_main);
+        ret.push_back(Pair("height", mapBlockIndex.find(header.hashBlock)->second->nHeight));
+    }
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("txouts", (int64_t)header.nCoins));
+    ret.push_back(Pair("hash_set", header.hashSet.GetHex()));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -612,7 +805,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -636,33 +828,33 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -978,6 +1170,35 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getblockcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getblockcacheinfo\n"
+            "\nReturns details on the cache of recently used blocks.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": xxxxx,             (numeric) Blocks in the cache\n"
+            "  \"usage\": xxxxx,              (numeric) Memory usage of the cached blocks\n"
+            "  \"maxusage\": xxxxx,           (numeric) Memory usage above which blocks are evicted (-blockcachesize)\n"
+            "  \"hits\": xxxxx,               (numeric) Block reads served from the cache since startup\n"
+            "  \"misses\": xxxxx              (numeric) Block reads that went to disk since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockcacheinfo", "")
+            + HelpExampleRpc("getblockcacheinfo", "")
+        );
+
+    CBlockCache::Stats stats = blockcache.GetStats();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("blocks", (int64_t)stats.nBlocks));
+    ret.push_back(Pair("usage", (int64_t)stats.nUsage));
+    ret.push_back(Pair("maxusage", (int64_t)stats.nMaxUsage));
+    ret.push_back(Pair("hits", (int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (int64_t)stats.nMisses));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -278,6 +278,7 @@ static const CRPCCommand vRPCCommands[] =
     { "Blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "Blockchain",         "getblockcount",          &getblockcount,          true  },
     { "Blockchain",         "getblock",               &getblock,               true  },
+    { "Blockchain",         "getblockcacheinfo",      &getblockcacheinfo,      true  },
     { "Blockchain",         "getblockhashes",         &getblockhashes,         true  },
     { "Blockchain",         "getblockhash",           &getblockhash,           true  },
     { "Blockchain",         "getblockheader",         &getblockheader,         true  },
@@ -290,6 +291,8 @@ static const CRPCCommand vRPCCommands[] =
     { "Blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
     { "Blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
     { "Blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "Blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "Blockchain",         "loadtxoutset",           &loadtxoutset,           true  },
     { "Blockchain",         "verifychain",            &verifychain,            true  },
     { "Blockchain",         "getspentinfo",           &getspentinfo,           false },
 
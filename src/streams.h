@@ -443,6 +443,59 @@ public:
     }
 };
 
+/** Deserialize from memory owned by someone else, like a mapped file,
+ *  without copying it. The memory has to outlive the stream.
+ */
+class CSpanReader
+{
+private:
+    int nType;
+    int nVersion;
+
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+
+public:
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn) {}
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    //! Bytes read so far
+    size_t GetPos() const        { return pcur - pbegin; }
+    //! Bytes left
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    const char* data() const     { return pcur; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read: end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CSpanReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore: end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
  *  deserialize from. It guarantees the ability to rewind a given number of bytes.
  *
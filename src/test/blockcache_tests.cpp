@@ -0,0 +1,102 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+#include "random.h"
+#include "test/test_random.h"
+#include "test/test_zumy.h"
+
+#include <memory>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+/** A block of nTx small transactions, its hash seeded so no PoW hash is computed */
+static CBlockRef MakeBlock(unsigned int nTx)
+{
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    pblock->nNonce = insecure_rand();
+    pblock->nBits = 0x207fffff;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        pblock->vtx.push_back(tx);
+    }
+    pblock->SetCachedHash(GetRandHash());
+    return pblock;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_hits)
+{
+    CBlockCache cache(1 << 20);
+    CBlockRef pblock = MakeBlock(10);
+    BOOST_CHECK(!cache.Get(pblock->GetHash()));
+    cache.Insert(pblock);
+    BOOST_CHECK(cache.Get(pblock->GetHash()) == pblock);
+    BOOST_CHECK(cache.Get(pblock->GetHash()) == pblock);
+    // Inserting it again changes nothing
+    cache.Insert(pblock);
+
+    CBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1U);
+    BOOST_CHECK(stats.nUsage > 0 && stats.nUsage <= stats.nMaxUsage);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(pblock->GetHash()));
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    std::vector<CBlockRef> vBlocks;
+    for (unsigned int i = 0; i < 20; i++)
+        vBlocks.push_back(MakeBlock(50));
+    CBlockCache cache(1 << 20);
+    cache.Insert(vBlocks[0]);
+    size_t nBlockUsage = cache.GetStats().nUsage;
+    cache.Clear();
+
+    // Room for five blocks
+    cache.SetMaxUsage(nBlockUsage * 5 + nBlockUsage / 2);
+    for (unsigned int i = 0; i < 5; i++)
+        cache.Insert(vBlocks[i]);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 5U);
+    // Using the oldest makes the second oldest the next to go
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()));
+    cache.Insert(vBlocks[5]);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 5U);
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()));
+    BOOST_CHECK(!cache.Get(vBlocks[1]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[2]->GetHash()));
+
+    // Evicted blocks stay valid for whoever holds them
+    CBlockRef pblock = cache.Get(vBlocks[3]->GetHash());
+    for (unsigned int i = 6; i < 20; i++)
+        cache.Insert(vBlocks[i]);
+    BOOST_CHECK(!cache.Get(vBlocks[3]->GetHash()));
+    BOOST_CHECK_EQUAL(pblock->vtx.size(), 50U);
+    BOOST_CHECK(cache.GetStats().nUsage <= cache.GetStats().nMaxUsage);
+
+    // A block bigger than half the budget is not cached
+    CBlockRef pblockBig = MakeBlock(2000);
+    cache.Insert(pblockBig);
+    BOOST_CHECK(!cache.Get(pblockBig->GetHash()));
+
+    // Turning the cache off empties it
+    BOOST_CHECK(cache.IsEnabled());
+    cache.SetMaxUsage(0);
+    BOOST_CHECK(!cache.IsEnabled());
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+    cache.Insert(vBlocks[0]);
+    BOOST_CHECK(!cache.Get(vBlocks[0]->GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
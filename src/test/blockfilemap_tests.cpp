@@ -0,0 +1,107 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "util.h"
+#include "test/test_zumy.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+static boost::filesystem::path WriteFile(const std::string& strName, const std::vector<char>& vch, const char* mode = "wb")
+{
+    boost::filesystem::path path = GetDataDir() / strName;
+    FILE* file = fopen(path.string().c_str(), mode);
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(vch.data(), 1, vch.size(), file), vch.size());
+    fclose(file);
+    return path;
+}
+
+BOOST_AUTO_TEST_CASE(span_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint32_t)7 << std::string("abc") << (uint64_t)9;
+    std::vector<char> vch(ss.begin(), ss.end());
+
+    CSpanReader reader(vch.data(), vch.data() + vch.size(), SER_DISK, CLIENT_VERSION);
+    uint32_t n;
+    std::string str;
+    uint64_t m;
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, 7U);
+    reader.ignore(4);
+    BOOST_CHECK_EQUAL(reader.GetPos(), 8U);
+    reader >> m;
+    BOOST_CHECK_EQUAL(m, 9U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+
+    CSpanReader reader2(vch.data(), vch.data() + vch.size(), SER_DISK, CLIENT_VERSION);
+    reader2 >> n >> str;
+    BOOST_CHECK_EQUAL(str, "abc");
+    BOOST_CHECK_THROW(reader2.ignore(9), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_lru)
+{
+    std::vector<char> vch(1000);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = i % 251;
+    boost::filesystem::path path0 = WriteFile("blk00000.dat", vch);
+    boost::filesystem::path path1 = WriteFile("blk00001.dat", vch);
+    boost::filesystem::path path2 = WriteFile("rev00000.dat", vch);
+
+    CBlockFileMapCache cache;
+    // Off until it has room
+    BOOST_CHECK(!cache.Get("blk", 0, path0, 0));
+    cache.SetMaxFiles(2);
+
+    CMappedBlockFileRef mapped0 = cache.Get("blk", 0, path0, 10);
+    BOOST_REQUIRE(mapped0);
+    BOOST_CHECK_EQUAL(mapped0->size(), vch.size());
+    BOOST_CHECK(std::equal(vch.begin(), vch.end(), mapped0->begin()));
+    BOOST_CHECK(cache.Get("blk", 0, path0, 999) == mapped0);
+    // Past the end of the file
+    BOOST_CHECK(!cache.Get("blk", 1, path1, 1000));
+
+    // The least recently used mapping goes first, but stays valid while held
+    BOOST_CHECK(cache.Get("blk", 1, path1, 0));
+    BOOST_CHECK(cache.Get("blk", 0, path0, 0) == mapped0);
+    BOOST_CHECK(cache.Get("rev", 0, path2, 0));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(cache.Get("blk", 0, path0, 0) == mapped0);
+
+    // Erasing a file number drops both of its files
+    cache.Erase(0);
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(mapped0->begin()[500], vch[500]);
+
+    // A file that grew is mapped again when a read needs the new part
+    CMappedBlockFileRef mapped2 = cache.Get("rev", 0, path2, 0);
+    BOOST_REQUIRE(mapped2);
+    WriteFile("rev00000.dat", vch, "ab");
+    BOOST_CHECK(cache.Get("rev", 0, path2, 999) == mapped2);
+    CMappedBlockFileRef mapped2b = cache.Get("rev", 0, path2, 1500);
+    BOOST_REQUIRE(mapped2b);
+    BOOST_CHECK(mapped2b != mapped2);
+    BOOST_CHECK_EQUAL(mapped2b->size(), 2 * vch.size());
+    BOOST_CHECK_EQUAL(mapped2->size(), vch.size());
+
+    // Missing files do not map
+    BOOST_CHECK(!cache.Get("blk", 9, GetDataDir() / "blk00009.dat", 0));
+
+    cache.SetMaxFiles(0);
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK(!cache.Get("rev", 0, path2, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,7 +2,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "clientversion.h"
+#include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "main.h" // For CheckBlock
 #include "primitives/block.h"
@@ -41,4 +43,86 @@ bool read_block(const std::string& filename, CBlock& block)
     return true;
 }
 
+/** A block of a coinbase and nTx - 1 spends of made up outputs */
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(coinbase);
+    for (unsigned int i = 1; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(i)), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    return block;
+}
+
+/** Run CheckBlock on the serial path (-par=1) and on the block check queue */
+static void CheckBlockBothWays(const CBlock& block, bool fExpected, const std::string& strReason)
+{
+    int nScriptCheckThreadsSaved = nScriptCheckThreads;
+    for (int nThreads = 0; nThreads <= 3; nThreads += 3) {
+        nScriptCheckThreads = nThreads;
+        CBlock check(block);
+        CValidationState state;
+        BOOST_CHECK_EQUAL(CheckBlock(check, state, false, true), fExpected);
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), strReason);
+    }
+    nScriptCheckThreads = nScriptCheckThreadsSaved;
+}
+
+BOOST_FIXTURE_TEST_CASE(checkblock_transactions, TestingSetup)
+{
+    // Within one run of the block check queue, on several of them, and on
+    // several with a short last run
+    unsigned int vSizes[] = {1, 2, 63, 64, 65, 128, 199, 200};
+    BOOST_FOREACH(unsigned int nTx, vSizes) {
+        CBlock block = BuildBlock(nTx);
+        CheckBlockBothWays(block, true, "");
+
+        // A wrong merkle root is caught
+        CBlock wrongRoot(block);
+        wrongRoot.hashMerkleRoot = uint256();
+        CheckBlockBothWays(wrongRoot, false, "bad-txnmrklroot");
+
+        // CVE-2012-2459: an odd number of transactions with the last one
+        // repeated has the same merkle root
+        if (nTx >= 3 && nTx % 2 == 1) {
+            CBlock mutated(block);
+            mutated.vtx.push_back(mutated.vtx.back());
+            bool fMutated = false;
+            BOOST_CHECK(BlockMerkleRoot(mutated, &fMutated) == block.hashMerkleRoot);
+            BOOST_CHECK(fMutated);
+            CheckBlockBothWays(mutated, false, "bad-txns-duplicate");
+        }
+    }
+
+    // The first failing transaction is the one reported, also when a later
+    // run of the queue fails first
+    CBlock block = BuildBlock(200);
+    CMutableTransaction negative(block.vtx[150]);
+    negative.vout[0].nValue = -1;
+    block.vtx[150] = negative;
+    CMutableTransaction empty(block.vtx[170]);
+    empty.vin.clear();
+    block.vtx[170] = empty;
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    CheckBlockBothWays(block, false, "bad-txns-vout-negative");
+    CMutableTransaction duplicate(block.vtx[20]);
+    duplicate.vin.push_back(duplicate.vin[0]);
+    block.vtx[20] = duplicate;
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    CheckBlockBothWays(block, false, "bad-txns-inputs-duplicate");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
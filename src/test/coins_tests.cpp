@@ -3,8 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "pubkey.h"
 #include "test_random.h"
+#include "script/standard.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
+#include "utilstrencodings.h"
 #include "test/test_zumy.h"
 #include "main.h"
 #include "consensus/validation.h"
@@ -16,30 +21,39 @@
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -49,8 +63,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -74,9 +88,12 @@ public:
     {
         // Manually recompute the zumy usage of the whole data, and compare it.
         size_t ret = memusage::ZumyUsage(cacheCoins);
+        size_t count = 0;
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.ZumyMemoryUsage();
+            ret += it->second.coin.ZumyMemoryUsage();
+            ++count;
         }
+        BOOST_CHECK_EQUAL(GetCacheSize(), count);
         BOOST_CHECK_EQUAL(ZumyMemoryUsage(), ret);
     }
 
@@ -91,7 +108,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -103,13 +120,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +146,53 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            COutPoint outpoint(txid, insecure_rand() % 3);
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK_EQUAL(stack.back()->HaveCoin(outpoint), !coin.IsSpent());
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(outpoint, std::move(newcoin), !coin.IsSpent() || (insecure_rand() & 1));
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
             }
         }
 
+        // One every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 3);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(outpoint);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(outpoint);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -205,10 +241,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
 }
 
 // This test is similar to the previous test
@@ -220,7 +258,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -238,7 +276,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique unless intended to duplicate
-            unsigned int height = insecure_rand();
+            unsigned int height = insecure_rand() & 0x3FFFFFFF; // Coin stores 31 bits of height
 
             // 1/10 times create a coinbase
             if (insecure_rand() % 10 == 0 || coinbaseids.size() < 10) {
@@ -273,8 +311,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,8 +331,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             CValidationState dummy;
             UpdateCoins(tx, dummy, *(stack.back()), height);
@@ -303,13 +339,11 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -347,4 +381,172 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // Non-coinbase output at height 203998 paying 600 coins to a key hash
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
+    ss1 >> cc1;
+    BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
+    BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+
+    // Round trip
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << cc1;
+    BOOST_CHECK_EQUAL(HexStr(ss2.begin(), ss2.end()), "97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+    BOOST_CHECK_EQUAL(ss2.size(), cc1.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+
+    // Coinbase bit
+    Coin cc3(cc1.out, 1, true);
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << cc3;
+    Coin cc4;
+    ss3 >> cc4;
+    BOOST_CHECK(cc4.IsCoinBase());
+    BOOST_CHECK_EQUAL(cc4.nHeight, 1);
+}
+
+BOOST_AUTO_TEST_CASE(undo_legacy_format)
+{
+    // Undo records written by the per-transaction coins code carry a
+    // transaction version after the height code for the last spend of a
+    // transaction, and no metadata at all for the other spends.
+    CTxOut out;
+    out.nValue = 5000;
+    out.scriptPubKey = GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))));
+
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    WriteCompactSize(ssLegacy, 2);
+    ssLegacy << VARINT(0u);                         // not the last spend: no metadata
+    ssLegacy << CTxOutCompressor(out);
+    unsigned int nCode = 100 * 2 + 1;
+    int nVersion = 2;
+    ssLegacy << VARINT(nCode) << VARINT(nVersion);  // last spend of a coinbase at height 100
+    ssLegacy << CTxOutCompressor(out);
+
+    CTxUndo undo;
+    ssLegacy >> undo;
+    BOOST_CHECK(ssLegacy.empty());
+    BOOST_REQUIRE_EQUAL(undo.vprevout.size(), 2U);
+    BOOST_CHECK_EQUAL(undo.vprevout[0].nHeight, 0);
+    BOOST_CHECK(undo.vprevout[0].out == out);
+    BOOST_CHECK_EQUAL(undo.vprevout[1].nHeight, 100);
+    BOOST_CHECK(undo.vprevout[1].IsCoinBase());
+    BOOST_CHECK(undo.vprevout[1].out == out);
+
+    // What we write now is readable by the old format: a zero dummy version
+    // follows the height code.
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << undo;
+    BOOST_CHECK_EQUAL(ssNew.size(), ::GetSerializeSize(undo, SER_DISK, CLIENT_VERSION));
+    CTxUndo undo2;
+    ssNew >> undo2;
+    BOOST_REQUIRE_EQUAL(undo2.vprevout.size(), 2U);
+    BOOST_CHECK_EQUAL(undo2.vprevout[1].nHeight, 100);
+    BOOST_CHECK(undo2.vprevout[1].out == out);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(coins_db_background_flush, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::vector<COutPoint> outpoints;
+    for (unsigned int i = 0; i < 200; i++)
+        outpoints.push_back(COutPoint(GetRandHash(), i));
+    uint256 hashFirst = GetRandHash();
+    uint256 hashSecond = GetRandHash();
+
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            CTxOut out;
+            out.nValue = 1000 + i;
+            out.scriptPubKey = CScript() << OP_TRUE;
+            cache.AddCoin(outpoints[i], Coin(out, 1, false), false);
+        }
+        cache.SetBestBlock(hashFirst);
+        BOOST_CHECK(cache.Flush(true));
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    }
+
+    // Whether or not the write has committed yet, the database shows it
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.GetBestBlock() == hashFirst);
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+            BOOST_CHECK_EQUAL(cache.AccessCoin(outpoints[i]).out.nValue, 1000 + i);
+        }
+        // Spend every other coin; this write has to queue behind the first
+        for (unsigned int i = 0; i < outpoints.size(); i += 2)
+            BOOST_CHECK(cache.SpendCoin(outpoints[i]));
+        cache.SetBestBlock(hashSecond);
+        BOOST_CHECK(cache.Flush(true));
+    }
+
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        BOOST_CHECK_EQUAL(db.HaveCoin(outpoints[i]), i % 2 == 1);
+    BOOST_CHECK(db.GetBestBlock() == hashSecond);
+
+    // A synchronous write waits for the background one, so afterwards the
+    // database itself is at the second block
+    CCoinsMap mapEmpty;
+    BOOST_CHECK(db.BatchWrite(mapEmpty, uint256()));
+    BOOST_CHECK(db.GetBestBlock() == hashSecond);
+    Coin coin;
+    BOOST_CHECK(!db.GetCoin(outpoints[0], coin));
+    BOOST_CHECK(db.GetCoin(outpoints[1], coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 1001);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(prefetch_block_coins, TestingSetup)
+{
+    LOCK(cs_main);
+    // Coins in the database, but not in the tip cache
+    std::vector<COutPoint> outpoints;
+    for (unsigned int i = 0; i < 10; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), i));
+        CTxOut out;
+        out.nValue = 1000 + i;
+        out.scriptPubKey = CScript() << OP_TRUE;
+        pcoinsTip->AddCoin(outpoints.back(), Coin(out, 1, false), false);
+    }
+    BOOST_CHECK(pcoinsTip->Flush());
+    BOOST_CHECK_EQUAL(pcoinsTip->GetCacheSize(), 0U);
+
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    block.vtx.push_back(coinbase);
+    CMutableTransaction spend;
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        spend.vin.push_back(CTxIn(outpoints[i]));
+    spend.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));              // unknown to the database
+    spend.vout.push_back(CTxOut(1000, CScript() << OP_TRUE));
+    block.vtx.push_back(spend);
+    CMutableTransaction child;
+    child.vin.push_back(CTxIn(COutPoint(block.vtx[1].GetHash(), 0)));     // created in the block
+    block.vtx.push_back(child);
+
+    PrefetchBlockCoins(block);
+    BOOST_CHECK_EQUAL(pcoinsTip->GetCacheSize(), outpoints.size());
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        BOOST_CHECK(pcoinsTip->HaveCoinInCache(outpoints[i]));
+        BOOST_CHECK_EQUAL(pcoinsTip->AccessCoin(outpoints[i]).out.nValue, 1000 + i);
+    }
+
+    // Spending a prefetched coin still reaches the database
+    CCoinsViewCache cache(pcoinsTip);
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!pcoinsTip->HaveCoin(outpoints[0]));
+    BOOST_CHECK(pcoinsTip->Flush());
+    BOOST_CHECK(!pcoinsdbview->HaveCoin(outpoints[0]));
+    BOOST_CHECK(pcoinsdbview->HaveCoin(outpoints[1]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
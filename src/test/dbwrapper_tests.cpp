@@ -326,4 +326,84 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 
 
 
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    DBProfile profile;
+    BOOST_CHECK(ParseDBProfile("index", profile) && profile == DBPROFILE_INDEX);
+    BOOST_CHECK(ParseDBProfile("default", profile) && profile == DBPROFILE_DEFAULT);
+    BOOST_CHECK(!ParseDBProfile("fast", profile));
+    BOOST_CHECK_EQUAL(GetDBProfileName(DBPROFILE_INDEX), "index");
+
+    // The last -dbprofile naming a database wins, others keep their role's profile
+    mapMultiArgs["-dbprofile"].push_back("chainstate:index");
+    mapMultiArgs["-dbprofile"].push_back("blockindex:index");
+    mapMultiArgs["-dbprofile"].push_back("blockindex:default");
+    BOOST_CHECK(GetDBProfile("chainstate", DBPROFILE_DEFAULT) == DBPROFILE_INDEX);
+    BOOST_CHECK(GetDBProfile("blockindex", DBPROFILE_INDEX) == DBPROFILE_DEFAULT);
+    BOOST_CHECK(GetDBProfile("blockhashes", DBPROFILE_DEFAULT) == DBPROFILE_DEFAULT);
+    mapMultiArgs.erase("-dbprofile");
+
+    // An index profile database reads back what was written, by key and in order
+    path ph = temp_directory_path() / unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, true, DBPROFILE_INDEX);
+    CDBBatch batch(&dbw.GetObfuscateKey());
+    for (int x = 0; x < 1000; ++x)
+        batch.Write(std::make_pair('a', x), std::string(100, 'a' + x % 26));
+    BOOST_CHECK(dbw.WriteBatch(batch));
+    std::string value;
+    BOOST_CHECK(dbw.Read(std::make_pair('a', 500), value));
+    BOOST_CHECK_EQUAL(value, std::string(100, 'a' + 500 % 26));
+
+    std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+    int nCount = 0;
+    for (it->Seek(std::make_pair('a', 0)); it->Valid(); it->Next()) {
+        std::pair<char, int> key;
+        BOOST_REQUIRE(it->GetKey(key) && key.first == 'a');
+        BOOST_CHECK(it->GetValue(value));
+        nCount++;
+    }
+    BOOST_CHECK_EQUAL(nCount, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_compression)
+{
+    // A new index database is compressed if the build can, and stays as it
+    // was created whatever profile it is opened with later
+    path ph = temp_directory_path() / unique_path();
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, false, DBPROFILE_INDEX);
+        BOOST_CHECK_EQUAL(dbw.IsCompressed(), HaveDBCompression());
+        BOOST_CHECK(dbw.Write('k', std::string(1000, 'k')));
+    }
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, false, DBPROFILE_DEFAULT);
+        BOOST_CHECK_EQUAL(dbw.IsCompressed(), HaveDBCompression());
+        std::string value;
+        BOOST_CHECK(dbw.Read('k', value));
+        BOOST_CHECK_EQUAL(value, std::string(1000, 'k'));
+    }
+
+    // An existing database is never compressed afterwards
+    path ph2 = temp_directory_path() / unique_path();
+    {
+        CDBWrapper dbw(ph2, (1 << 20), false, false, false, DBPROFILE_DEFAULT);
+        BOOST_CHECK(!dbw.IsCompressed());
+        BOOST_CHECK(dbw.Write('k', 1));
+    }
+    {
+        CDBWrapper dbw(ph2, (1 << 20), false, false, false, DBPROFILE_INDEX);
+        BOOST_CHECK(!dbw.IsCompressed());
+        // Pretend a build with Snappy created it
+        BOOST_CHECK(dbw.Write(std::string("\000compression", 12), true));
+    }
+
+    // A database recorded as compressed is refused by a build without Snappy
+    if (HaveDBCompression()) {
+        CDBWrapper dbw(ph2, (1 << 20), false, false, false, DBPROFILE_DEFAULT);
+        BOOST_CHECK(dbw.IsCompressed());
+    } else {
+        BOOST_CHECK_THROW(CDBWrapper(ph2, (1 << 20), false, false, false, DBPROFILE_DEFAULT), dbwrapper_error);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
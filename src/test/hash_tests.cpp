@@ -2,13 +2,16 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/argon2d/argon2.h"
 #include "hash.h"
 #include "utilstrencodings.h"
 #include "test/test_zumy.h"
+#include "test/test_random.h"
 
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(hash_tests, BasicTestingSetup)
 
@@ -45,4 +48,90 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(argon2d_thread_arena)
+{
+    // Hashes computed in a reused per-thread matrix must not depend on what
+    // was hashed before or on which thread's matrix is used.
+    std::vector<unsigned char> vHeader(INPUT_BYTES);
+    for (unsigned int i = 0; i < vHeader.size(); i++)
+        vHeader[i] = i * 7;
+
+    uint256 hash1 = hash_Argon2d(&vHeader[0], 1);
+    uint256 hash2 = hash_Argon2d(&vHeader[0], 2);
+    BOOST_CHECK(hash_Argon2d(&vHeader[0], 1) == hash1);
+    BOOST_CHECK(hash_Argon2d(&vHeader[0], 2) == hash2);
+
+    uint256 hashThread1, hashThread2;
+    boost::thread thread([&]() {
+        hashThread2 = hash_Argon2d(&vHeader[0], 2);
+        hashThread1 = hash_Argon2d(&vHeader[0], 1);
+    });
+    thread.join();
+    BOOST_CHECK(hashThread1 == hash1);
+    BOOST_CHECK(hashThread2 == hash2);
+
+    // A nested allocation on the same thread must not alias the arena
+    uint8_t *pArena, *pNested;
+    BOOST_CHECK_EQUAL(Argon2dThreadArenaAllocate(&pArena, 1024), ARGON2_OK);
+    BOOST_CHECK_EQUAL(Argon2dThreadArenaAllocate(&pNested, 1024), ARGON2_OK);
+    BOOST_CHECK(pArena != pNested);
+    Argon2dThreadArenaFree(pNested, 1024);
+    Argon2dThreadArenaFree(pArena, 1024);
+}
+
+BOOST_AUTO_TEST_CASE(argon2d_kernels)
+{
+    // Every kernel usable on this CPU must hash exactly like the reference
+    const argon2_kernel kernelSelected = argon2_get_kernel();
+    BOOST_CHECK_EQUAL(argon2_kernel_selftest(ARGON2_KERNEL_REF), ARGON2_OK);
+    BOOST_CHECK(argon2_kernel_available(kernelSelected));
+
+    std::vector<std::vector<unsigned char> > vHeaders;
+    for (unsigned int n = 0; n < 8; n++) {
+        std::vector<unsigned char> vHeader(INPUT_BYTES);
+        for (unsigned int i = 0; i < vHeader.size(); i++)
+            vHeader[i] = insecure_rand();
+        vHeaders.push_back(vHeader);
+    }
+
+    BOOST_CHECK_EQUAL(argon2_set_kernel(ARGON2_KERNEL_REF), ARGON2_OK);
+    std::vector<uint256> vExpected;
+    for (unsigned int n = 0; n < vHeaders.size(); n++)
+        vExpected.push_back(hash_Argon2d(&vHeaders[n][0], 1));
+
+    for (int kernel = ARGON2_KERNEL_REF; kernel < ARGON2_KERNEL_COUNT; kernel++) {
+        BOOST_CHECK(argon2_kernel2string((argon2_kernel)kernel) != NULL);
+        if (!argon2_kernel_available((argon2_kernel)kernel)) {
+            BOOST_CHECK_EQUAL(argon2_set_kernel((argon2_kernel)kernel), ARGON2_KERNEL_UNAVAILABLE);
+            continue;
+        }
+        BOOST_CHECK_EQUAL(argon2_set_kernel((argon2_kernel)kernel), ARGON2_OK);
+        for (unsigned int n = 0; n < vHeaders.size(); n++)
+            BOOST_CHECK(hash_Argon2d(&vHeaders[n][0], 1) == vExpected[n]);
+    }
+
+    BOOST_CHECK_EQUAL(argon2_set_kernel(kernelSelected), ARGON2_OK);
+}
+
+BOOST_AUTO_TEST_CASE(argon2d_batch)
+{
+    // Batched hashing must match hashing each header on its own, including
+    // counts that are not a multiple of the batch size
+    const unsigned int nHeaders = 2 * ARGON2_BATCH_MAX + 3;
+    std::vector<unsigned char> vHeaders(nHeaders * INPUT_BYTES);
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        vHeaders[i] = insecure_rand();
+
+    std::vector<uint256> vExpected;
+    for (unsigned int n = 0; n < nHeaders; n++)
+        vExpected.push_back(hash_Argon2d(&vHeaders[n * INPUT_BYTES], 1));
+
+    for (unsigned int nCount = 1; nCount <= nHeaders; nCount += 4) {
+        std::vector<uint256> vHashes(nCount);
+        hash_Argon2d_batch(&vHeaders[0], nCount, &vHashes[0]);
+        for (unsigned int n = 0; n < nCount; n++)
+            BOOST_CHECK(vHashes[n] == vExpected[n]);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+#include "test/test_zumy.h"
+
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+// Every case builds its own chains, so the suite has no fixture
+BOOST_AUTO_TEST_SUITE(loadblock_tests)
+
+static const int LOAD_CHAIN_LENGTH = 20;
+
+/** Mine nBlocks on regtest on top of genesis and return them */
+static std::vector<CBlock> MineChain(int nBlocks)
+{
+    TestingSetup setup(CBaseChainParams::REGTEST);
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    std::vector<CBlock> vBlocks;
+    for (int i = 0; i < nBlocks; i++) {
+        std::unique_ptr<CBlockTemplate> pblocktemplate = CreateNewBlock(chainparams, scriptPubKey);
+        CBlock& block = pblocktemplate->block;
+        unsigned int extraNonce = 0;
+        IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+        while (!CheckProofOfWork(block.GetHash(), block.nBits, chainparams.GetConsensus()))
+            ++block.nNonce;
+        CValidationState state;
+        BOOST_REQUIRE(ProcessNewBlock(state, chainparams, NULL, &block, true, NULL));
+        vBlocks.push_back(block);
+    }
+    BOOST_REQUIRE_EQUAL(chainActive.Height(), nBlocks);
+    return vBlocks;
+}
+
+/** Append a block to file as a block file holds it: network magic, size, block */
+static void WriteBlock(CAutoFile& file, const CBlock& block)
+{
+    file << FLATDATA(Params(CBaseChainParams::REGTEST).MessageStart()) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) << block;
+}
+
+/** Import path into a fresh regtest chain with -par at nThreads and return the height reached */
+static int LoadFile(const boost::filesystem::path& path, int nThreads)
+{
+    TestingSetup setup(CBaseChainParams::REGTEST);
+    nScriptCheckThreads = nThreads;
+    FILE* file = fopen(path.string().c_str(), "rb");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(LoadExternalBlockFile(Params(), file));
+    CValidationState state;
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+    int nHeight = chainActive.Height();
+    nScriptCheckThreads = 3;
+    return nHeight;
+}
+
+BOOST_AUTO_TEST_CASE(loadblock_import)
+{
+    std::vector<CBlock> vBlocks = MineChain(LOAD_CHAIN_LENGTH);
+    boost::filesystem::path pathClean = GetTempPath() / strprintf("test_zumy_loadblock_%i.dat", (int)GetRand(100000));
+    boost::filesystem::path pathDamaged = pathClean;
+    pathDamaged.replace_extension(".damaged");
+
+    {
+        CAutoFile file(fopen(pathClean.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        BOOST_FOREACH(const CBlock& block, vBlocks)
+            WriteBlock(file, block);
+    }
+
+    // A stray magic, a block cut short and a block with a damaged
+    // transaction count in the middle. Neither of the last two decodes, so
+    // the importer has to rewind to right after their magic and scan on.
+    {
+        CAutoFile file(fopen(pathDamaged.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        for (int i = 0; i < LOAD_CHAIN_LENGTH; i++) {
+            if (i == 5)
+                file << FLATDATA(Params(CBaseChainParams::REGTEST).MessageStart());
+            if (i == 8 || i == 12) {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                ss << vBlocks[i];
+                std::vector<char> vData(ss.begin(), ss.end());
+                if (i == 8)
+                    vData.resize(vData.size() / 2);
+                else
+                    memset(&vData[80], 0xff, 8); // the transaction count
+                file << FLATDATA(Params(CBaseChainParams::REGTEST).MessageStart()) << (unsigned int)vData.size();
+                file.write(&vData[0], vData.size());
+            }
+            WriteBlock(file, vBlocks[i]);
+        }
+    }
+
+    // Serially (-par=1) and on the block decode threads
+    for (int nThreads = 0; nThreads <= 3; nThreads += 3) {
+        BOOST_CHECK_EQUAL(LoadFile(pathClean, nThreads), LOAD_CHAIN_LENGTH);
+        BOOST_CHECK_EQUAL(LoadFile(pathDamaged, nThreads), LOAD_CHAIN_LENGTH);
+    }
+
+    boost::filesystem::remove(pathClean);
+    boost::filesystem::remove(pathDamaged);
+}
+
+// A file ending in the middle of a block loads what comes before it
+BOOST_AUTO_TEST_CASE(loadblock_truncated)
+{
+    std::vector<CBlock> vBlocks = MineChain(LOAD_CHAIN_LENGTH);
+    boost::filesystem::path path = GetTempPath() / strprintf("test_zumy_loadblock_%i.dat", (int)GetRand(100000));
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        for (int i = 0; i < LOAD_CHAIN_LENGTH - 1; i++)
+            WriteBlock(file, vBlocks[i]);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vBlocks.back();
+        file << FLATDATA(Params(CBaseChainParams::REGTEST).MessageStart()) << (unsigned int)ss.size();
+        file.write(&ss[0], ss.size() - 10);
+    }
+    for (int nThreads = 0; nThreads <= 3; nThreads += 3)
+        BOOST_CHECK_EQUAL(LoadFile(path, nThreads), LOAD_CHAIN_LENGTH - 1);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
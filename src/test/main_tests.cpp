@@ -5,6 +5,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "txdb.h"
 
 #include "test/test_zumy.h"
 
@@ -29,4 +30,64 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(header_hash_journal)
+{
+    CHeaderHashDB db(1 << 20, true);
+    CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    const uint256 hash = header.GetHash();
+
+    // Unknown headers are left alone
+    header.fHashCached = false;
+    BOOST_CHECK(!db.ReadHeaderHash(header));
+    BOOST_CHECK(!header.HasCachedHash());
+
+    // A journaled hash seeds the memoized hash of an identical header
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK(db.WriteHeaderHash(header));
+    header.fHashCached = false;
+    BOOST_CHECK(db.ReadHeaderHash(header));
+    BOOST_CHECK(header.HasCachedHash());
+    BOOST_CHECK(header.GetHash() == hash);
+
+    // Any change to the header misses the journal
+    header.nNonce++;
+    BOOST_CHECK(!db.ReadHeaderHash(header));
+    BOOST_CHECK(!header.HasCachedHash());
+}
+
+BOOST_AUTO_TEST_CASE(read_block_trusts_index)
+{
+    const CBlockIndex* pindex = chainActive.Genesis();
+    const uint256 hashGenesis = Params().GetConsensus().hashGenesisBlock;
+
+    // The indexed header matches the one on disk and lends it its hash
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+    BOOST_CHECK(block.HasCachedHash());
+    BOOST_CHECK(block.GetHash() == hashGenesis);
+
+    // A full re-verification hashes it again
+    fVerifyHeaderHashes = true;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+    BOOST_CHECK(block.GetHash() == hashGenesis);
+    fVerifyHeaderHashes = DEFAULT_VERIFYHEADERHASHES;
+}
+
+BOOST_AUTO_TEST_CASE(read_raw_block)
+{
+    // The raw bytes are exactly the network serialization of the block
+    std::vector<unsigned char> vchBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(vchBlock, chainActive.Genesis(), Params().MessageStart()));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << Params().GenesisBlock();
+    BOOST_CHECK(std::vector<unsigned char>(ssBlock.begin(), ssBlock.end()) == vchBlock);
+
+    // A different network's magic is refused
+    CMessageHeader::MessageStartChars messageStart;
+    memcpy(messageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+    messageStart[0] ^= 0xff;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchBlock, chainActive.Genesis(), messageStart));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
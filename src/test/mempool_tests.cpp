@@ -317,6 +317,133 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     CheckSort<3>(pool, sortedOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(20000LL).FromTx(tx2));
+
+    /* no fee, but with a child paying for both */
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(0LL).FromTx(tx3));
+
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vin.resize(1);
+    tx4.vin[0].prevout = COutPoint(tx3.GetHash(), 0);
+    tx4.vin[0].scriptSig = CScript() << OP_11;
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 4 * COIN;
+    CTxMemPool::setEntries setAncestors;
+    setAncestors.insert(pool.mapTx.find(tx3.GetHash()));
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(200000LL).FromTx(tx4), setAncestors);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    CTxMemPool::txiter it4 = pool.mapTx.find(tx4.GetHash());
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it4->GetSizeWithAncestors(), it3->GetTxSize() + it4->GetTxSize());
+    BOOST_CHECK_EQUAL(it4->GetModFeesWithAncestors(), 200000);
+
+    // The package of tx3 and tx4 pays the best feerate, tx3 alone the worst
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+
+    // A fee delta on the parent carries over to its descendants
+    pool.PrioritiseTransaction(tx3.GetHash(), tx3.GetHash().ToString(), 0, 1000000LL);
+    BOOST_CHECK_EQUAL(it4->GetModFeesWithAncestors(), 1200000);
+    sortedOrder[3] = sortedOrder[2];
+    sortedOrder[2] = sortedOrder[1];
+    sortedOrder[1] = sortedOrder[0];
+    sortedOrder[0] = tx3.GetHash().ToString();
+    CheckSort<4>(pool, sortedOrder);
+
+    // Taking the parent out, as a block does, leaves the child on its own
+    std::list<CTransaction> removed;
+    pool.remove(tx3, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it4->GetSizeWithAncestors(), it4->GetTxSize());
+    BOOST_CHECK_EQUAL(it4->GetModFeesWithAncestors(), 200000);
+}
+
+
+BOOST_AUTO_TEST_CASE(MempoolLinksTest)
+{
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(4);
+    for (int i = 0; i < 4; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10000LL;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+
+    std::vector<CTransaction> vChildren;
+    for (int i = 0; i < 4; i++) {
+        CMutableTransaction txChild;
+        txChild.vin.resize(1);
+        txChild.vin[0].scriptSig = CScript() << OP_11;
+        txChild.vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild.vout.resize(1);
+        txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild.vout[0].nValue = 9000LL;
+        vChildren.push_back(txChild);
+        pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    }
+
+    // The children are kept sorted by hash, and each has the parent
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    const CTxMemPool::vecEntries& children = pool.GetMemPoolChildren(itParent);
+    BOOST_CHECK_EQUAL(children.size(), 4U);
+    for (unsigned int i = 1; i < children.size(); i++)
+        BOOST_CHECK(children[i - 1]->GetTx().GetHash() < children[i]->GetTx().GetHash());
+    BOOST_FOREACH(const CTransaction& tx, vChildren) {
+        const CTxMemPool::vecEntries& parents = pool.GetMemPoolParents(pool.mapTx.find(tx.GetHash()));
+        BOOST_CHECK_EQUAL(parents.size(), 1U);
+        BOOST_CHECK(parents[0] == itParent);
+    }
+
+    // get() hands out the transaction the entry holds
+    std::shared_ptr<const CTransaction> ptx = pool.get(txParent.GetHash());
+    BOOST_CHECK(ptx.get() == &itParent->GetTx());
+    BOOST_CHECK(!pool.get(uint256S("01")));
+
+    std::list<CTransaction> removed;
+    pool.remove(vChildren[2], removed, false);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itParent).size(), 3U);
+
+    // Removing everything gives all the link memory back
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.ZumyMemoryUsage(), 0U);
+    // The shared transaction outlives its entry
+    BOOST_CHECK(ptx->GetHash() == txParent.GetHash());
+}
 
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
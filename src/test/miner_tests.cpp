@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "consensus/consensus.h"
@@ -11,6 +12,7 @@
 #include "masternode-payments.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "script/interpreter.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -148,6 +150,15 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     BOOST_CHECK_THROW(CreateNewBlock(chainparams, scriptPubKey), std::runtime_error);
     mempool.clear();
 
+    // The cached template is built once for the tip and handed out until the mempool changes
+    const CBlockIndex* pindexCached;
+    unsigned int nUpdatedCached;
+    std::shared_ptr<const CBlockTemplate> pcached = blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached);
+    BOOST_REQUIRE(pcached);
+    BOOST_CHECK(pindexCached == chainActive.Tip());
+    BOOST_CHECK_EQUAL(pcached->block.vtx.size(), 1);
+    BOOST_CHECK(blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached) == pcached);
+
     tx.vin[0].prevout.hash = txFirst[0]->GetHash();
     tx.vout[0].nValue = 50000000000LL;
     for (unsigned int i = 0; i < 1001; ++i)
@@ -160,6 +171,64 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlock(chainparams, scriptPubKey));
+
+    // Once the refresh interval passed the new transactions are appended under the same header and payees
+    SetMockTime(GetTime() + BLOCK_TEMPLATE_REFRESH_INTERVAL);
+    std::shared_ptr<const CBlockTemplate> pupdated = blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached);
+    BOOST_REQUIRE(pupdated);
+    BOOST_CHECK(pupdated != pcached);
+    BOOST_CHECK_EQUAL(nUpdatedCached, mempool.GetTransactionsUpdated());
+    BOOST_CHECK_EQUAL(pupdated->block.vtx.size(), pblocktemplate->block.vtx.size());
+    BOOST_CHECK(pupdated->block.hashPrevBlock == pcached->block.hashPrevBlock);
+    BOOST_CHECK_EQUAL(pupdated->block.nBits, pcached->block.nBits);
+    BOOST_CHECK_EQUAL(pupdated->block.vtx[0].vout.size(), pcached->block.vtx[0].vout.size());
+    BOOST_CHECK_EQUAL(pupdated->vTxFees[0], pblocktemplate->vTxFees[0]);
+
+    // Within the interval nothing changes, after it another transaction is
+    // appended behind the ones already there
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_1;
+    tx2.vin[0].prevout.hash = txFirst[1]->GetHash();
+    tx2.vin[0].prevout.n = 0;
+    tx2.vout.resize(1);
+    tx2.vout[0].nValue = 40000000000LL;
+    tx2.vout[0].scriptPubKey = CScript() << OP_1;
+    hash = tx2.GetHash();
+    mempool.addUnchecked(hash, TestMemPoolEntryHelper().Fee(1000000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx2));
+    BOOST_CHECK(blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached) == pupdated);
+    SetMockTime(GetTime() + BLOCK_TEMPLATE_REFRESH_INTERVAL);
+    std::shared_ptr<const CBlockTemplate> pappended = blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached);
+    BOOST_REQUIRE(pappended);
+    BOOST_REQUIRE_EQUAL(pappended->block.vtx.size(), pupdated->block.vtx.size() + 1);
+    BOOST_CHECK(std::equal(pupdated->block.vtx.begin() + 1, pupdated->block.vtx.end(), pappended->block.vtx.begin() + 1));
+    BOOST_CHECK(pappended->block.vtx.back().GetHash() == hash);
+    BOOST_CHECK_EQUAL(pappended->vTxFees[0], pupdated->vTxFees[0] - 1000000);
+    BOOST_CHECK_EQUAL(pappended->nBlockSize, pupdated->nBlockSize + ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION));
+
+    // A transaction of the template leaving the pool has the block selected again
+    std::list<CTransaction> removed;
+    mempool.remove(tx2, removed, true);
+    SetMockTime(GetTime() + BLOCK_TEMPLATE_REFRESH_INTERVAL);
+    std::shared_ptr<const CBlockTemplate> preselected = blocktemplatecache.Get(chainparams, pindexCached, nUpdatedCached);
+    BOOST_REQUIRE(preselected);
+    BOOST_CHECK_EQUAL(preselected->block.vtx.size(), pupdated->block.vtx.size());
+    BOOST_CHECK_EQUAL(preselected->vTxFees[0], pupdated->vTxFees[0]);
+
+    // A refill keeps the payees the template was built with, they are only
+    // picked again for a new tip
+    CBlockTemplate stale(*pupdated);
+    CTxOut txoutStalePayee(1 * COIN, CScript() << OP_TRUE << OP_DROP << OP_TRUE);
+    CMutableTransaction txStale(stale.block.vtx[0]);
+    txStale.vout[0].nValue -= txoutStalePayee.nValue;
+    txStale.vout.push_back(txoutStalePayee);
+    stale.block.vtx[0] = txStale;
+    stale.block.txoutMasternode = txoutStalePayee;
+    std::unique_ptr<CBlockTemplate> prefilled = BlockAssembler(chainparams).UpdateTransactions(stale, chainActive.Tip());
+    BOOST_REQUIRE(prefilled);
+    BOOST_CHECK(prefilled->block.txoutMasternode == stale.block.txoutMasternode);
+    BOOST_CHECK(prefilled->block.vtx[0].vout == stale.block.vtx[0].vout);
+    BOOST_CHECK(prefilled->block.vtx[0].vin == stale.block.vtx[0].vin);
+    SetMockTime(0);
     mempool.clear();
 
     // block size > limit
@@ -383,4 +452,98 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+/* A transaction paying no fee is mined when a child pays for it */
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_cpfp, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    TestMemPoolEntryHelper entry;
+    entry.Time(GetTime()).SpendsCoinbase(true);
+
+    // Only fees decide, no room for high-priority transactions
+    mapArgs["-blockprioritysize"] = "0";
+
+    // A parent paying nothing, spendable by anyone
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = coinbaseTxns[0].vout[0].nValue;
+    txParent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, txParent, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txParent.vin[0].scriptSig << vchSig;
+
+    // Its child paying for both
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = txParent.vout[0].nValue - CENT;
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+
+    // Another transaction paying nothing, without a child
+    CMutableTransaction txAlone(txParent);
+    txAlone.vin[0].prevout = COutPoint(coinbaseTxns[1].GetHash(), 0);
+    txAlone.vin[0].scriptSig = CScript();
+    txAlone.vout[0].nValue = coinbaseTxns[1].vout[0].nValue;
+    hash = SignatureHash(scriptPubKey, txAlone, 0, SIGHASH_ALL);
+    vchSig.clear();
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txAlone.vin[0].scriptSig << vchSig;
+
+    {
+        LOCK(mempool.cs);
+        mempool.addUnchecked(txParent.GetHash(), entry.Fee(0).FromTx(txParent));
+        mempool.addUnchecked(txChild.GetHash(), entry.Fee(CENT).SpendsCoinbase(false).FromTx(txChild));
+        mempool.addUnchecked(txAlone.GetHash(), entry.Fee(0).SpendsCoinbase(true).FromTx(txAlone));
+    }
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(chainparams, scriptPubKey));
+    const std::vector<CTransaction>& vtx = pblocktemplate->block.vtx;
+    BOOST_CHECK_EQUAL(vtx.size(), 3U);
+    BOOST_CHECK(vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(vtx[2].GetHash() == txChild.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -CENT);
+
+    mapArgs.erase("-blockprioritysize");
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(CMinerHasher_ScanNonces)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.nTime = 1543504836;
+    header.nBits = 0x207fffff;
+    header.nNonce = 1000;
+
+    // Single hashing, the default, and the largest batch
+    unsigned int vBatchSizes[] = {DEFAULT_GENBATCHSIZE, ARGON2_BATCH_MAX};
+    BOOST_FOREACH(unsigned int nBatchSize, vBatchSizes) {
+        CMinerHasher hasher(nBatchSize);
+        uint32_t nHashesDone;
+
+        // No nonce meets a zero target: the whole range is hashed once
+        header.nNonce = 1000;
+        BOOST_CHECK(!hasher.ScanNonces(header, 1004, arith_uint256(), nHashesDone));
+        BOOST_CHECK_EQUAL(nHashesDone, 4U);
+        BOOST_CHECK_EQUAL(header.nNonce, 1003U);
+        BOOST_CHECK(!hasher.ScanNonces(header, 1014, arith_uint256(), nHashesDone));
+        BOOST_CHECK_EQUAL(nHashesDone, 11U);
+        BOOST_CHECK_EQUAL(header.nNonce, 1013U);
+
+        // Any nonce meets the maximum target: stop at the first one
+        header.nNonce = 2000;
+        BOOST_CHECK(hasher.ScanNonces(header, 3000, ~arith_uint256(), nHashesDone));
+        BOOST_CHECK(nHashesDone >= 1 && nHashesDone <= nBatchSize);
+        BOOST_CHECK_EQUAL(header.nNonce, 2000U);
+        BOOST_CHECK(hasher.Hash(header) == header.GetHash());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,175 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "multiset.h"
+#include "streams.h"
+#include "txdb.h"
+#include "utilstrencodings.h"
+#include "version.h"
+#include "test/test_zumy.h"
+#include "test/test_random.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(multiset_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(multiset_order_independent)
+{
+    std::vector<uint256> elements;
+    for (int i = 0; i < 10; i++)
+        elements.push_back(GetRandHash());
+
+    CECMultiset forward, backward;
+    BOOST_CHECK(forward.IsEmpty());
+    BOOST_CHECK(forward == backward);
+    for (unsigned int i = 0; i < elements.size(); i++) {
+        forward.Add(elements[i]);
+        backward.Add(elements[elements.size() - 1 - i]);
+    }
+    BOOST_CHECK(!forward.IsEmpty());
+    BOOST_CHECK(forward == backward);
+    BOOST_CHECK(forward.GetHash() == backward.GetHash());
+
+    // A different set hashes differently
+    CECMultiset other = forward;
+    other.Remove(elements[3]);
+    BOOST_CHECK(other != forward);
+    other.Add(elements[3]);
+    BOOST_CHECK(other == forward);
+
+    // Removing everything, in any order, gives back the empty set
+    for (unsigned int i = 0; i < elements.size(); i += 2)
+        forward.Remove(elements[i]);
+    for (unsigned int i = 1; i < elements.size(); i += 2)
+        forward.Remove(elements[i]);
+    BOOST_CHECK(forward.IsEmpty());
+    BOOST_CHECK(forward.GetHash() == CECMultiset().GetHash());
+
+    // A removal may come before the addition it cancels
+    CECMultiset early;
+    early.Remove(elements[0]);
+    BOOST_CHECK(!early.IsEmpty());
+    early.Add(elements[0]);
+    BOOST_CHECK(early.IsEmpty());
+}
+
+BOOST_AUTO_TEST_CASE(multiset_batches_and_combine)
+{
+    // More elements than fit in one batch of queued changes
+    CECMultiset all, first, second;
+    for (unsigned int i = 0; i < CECMultiset::MAX_PENDING * 2 + 10; i++) {
+        uint256 element = GetRandHash();
+        all.Add(element);
+        if (i % 3)
+            first.Add(element);
+        else
+            second.Add(element);
+    }
+    BOOST_CHECK(all != first);
+    first.Combine(second);
+    BOOST_CHECK(all == first);
+
+    CECMultiset empty;
+    first.Combine(empty);
+    BOOST_CHECK(all == first);
+    empty.Combine(all);
+    BOOST_CHECK(all == empty);
+}
+
+BOOST_AUTO_TEST_CASE(multiset_serialization)
+{
+    CECMultiset set;
+    CDataStream ssEmpty(SER_DISK, CLIENT_VERSION);
+    ssEmpty << set;
+    BOOST_CHECK_EQUAL(HexStr(ssEmpty.begin(), ssEmpty.end()), std::string(66, '0'));
+
+    set.Add(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << set;
+    BOOST_CHECK_EQUAL(ss.size(), 33U);
+    BOOST_CHECK(ss[0] == 0x02);
+    CECMultiset set2;
+    ss >> set2;
+    BOOST_CHECK(set == set2);
+
+    // Not a point on the curve
+    std::vector<unsigned char> vchBad(33, 0xff);
+    CDataStream ssBad(vchBad, SER_DISK, CLIENT_VERSION);
+    CECMultiset set3;
+    BOOST_CHECK_THROW(ssBad >> set3, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(coins_commitment)
+{
+    CTxOut out;
+    out.nValue = 5000;
+    out.scriptPubKey = CScript() << OP_TRUE;
+    COutPoint outpoint1(GetRandHash(), 0);
+    COutPoint outpoint2(GetRandHash(), 1);
+
+    CCoinsCommitment commitment;
+    commitment.AddCoin(outpoint1, Coin(out, 10, false));
+    commitment.AddCoin(outpoint2, Coin(out, 11, true));
+    BOOST_CHECK_EQUAL(commitment.nTransactionOutputs, 2U);
+    BOOST_CHECK_EQUAL(commitment.nTotalAmount, 10000);
+    BOOST_CHECK_EQUAL(commitment.nSerializedSize, 2 * (32 + ::GetSerializeSize(Coin(out, 10, false), SER_DISK, CLIENT_VERSION)));
+
+    // The height and coinbase flag are part of the element
+    CCoinsCommitment other;
+    other.AddCoin(outpoint1, Coin(out, 10, false));
+    other.AddCoin(outpoint2, Coin(out, 12, true));
+    BOOST_CHECK(other.multiset != commitment.multiset);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << commitment;
+    CCoinsCommitment commitment2;
+    ss >> commitment2;
+    BOOST_CHECK(commitment2.multiset == commitment.multiset);
+    BOOST_CHECK_EQUAL(commitment2.nTotalAmount, commitment.nTotalAmount);
+
+    commitment.RemoveCoin(outpoint2, Coin(out, 11, true));
+    commitment.RemoveCoin(outpoint1, Coin(out, 10, false));
+    BOOST_CHECK(commitment.multiset.IsEmpty());
+    BOOST_CHECK_EQUAL(commitment.nTransactionOutputs, 0U);
+    BOOST_CHECK_EQUAL(commitment.nSerializedSize, 0U);
+    BOOST_CHECK_EQUAL(commitment.nTotalAmount, 0);
+}
+
+// Disconnected blocks take their commitments with them, pruning only
+// follows the active chain and would never reach them
+BOOST_FIXTURE_TEST_CASE(coins_commitment_disconnect, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+    const uint256 hash = block.GetHash();
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hash);
+    BOOST_CHECK(pblocktree->HaveCoinsCommitment(hash));
+    BOOST_CHECK(pblocktree->HaveCoinsCommitment(block.hashPrevBlock));
+
+    CValidationState state;
+    CBlockIndex* pindex = mapBlockIndex[hash];
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(InvalidateBlock(state, Params().GetConsensus(), pindex));
+    }
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.hashPrevBlock);
+    BOOST_CHECK(!pblocktree->HaveCoinsCommitment(hash));
+    BOOST_CHECK(pblocktree->HaveCoinsCommitment(block.hashPrevBlock));
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ReconsiderBlock(state, pindex));
+    }
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hash);
+    BOOST_CHECK(pblocktree->HaveCoinsCommitment(hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,11 +4,14 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "main.h"
+#include "primitives/block.h"
 #include "pow.h"
 #include "random.h"
 #include "util.h"
 #include "test/test_zumy.h"
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(pow_tests, BasicTestingSetup)
@@ -94,4 +97,101 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* The memoized header hash must follow every change to the header fields */
+BOOST_AUTO_TEST_CASE(block_hash_cache)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const CChainParams& chainparams = Params();
+
+    CBlock block = chainparams.GenesisBlock();
+    BOOST_CHECK(block.GetHash() == chainparams.GetConsensus().hashGenesisBlock);
+    BOOST_CHECK(block.HasCachedHash());
+    BOOST_CHECK(block.GetBlockHeader().HasCachedHash());
+
+    block.nNonce++;
+    BOOST_CHECK(!block.HasCachedHash());
+    uint256 hashNonce = block.GetHash();
+    BOOST_CHECK(hashNonce != chainparams.GetConsensus().hashGenesisBlock);
+    BOOST_CHECK(hashNonce == hash_Argon2d(UVOIDBEGIN(block.nVersion), 1));
+
+    block.hashMerkleRoot = uint256();
+    BOOST_CHECK(!block.HasCachedHash());
+    BOOST_CHECK(block.GetHash() == hash_Argon2d(UVOIDBEGIN(block.nVersion), 1));
+
+    block.nNonce--;
+    block.hashMerkleRoot = chainparams.GenesisBlock().hashMerkleRoot;
+    BOOST_CHECK(block.GetHash() == chainparams.GetConsensus().hashGenesisBlock);
+
+    block.SetNull();
+    BOOST_CHECK(!block.HasCachedHash());
+}
+
+static std::vector<CBlockHeader> BuildHeaders(size_t nCount)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<CBlockHeader> headers;
+    uint256 hashPrev = params.hashGenesisBlock;
+    for (size_t i = 0; i < nCount; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = hashPrev;
+        header.nTime = Params().GenesisBlock().nTime + (i + 1) * params.nPowTargetSpacing;
+        header.nBits = UintToArith256(params.powLimit).GetCompact();
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, params))
+            header.nNonce++;
+        hashPrev = header.GetHash();
+        headers.push_back(header);
+    }
+    BOOST_FOREACH(CBlockHeader& header, headers)
+        header.fHashCached = false;
+    return headers;
+}
+
+/* A headers message is only hashed as far as it connects and has valid proof of work */
+BOOST_AUTO_TEST_CASE(headers_pow_prefix)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = Params().GetConsensus();
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+
+    // Inline, then in chunks through the check queue. Without worker threads
+    // the queue runs the checks in the calling thread.
+    for (int nThreads = 0; nThreads <= 3; nThreads += 3) {
+        nScriptCheckThreads = nThreads;
+        const bool fSerial = nThreads == 0;
+
+        std::vector<CBlockHeader> headers = BuildHeaders(6);
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, params), 6U);
+        BOOST_FOREACH(const CBlockHeader& header, headers)
+            BOOST_CHECK(header.HasCachedHash());
+
+        // A predecessor hash that cannot meet the target stops the check
+        // before anything from there on is hashed
+        headers = BuildHeaders(6);
+        headers[3].hashPrevBlock = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, params), 3U);
+        BOOST_CHECK(headers[2].HasCachedHash());
+        BOOST_CHECK(!headers[3].HasCachedHash());
+        BOOST_CHECK(!headers[4].HasCachedHash());
+
+        // One that could, but is not the hash of the header before
+        headers = BuildHeaders(6);
+        headers[3].hashPrevBlock = uint256();
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, params), 3U);
+        BOOST_CHECK(!fSerial || !headers[4].HasCachedHash());
+
+        // A header failing its proof of work
+        headers = BuildHeaders(6);
+        while (CheckProofOfWork(headers[2].GetHash(), headers[2].nBits, params))
+            headers[2].nNonce++;
+        headers[2].fHashCached = false;
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(headers, params), 2U);
+        BOOST_CHECK(!fSerial || !headers[3].HasCachedHash());
+
+        BOOST_CHECK_EQUAL(CheckHeadersProofOfWork(std::vector<CBlockHeader>(), params), 0U);
+    }
+
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
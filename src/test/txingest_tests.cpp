@@ -0,0 +1,175 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "txingest.h"
+
+#include "test/test_zumy.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txingest_tests, TestingSetup)
+
+static CAddress PeerAddress(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CAddress(CService(CNetAddr(s), Params().GetDefaultPort()));
+}
+
+static CTxIngestEntry MakeEntry(CNode* pfrom, uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = n;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1000;
+    tx.nLockTime = n;
+    return CTxIngestEntry(pfrom, NetMsgType::TX, std::make_shared<const CTransaction>(tx));
+}
+
+static void ReleaseBatch(std::vector<CTxIngestEntry>& vBatch)
+{
+    BOOST_FOREACH(CTxIngestEntry& entry, vBatch)
+        entry.pfrom->Release();
+    vBatch.clear();
+}
+
+BOOST_AUTO_TEST_CASE(txingest_batch)
+{
+    CNode node(INVALID_SOCKET, PeerAddress(0xa0b0c001), "", true);
+    CTxIngestQueue queue(1000000);
+
+    std::vector<CTxIngestEntry> vEntries;
+    for (uint32_t i = 0; i < 5; i++) {
+        vEntries.push_back(MakeEntry(&node, i));
+        BOOST_CHECK(queue.Push(vEntries.back()));
+    }
+    BOOST_CHECK_EQUAL(node.GetRefCount(), 5);
+
+    // A batch stops at its size and keeps the peer's order
+    std::vector<CTxIngestEntry> vBatch;
+    queue.TakeBatch(vBatch, 3);
+    BOOST_CHECK_EQUAL(vBatch.size(), 3U);
+    for (size_t i = 0; i < vBatch.size(); i++)
+        BOOST_CHECK(vBatch[i].tx->GetHash() == vEntries[i].tx->GetHash());
+    ReleaseBatch(vBatch);
+
+    queue.TakeBatch(vBatch, 3);
+    BOOST_CHECK_EQUAL(vBatch.size(), 2U);
+    BOOST_CHECK(vBatch[0].tx->GetHash() == vEntries[3].tx->GetHash());
+    BOOST_CHECK(vBatch[1].tx->GetHash() == vEntries[4].tx->GetHash());
+    ReleaseBatch(vBatch);
+    BOOST_CHECK_EQUAL(node.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(queue.GetPeerBytes(node.GetId()), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txingest_dedup)
+{
+    CNode node1(INVALID_SOCKET, PeerAddress(0xa0b0c001), "", true);
+    CNode node2(INVALID_SOCKET, PeerAddress(0xa0b0c002), "", true);
+    CTxIngestQueue queue(1000000);
+
+    CTxIngestEntry entry1 = MakeEntry(&node1, 7);
+    const uint256 hash = entry1.tx->GetHash();
+    BOOST_CHECK(!queue.Contains(hash));
+    BOOST_CHECK(queue.Push(entry1));
+    BOOST_CHECK(queue.Contains(hash));
+
+    // The same transaction from a second peer, as a whitelisted peer may
+    // relay it, stays known as queued until both copies are taken
+    BOOST_CHECK(queue.Push(MakeEntry(&node2, 7)));
+    std::vector<CTxIngestEntry> vBatch;
+    queue.TakeBatch(vBatch, 1);
+    BOOST_CHECK_EQUAL(vBatch.size(), 1U);
+    BOOST_CHECK(queue.Contains(hash));
+    queue.TakeBatch(vBatch, 2);
+    BOOST_CHECK_EQUAL(vBatch.size(), 2U);
+    BOOST_CHECK(!queue.Contains(hash));
+    ReleaseBatch(vBatch);
+}
+
+BOOST_AUTO_TEST_CASE(txingest_fairness)
+{
+    CNode node1(INVALID_SOCKET, PeerAddress(0xa0b0c001), "", true);
+    CNode node2(INVALID_SOCKET, PeerAddress(0xa0b0c002), "", true);
+    CNode node3(INVALID_SOCKET, PeerAddress(0xa0b0c003), "", true);
+    CTxIngestQueue queue(1000000);
+
+    // The first peer floods, the others send a couple each
+    for (uint32_t i = 0; i < 20; i++)
+        BOOST_CHECK(queue.Push(MakeEntry(&node1, i)));
+    for (uint32_t i = 0; i < 2; i++) {
+        BOOST_CHECK(queue.Push(MakeEntry(&node2, 100 + i)));
+        BOOST_CHECK(queue.Push(MakeEntry(&node3, 200 + i)));
+    }
+
+    // Batches smaller than the number of peers resume after the last peer
+    // served instead of starting over with the first one
+    std::vector<CTxIngestEntry> vBatch;
+    queue.TakeBatch(vBatch, 2);
+    BOOST_CHECK_EQUAL(vBatch.size(), 2U);
+    BOOST_CHECK_EQUAL(vBatch[0].pfrom, &node1);
+    BOOST_CHECK_EQUAL(vBatch[1].pfrom, &node2);
+    ReleaseBatch(vBatch);
+
+    queue.TakeBatch(vBatch, 2);
+    BOOST_CHECK_EQUAL(vBatch.size(), 2U);
+    BOOST_CHECK_EQUAL(vBatch[0].pfrom, &node3);
+    BOOST_CHECK_EQUAL(vBatch[1].pfrom, &node1);
+    ReleaseBatch(vBatch);
+
+    queue.TakeBatch(vBatch, 3);
+    BOOST_CHECK_EQUAL(vBatch.size(), 3U);
+    BOOST_CHECK_EQUAL(vBatch[0].pfrom, &node2);
+    BOOST_CHECK_EQUAL(vBatch[1].pfrom, &node3);
+    BOOST_CHECK_EQUAL(vBatch[2].pfrom, &node1);
+    ReleaseBatch(vBatch);
+
+    // Only the flooding peer is left
+    queue.TakeBatch(vBatch, 100);
+    BOOST_CHECK_EQUAL(vBatch.size(), 17U);
+    BOOST_FOREACH(const CTxIngestEntry& entry, vBatch)
+        BOOST_CHECK_EQUAL(entry.pfrom, &node1);
+    ReleaseBatch(vBatch);
+}
+
+BOOST_AUTO_TEST_CASE(txingest_peer_bytes)
+{
+    CNode node1(INVALID_SOCKET, PeerAddress(0xa0b0c001), "", true);
+    CNode node2(INVALID_SOCKET, PeerAddress(0xa0b0c002), "", true);
+    const size_t nSize = MakeEntry(&node1, 0).nSize;
+    CTxIngestQueue queue(3 * nSize);
+
+    for (uint32_t i = 0; i < 3; i++) {
+        BOOST_CHECK(!queue.IsFull(node1.GetId()));
+        BOOST_CHECK(queue.Push(MakeEntry(&node1, i)));
+    }
+    BOOST_CHECK_EQUAL(queue.GetPeerBytes(node1.GetId()), 3 * nSize);
+    BOOST_CHECK(queue.IsFull(node1.GetId()));
+    BOOST_CHECK(!queue.Push(MakeEntry(&node1, 3)));
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 3);
+
+    // The limit is per peer
+    BOOST_CHECK(!queue.IsFull(node2.GetId()));
+    BOOST_CHECK(queue.Push(MakeEntry(&node2, 10)));
+
+    std::vector<CTxIngestEntry> vBatch;
+    queue.TakeBatch(vBatch, 2);
+    ReleaseBatch(vBatch);
+    BOOST_CHECK_EQUAL(queue.GetPeerBytes(node1.GetId()), 2 * nSize);
+    BOOST_CHECK(!queue.IsFull(node1.GetId()));
+    BOOST_CHECK(queue.Push(MakeEntry(&node1, 3)));
+
+    queue.TakeBatch(vBatch, 100);
+    ReleaseBatch(vBatch);
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(node2.GetRefCount(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -83,4 +83,71 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static CMutableTransaction
+SignedSpend(const CKey& key, const CTransaction& txFrom, CAmount nValue, const CScript& scriptPubKeyOut)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = txFrom.GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = nValue;
+    spend.vout[0].scriptPubKey = scriptPubKeyOut;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_precheck, TestChain100Setup)
+{
+    // Prechecking only verifies ahead of time, what goes into the memory
+    // pool is still up to AcceptToMemoryPool.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend = SignedSpend(coinbaseKey, coinbaseTxns[0], 11*CENT, scriptPubKey);
+
+    // The same spend with an output changed after signing
+    CMutableTransaction badSpend(spend);
+    badSpend.vout[0].nValue = 12*CENT;
+
+    fTxPrecheck = true;
+    CTransaction tx(spend), txBad(badSpend);
+    std::vector<const CTransaction*> vtx;
+    vtx.push_back(&txBad);
+    vtx.push_back(&tx);
+    BOOST_CHECK_EQUAL(PrecheckTransactions(vtx), 2U);
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    BOOST_CHECK(!ToMemPool(badSpend));
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    // Already in the memory pool, nothing to do
+    BOOST_CHECK_EQUAL(PrecheckTransactions(vtx), 0U);
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    // A nonstandard output gets the transaction turned down before its
+    // scripts are verified
+    CTransaction txNonStandard(SignedSpend(coinbaseKey, coinbaseTxns[1], 11*CENT, CScript() << OP_TRUE));
+    BOOST_CHECK_EQUAL(PrecheckTransactions(std::vector<const CTransaction*>(1, &txNonStandard)), 0U);
+
+    // So does paying no fee on a coin too young to be spent for free, while
+    // the same spend paying the relay fee is verified
+    const CTransaction& txYoung = coinbaseTxns[50];
+    const CAmount nYoungValue = txYoung.vout[0].nValue;
+    CTransaction txFree(SignedSpend(coinbaseKey, txYoung, nYoungValue, scriptPubKey));
+    CTransaction txPaying(SignedSpend(coinbaseKey, txYoung, nYoungValue - CENT / 10, scriptPubKey));
+    BOOST_CHECK_EQUAL(PrecheckTransactions(std::vector<const CTransaction*>(1, &txFree)), 0U);
+    BOOST_CHECK_EQUAL(PrecheckTransactions(std::vector<const CTransaction*>(1, &txPaying)), 1U);
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    fTxPrecheck = DEFAULT_TXPRECHECK;
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,239 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "utxosnapshot.h"
+#include "test/test_zumy.h"
+
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxosnapshot_tests, TestingSetup)
+
+static const CMessageHeader::MessageStartChars pchTestMessageStart = {0x01, 0x02, 0x03, 0x04};
+
+/** Fill db with transactions of a few outputs each, some with scripts big enough to span chunks */
+static void FillCoins(CCoinsViewDB& db, std::map<COutPoint, Coin>& mapCoins, CCoinsCommitment& commitment)
+{
+    CCoinsViewCache cache(&db);
+    for (unsigned int i = 0; i < 400; i++) {
+        uint256 txid = GetRandHash();
+        for (unsigned int n = 0; n < 1 + i % 4; n++) {
+            CTxOut out;
+            out.nValue = 1000 + i;
+            out.scriptPubKey = CScript() << std::vector<unsigned char>(i % 3 ? 25 : 9000, i) << OP_DROP << OP_TRUE;
+            COutPoint outpoint(txid, n * 7);
+            Coin coin(out, 1 + i, i % 5 == 0);
+            mapCoins[outpoint] = coin;
+            commitment.AddCoin(outpoint, coin);
+            cache.AddCoin(outpoint, std::move(coin), false);
+        }
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+}
+
+static boost::filesystem::path WriteSnapshot(CCoinsViewDB& db, CUTXOSnapshotHeader& header)
+{
+    boost::filesystem::path path = GetDataDir() / "utxo.dat";
+    CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    std::unique_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    BOOST_REQUIRE(pcursor);
+    memcpy(header.pchMessageStart, pchTestMessageStart, sizeof(header.pchMessageStart));
+    header.hashBlock = pcursor->GetBestBlock();
+    header.nChainTx = 1234;
+    std::string strError;
+    BOOST_CHECK(WriteUTXOSnapshot(file, pcursor.get(), header, strError));
+    return path;
+}
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_roundtrip)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<COutPoint, Coin> mapCoins;
+    CCoinsCommitment expected;
+    FillCoins(db, mapCoins, expected);
+
+    CUTXOSnapshotHeader headerOut;
+    boost::filesystem::path path = WriteSnapshot(db, headerOut);
+    BOOST_CHECK_EQUAL(headerOut.nCoins, mapCoins.size());
+    BOOST_CHECK(headerOut.hashSet == expected.multiset.GetHash());
+    // The big scripts do not fit in one chunk
+    BOOST_CHECK(boost::filesystem::file_size(path) > 2 * SNAPSHOT_CHUNK_SIZE);
+
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    CUTXOSnapshotHeader header;
+    file >> header;
+    BOOST_CHECK(header.IsValid(pchTestMessageStart));
+    CMessageHeader::MessageStartChars pchOther = {0x01, 0x02, 0x03, 0x05};
+    BOOST_CHECK(!header.IsValid(pchOther));
+    BOOST_CHECK(header.hashBlock == db.GetBestBlock());
+    BOOST_CHECK_EQUAL(header.nChainTx, 1234U);
+    BOOST_CHECK_EQUAL(header.nCoins, headerOut.nCoins);
+    BOOST_CHECK(header.hashSet == headerOut.hashSet);
+
+    // Load it into a view, flushing as it goes
+    CCoinsViewDB dbLoaded(1 << 20, true);
+    CCoinsViewCache cache(&dbLoaded);
+    CCoinsCommitment commitment;
+    std::string strError;
+    BOOST_CHECK(ReadUTXOSnapshot(file, header, commitment, &cache, 100000, strError));
+    BOOST_CHECK(commitment.multiset == expected.multiset);
+    BOOST_CHECK_EQUAL(commitment.nTotalAmount, expected.nTotalAmount);
+    cache.SetBestBlock(header.hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    std::unique_ptr<CCoinsViewCursor> pcursor(dbLoaded.Cursor());
+    size_t nLoaded = 0;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint outpoint;
+        Coin coin;
+        BOOST_CHECK(pcursor->GetKey(outpoint) && pcursor->GetValue(coin));
+        std::map<COutPoint, Coin>::const_iterator it = mapCoins.find(outpoint);
+        BOOST_REQUIRE(it != mapCoins.end());
+        BOOST_CHECK(coin.out == it->second.out);
+        BOOST_CHECK_EQUAL(coin.nHeight, it->second.nHeight);
+        BOOST_CHECK_EQUAL(coin.fCoinBase, it->second.fCoinBase);
+        nLoaded++;
+    }
+    BOOST_CHECK_EQUAL(nLoaded, mapCoins.size());
+    BOOST_CHECK(dbLoaded.GetBestBlock() == header.hashBlock);
+}
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_corruption)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<COutPoint, Coin> mapCoins;
+    CCoinsCommitment expected;
+    FillCoins(db, mapCoins, expected);
+    CUTXOSnapshotHeader headerOut;
+    boost::filesystem::path path = WriteSnapshot(db, headerOut);
+
+    // A flipped byte in the middle fails its chunk checksum
+    {
+        FILE* f = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(f);
+        long nPos = boost::filesystem::file_size(path) / 2;
+        fseek(f, nPos, SEEK_SET);
+        int ch = fgetc(f);
+        fseek(f, nPos, SEEK_SET);
+        fputc(ch ^ 0x20, f);
+        fclose(f);
+    }
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        CCoinsCommitment commitment;
+        std::string strError;
+        BOOST_CHECK(!ReadUTXOSnapshot(file, header, commitment, NULL, 0, strError));
+        BOOST_CHECK(strError.find("checksum") != std::string::npos);
+    }
+    boost::filesystem::remove(path);
+
+    // Intact coins with the wrong set hash, or missing some
+    path = WriteSnapshot(db, headerOut);
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        header.hashSet = GetRandHash();
+        CCoinsCommitment commitment;
+        std::string strError;
+        BOOST_CHECK(!ReadUTXOSnapshot(file, header, commitment, NULL, 0, strError));
+    }
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        header.nCoins += 1;
+        CCoinsCommitment commitment;
+        std::string strError;
+        BOOST_CHECK(!ReadUTXOSnapshot(file, header, commitment, NULL, 0, strError));
+    }
+    boost::filesystem::remove(path);
+
+    // Coins out of outpoint order, with a matching count, set hash and checksum
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        memcpy(header.pchMessageStart, pchTestMessageStart, sizeof(header.pchMessageStart));
+        CCoinsCommitment commitment;
+        CDataStream ssChunk(SER_DISK, CLIENT_VERSION);
+        uint256 txid = GetRandHash();
+        unsigned int vOutputs[] = {3, 1};
+        BOOST_FOREACH(unsigned int n, vOutputs) {
+            Coin coin(CTxOut(1000 + n, CScript() << OP_TRUE), 10, false);
+            uint64_t nCode = ((uint64_t)n << 1) | (header.nCoins > 0);
+            ssChunk << VARINT(nCode);
+            if (header.nCoins == 0)
+                ssChunk << txid;
+            ssChunk << coin;
+            commitment.AddCoin(COutPoint(txid, n), coin);
+            header.nCoins++;
+        }
+        header.hashSet = commitment.multiset.GetHash();
+        std::vector<unsigned char> vchPayload(ssChunk.begin(), ssChunk.end());
+        file << header << (uint32_t)header.nCoins << vchPayload << Hash(vchPayload.begin(), vchPayload.end());
+    }
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        CCoinsCommitment commitment;
+        std::string strError;
+        BOOST_CHECK(!ReadUTXOSnapshot(file, header, commitment, NULL, 0, strError));
+        BOOST_CHECK(strError.find("out of order") != std::string::npos);
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_relabelled)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<COutPoint, Coin> mapCoins;
+    CCoinsCommitment expected;
+    FillCoins(db, mapCoins, expected);
+    CUTXOSnapshotHeader headerOut;
+    boost::filesystem::path path = WriteSnapshot(db, headerOut);
+
+    // The coins of one block claimed as the state after another pass the set
+    // hash, so the expected block is checked as well
+    uint256 hashOther = GetRandHash();
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        header.hashBlock = hashOther;
+        std::string strError;
+        BOOST_CHECK(!LoadUTXOSnapshot(file, header, headerOut.hashBlock, headerOut.hashSet, strError));
+        BOOST_CHECK(strError.find("expected block") != std::string::npos);
+    }
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CUTXOSnapshotHeader header;
+        file >> header;
+        std::string strError;
+        BOOST_CHECK(!LoadUTXOSnapshot(file, header, hashOther, headerOut.hashSet, strError));
+        BOOST_CHECK(strError.find("expected block") != std::string::npos);
+        BOOST_CHECK(!LoadUTXOSnapshot(file, header, header.hashBlock, GetRandHash(), strError));
+        BOOST_CHECK(strError.find("hash_set") != std::string::npos);
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -10,14 +10,21 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "primitives/block.h"
+#include "reverselock.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "crypto/sha256.h"
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -26,42 +33,117 @@ static const char DB_ADDRESSUNSPENTINDEX = 'u';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_SPENTINDEX = 'p';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_HEADER_HASH = 'h';
+static const char DB_COINS_COMMITMENT = 'U';
+static const char DB_SNAPSHOT_BASE = 'S';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+namespace {
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 32 + ::GetSerializeSize(VARINT(outpoint->n), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, key, nType, nVersion);
+        ::Serialize(s, outpoint->hash, nType, nVersion);
+        ::Serialize(s, VARINT(outpoint->n), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        ::Unserialize(s, key, nType, nVersion);
+        ::Unserialize(s, outpoint->hash, nType, nVersion);
+        ::Unserialize(s, VARINT(outpoint->n), nType, nVersion);
+    }
+};
+
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, GetDBProfile("chainstate", DBPROFILE_DEFAULT)), fFlushing(false), fFlushFailed(false), fShutdown(false)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(std::make_pair(DB_COINS, txid), coins);
+CCoinsViewDB::~CCoinsViewDB() {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        fShutdown = true;
+        condFlush.notify_all();
+    }
+    // The writer drains a snapshot still in flight before it exits
+    if (threadFlush.joinable())
+        threadFlush.join();
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if (fFlushing || fFlushFailed) {
+            CCoinsMap::const_iterator it = mapFlushing.find(outpoint);
+            if (it != mapFlushing.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(std::make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if (fFlushing || fFlushFailed) {
+            CCoinsMap::const_iterator it = mapFlushing.find(outpoint);
+            if (it != mapFlushing.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if ((fFlushing || fFlushFailed) && !hashFlushing.IsNull())
+            return hashFlushing;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
+bool CCoinsViewDB::WaitForFlush() const {
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fFlushing)
+        condFlush.wait(lock);
+    return !fFlushFailed;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // Writes must reach the database in order
+    if (!WaitForFlush())
+        return false;
     CDBBatch batch(&db.GetObfuscateKey());
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(std::make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(std::make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
@@ -71,11 +153,280 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed coins (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::BatchWriteInBackground(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // Only dirty entries have to be written or served from the snapshot
+    size_t count = mapCoins.size();
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            it++;
+        else
+            mapCoins.erase(it++);
+    }
+
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fFlushing)
+        condFlush.wait(lock);
+    if (fFlushFailed)
+        return false;
+    mapFlushing.clear();
+    mapFlushing.swap(mapCoins);
+    hashFlushing = hashBlock;
+    fFlushing = true;
+    LogPrint("coindb", "Handing %u changed coins (out of %u) to the coin database writer...\n", (unsigned int)mapFlushing.size(), (unsigned int)count);
+    if (!threadFlush.joinable())
+        threadFlush = boost::thread(boost::bind(&CCoinsViewDB::ThreadFlush, this));
+    condFlush.notify_all();
+    return true;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CDBBatch batch(&db.GetObfuscateKey());
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CoinEntry entry(&it->first);
+        if (it->second.coin.IsSpent())
+            batch.Erase(entry);
+        else
+            batch.Write(entry, it->second.coin);
+    }
+    if (!hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+
+    int64_t nStart = GetTimeMicros();
+    bool fOk = db.WriteBatch(batch);
+    LogPrint("coindb", "Committed %u changed coins to coin database in background (%.2fms)\n", (unsigned int)mapCoins.size(), (GetTimeMicros() - nStart) * 0.001);
+    return fOk;
+}
+
+void CCoinsViewDB::ThreadFlush() {
+    RenameThread("zumy-coinsflush");
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (true) {
+        while (!fFlushing && !fShutdown)
+            condFlush.wait(lock);
+        if (!fFlushing)
+            return;
+
+        // Readers may look into mapFlushing concurrently, but nobody changes
+        // it until fFlushing is cleared, so the batch can be built unlocked.
+        bool fOk = false;
+        CCoinsMap mapDone;
+        {
+            reverse_lock<boost::unique_lock<boost::mutex> > unlock(lock);
+            try {
+                fOk = WriteCoins(mapFlushing, hashFlushing);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
+        }
+        if (!fOk) {
+            // Keep serving the lost batch, so validation never sees the
+            // older database state, and shut down before anything else
+            // builds on it. Every later write is refused.
+            fFlushFailed = true;
+            fFlushing = false;
+            condFlush.notify_all();
+            reverse_lock<boost::unique_lock<boost::mutex> > unlock(lock);
+            strMiscWarning = "Failed to write to coin database";
+            LogPrintf("*** %s\n", strMiscWarning);
+            uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+            StartShutdown();
+            continue;
+        }
+        mapDone.swap(mapFlushing);
+        fFlushing = false;
+        condFlush.notify_all();
+        {
+            // Free the snapshot without holding up readers
+            reverse_lock<boost::unique_lock<boost::mutex> > unlock(lock);
+            mapDone.clear();
+        }
+    }
+}
+
+CCoinsViewCursor *CCoinsViewDB::Cursor() const
+{
+    // Iterate over the committed database, not a half written one
+    if (!WaitForFlush())
+        return NULL;
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
+    i->pcursor->Seek(DB_COIN);
+    // Cache key of first record
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
+    return i;
+}
+
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
+{
+    // Return cached key
+    if (keyTmp.first == DB_COIN) {
+        key = keyTmp.second;
+        return true;
+    }
+    return false;
+}
+
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
+{
+    return pcursor->GetValue(coin);
+}
+
+unsigned int CCoinsViewDBCursor::GetValueSize() const
+{
+    return pcursor->GetValueSize();
+}
+
+bool CCoinsViewDBCursor::Valid() const
+{
+    return keyTmp.first == DB_COIN;
+}
+
+void CCoinsViewDBCursor::Next()
+{
+    pcursor->Next();
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
+        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
+}
+
+namespace {
+
+//! Legacy class to deserialize pre-pertxout database entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-transaction records of the chainstate
+ * written by earlier Zumy releases to per-output records.
+ */
+bool CCoinsViewDB::Upgrade() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    LogPrintf("Upgrading database...\n");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(&db.GetObfuscateKey());
+    size_t nBatchEntries = 0;
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (nBatchEntries % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                    nBatchEntries++;
+                }
+            }
+            batch.Erase(key);
+            nBatchEntries++;
+            if (nBatchEntries * 64 > batch_size) {
+                db.WriteBatch(batch);
+                batch = CDBBatch(&db.GetObfuscateKey());
+                nBatchEntries = 0;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, GetDBProfile("blockindex", DBPROFILE_INDEX)) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -99,34 +450,39 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // Walk the committed database, not a half written one
+    if (!WaitForFlush())
+        return false;
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     std::unique_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    // Coins of one transaction are adjacent, as the key starts with the txid
+    uint256 prevTxid;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint outpoint;
+        CoinEntry key(&outpoint);
+        Coin coin;
+        if (pcursor->GetKey(key) && key.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (stats.nTransactions == 0 || outpoint.hash != prevTxid) {
+                    stats.nTransactions++;
+                    prevTxid = outpoint.hash;
                 }
+                stats.nTransactionOutputs++;
+                ss << outpoint;
+                ss << VARINT(coin.nHeight * 2 + coin.fCoinBase);
+                ss << coin.out;
+                stats.commitment.AddCoin(outpoint, coin);
+                nTotalAmount += coin.out.nValue;
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -156,6 +512,39 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadCoinsCommitment(const uint256 &hashBlock, CCoinsCommitment &commitment) {
+    return Read(std::make_pair(DB_COINS_COMMITMENT, hashBlock), commitment);
+}
+
+bool CBlockTreeDB::HaveCoinsCommitment(const uint256 &hashBlock) {
+    return Exists(std::make_pair(DB_COINS_COMMITMENT, hashBlock));
+}
+
+bool CBlockTreeDB::WriteCoinsCommitment(const uint256 &hashBlock, const CCoinsCommitment &commitment) {
+    return Write(std::make_pair(DB_COINS_COMMITMENT, hashBlock), commitment);
+}
+
+bool CBlockTreeDB::EraseCoinsCommitment(const uint256 &hashBlock) {
+    return Erase(std::make_pair(DB_COINS_COMMITMENT, hashBlock));
+}
+
+bool CBlockTreeDB::ReadSnapshotBase(uint256 &hashBlock, uint64_t &nChainTx) {
+    std::pair<uint256, uint64_t> base;
+    if (!Read(DB_SNAPSHOT_BASE, base))
+        return false;
+    hashBlock = base.first;
+    nChainTx = base.second;
+    return true;
+}
+
+bool CBlockTreeDB::WriteSnapshotBase(const uint256 &hashBlock, uint64_t nChainTx) {
+    return Write(DB_SNAPSHOT_BASE, std::make_pair(hashBlock, nChainTx));
+}
+
+bool CBlockTreeDB::EraseSnapshotBase() {
+    return Erase(DB_SNAPSHOT_BASE);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(std::make_pair(DB_TXINDEX, txid), pos);
 }
@@ -338,6 +727,15 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
                     return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
+                // The index stores the hash next to the header, only rehash
+                // the header when a full re-verification was asked for
+                if (fVerifyHeaderHashes) {
+                    CBlockHeader header = pindexNew->GetBlockHeader();
+                    header.fHashCached = false; // drop the hash taken from the index
+                    if (header.GetHash() != pindexNew->GetBlockHash())
+                        return error("LoadBlockIndex(): block hash does not match header: %s", pindexNew->ToString());
+                }
+
                 pcursor->Next();
             } else {
                 return error("LoadBlockIndex() : failed to read value");
@@ -349,3 +747,25 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+CHeaderHashDB::CHeaderHashDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "hashes", nCacheSize, fMemory, fWipe, false, GetDBProfile("blockhashes", DBPROFILE_DEFAULT)) {
+}
+
+static uint256 HeaderDigest(const CBlockHeader& header)
+{
+    uint256 digest;
+    CSHA256().Write(UBEGIN(header.nVersion), CBlockHeader::HEADER_SIZE).Finalize(digest.begin());
+    return digest;
+}
+
+bool CHeaderHashDB::ReadHeaderHash(const CBlockHeader& header) const {
+    uint256 hash;
+    if (!Read(std::make_pair(DB_HEADER_HASH, HeaderDigest(header)), hash))
+        return false;
+    header.SetCachedHash(hash);
+    return true;
+}
+
+bool CHeaderHashDB::WriteHeaderHash(const CBlockHeader& header) {
+    return Write(std::make_pair(DB_HEADER_HASH, HeaderDigest(header)), header.GetHash());
+}
@@ -10,13 +10,18 @@
 
 #include "coins.h"
 #include "dbwrapper.h"
+#include "sync.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread/thread.hpp>
+
 class CBlockFileInfo;
+class CBlockHeader;
 class CBlockIndex;
 class uint256;
 
@@ -45,20 +50,79 @@ static const int64_t nMaxBlockDBCache = 8;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 32;
+//! Max memory allocated to the header hash journal cache (MiB)
+static const int64_t nMaxHeaderHashDBCache = 8;
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * BatchWriteInBackground hands the dirty coins to a writer thread and
+ * returns at once. Until their batch commits, reads are answered from that
+ * snapshot first, so the view never appears to go back in time. The best
+ * block marker is written in the same batch as the coins, so after a crash
+ * the database is either entirely at the old or entirely at the new block.
+ * Only one snapshot is in flight at a time; any other write waits for it.
+ * If its batch fails to commit, the snapshot keeps being served, every
+ * later write is refused and the node shuts down.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    //! Protects the in flight snapshot and the writer thread state below
+    mutable CWaitableCriticalSection csFlush;
+    mutable CConditionVariable condFlush;
+    //! Dirty coins handed to the writer thread, read-only while fFlushing
+    //! and kept for good once fFlushFailed
+    CCoinsMap mapFlushing;
+    uint256 hashFlushing;
+    bool fFlushing;
+    bool fFlushFailed;
+    bool fShutdown;
+    boost::thread threadFlush;
+
+    void ThreadFlush();
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Wait until no snapshot is in flight. Returns false if a background write failed.
+    bool WaitForFlush() const;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWriteInBackground(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    CCoinsViewCursor *Cursor() const;
+
+    //! Convert an older per-transaction database to per-output records. Returns false on failure or interruption.
+    bool Upgrade();
+};
+
+/** Iterates over the coins of a CCoinsViewDB as of its creation */
+class CCoinsViewDBCursor: public CCoinsViewCursor
+{
+public:
+    ~CCoinsViewDBCursor() {}
+
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
+    unsigned int GetValueSize() const;
+
+    bool Valid() const;
+    void Next();
+
+private:
+    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+    std::unique_ptr<CDBIterator> pcursor;
+    std::pair<char, COutPoint> keyTmp;
+
+    friend class CCoinsViewDB;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -75,6 +139,15 @@ public:
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    //! Commitments to the UTXO set after a block, kept for the last few blocks
+    bool ReadCoinsCommitment(const uint256 &hashBlock, CCoinsCommitment &commitment);
+    bool HaveCoinsCommitment(const uint256 &hashBlock);
+    bool WriteCoinsCommitment(const uint256 &hashBlock, const CCoinsCommitment &commitment);
+    bool EraseCoinsCommitment(const uint256 &hashBlock);
+    //! The block a UTXO snapshot was loaded at, with its transaction count from the snapshot
+    bool ReadSnapshotBase(uint256 &hashBlock, uint64_t &nChainTx);
+    bool WriteSnapshotBase(const uint256 &hashBlock, uint64_t nChainTx);
+    bool EraseSnapshotBase();
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
@@ -94,4 +167,25 @@ public:
     bool LoadBlockIndexGuts();
 };
 
+/**
+ * Journal of the Argon2d hashes of block headers this node has already
+ * verified (blocks/hashes/), keyed by the SHA256 of the 80 byte header. It
+ * lets block file reads and -reindex reuse the proof of work hash of blocks
+ * we wrote ourselves instead of recomputing it. Hashes are a pure function
+ * of the header, so the journal outlives -reindex and is never wiped.
+ */
+class CHeaderHashDB : public CDBWrapper
+{
+public:
+    CHeaderHashDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CHeaderHashDB(const CHeaderHashDB&);
+    void operator=(const CHeaderHashDB&);
+public:
+    //! Seed the memoized hash of header from the journal, if it is there
+    bool ReadHeaderHash(const CBlockHeader& header) const;
+    //! Record the (already computed) hash of header
+    bool WriteHeaderHash(const CBlockHeader& header);
+};
+
 #endif // ZUMY_TXDB_H
@@ -0,0 +1,74 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txingest.h"
+
+#include "serialize.h"
+#include "version.h"
+
+CTxIngestEntry::CTxIngestEntry(CNode* pfromIn, const std::string& strCommandIn, const std::shared_ptr<const CTransaction>& txIn) :
+    pfrom(pfromIn),
+    strCommand(strCommandIn),
+    tx(txIn),
+    nSize(::GetSerializeSize(*txIn, SER_NETWORK, PROTOCOL_VERSION))
+{
+}
+
+CTxIngestQueue::CTxIngestQueue(size_t nMaxPeerBytesIn) :
+    nNextPeer(0),
+    nMaxPeerBytes(nMaxPeerBytesIn)
+{
+}
+
+bool CTxIngestQueue::Push(const CTxIngestEntry& entry)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    CPeerQueue& queue = mapQueue[entry.pfrom->GetId()];
+    if (queue.nBytes >= nMaxPeerBytes)
+        return false;
+    queue.entries.push_back(entry);
+    queue.nBytes += entry.nSize;
+    entry.pfrom->AddRef();
+    setQueued.insert(entry.tx->GetHash());
+    cond.notify_one();
+    return true;
+}
+
+bool CTxIngestQueue::Contains(const uint256& hash) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return setQueued.count(hash) > 0;
+}
+
+bool CTxIngestQueue::IsFull(NodeId id) const
+{
+    return GetPeerBytes(id) >= nMaxPeerBytes;
+}
+
+size_t CTxIngestQueue::GetPeerBytes(NodeId id) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::map<NodeId, CPeerQueue>::const_iterator it = mapQueue.find(id);
+    return it == mapQueue.end() ? 0 : it->second.nBytes;
+}
+
+void CTxIngestQueue::TakeBatch(std::vector<CTxIngestEntry>& vBatch, size_t nMax)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (mapQueue.empty())
+        cond.wait(lock);
+    while (vBatch.size() < nMax && !mapQueue.empty()) {
+        std::map<NodeId, CPeerQueue>::iterator it = mapQueue.lower_bound(nNextPeer);
+        if (it == mapQueue.end())
+            it = mapQueue.begin();
+        CPeerQueue& queue = it->second;
+        vBatch.push_back(queue.entries.front());
+        queue.entries.pop_front();
+        queue.nBytes -= vBatch.back().nSize;
+        setQueued.erase(setQueued.find(vBatch.back().tx->GetHash()));
+        nNextPeer = it->first + 1;
+        if (queue.entries.empty())
+            mapQueue.erase(it);
+    }
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZUMY_TXINGEST_H
+#define ZUMY_TXINGEST_H
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** A relayed transaction waiting to be validated, with the peer and message it came in */
+struct CTxIngestEntry
+{
+    CNode* pfrom;
+    std::string strCommand;
+    /** The transaction, a CTxLockRequest for a TXLOCKREQUEST message */
+    std::shared_ptr<const CTransaction> tx;
+    /** Serialized size of tx, what the entry counts against its peer's queue */
+    size_t nSize;
+
+    CTxIngestEntry() : pfrom(NULL), nSize(0) {}
+    CTxIngestEntry(CNode* pfromIn, const std::string& strCommandIn, const std::shared_ptr<const CTransaction>& txIn);
+};
+
+/**
+ * Relayed transactions waiting for ThreadTxIngest, kept per peer so that a
+ * batch takes one from every peer in turn and no peer can crowd the others
+ * out. Every peer's queue is limited by the bytes of its transactions. The
+ * queued entries hold a reference on their peer, which is handed over with
+ * the batch.
+ */
+class CTxIngestQueue
+{
+private:
+    struct CPeerQueue
+    {
+        std::deque<CTxIngestEntry> entries;
+        size_t nBytes;
+
+        CPeerQueue() : nBytes(0) {}
+    };
+
+    mutable boost::mutex cs;
+    boost::condition_variable cond;
+    std::map<NodeId, CPeerQueue> mapQueue;
+    std::multiset<uint256> setQueued;
+    /** The next batch starts with the first peer from this id on */
+    NodeId nNextPeer;
+    size_t nMaxPeerBytes;
+
+public:
+    explicit CTxIngestQueue(size_t nMaxPeerBytesIn);
+
+    /** Queue entry. Returns false if its peer is already over its byte limit. */
+    bool Push(const CTxIngestEntry& entry);
+
+    /** Whether a transaction with this hash is queued */
+    bool Contains(const uint256& hash) const;
+
+    /** Whether the peer has reached its byte limit, and nothing more of it should be read */
+    bool IsFull(NodeId id) const;
+
+    /** Bytes queued for the peer */
+    size_t GetPeerBytes(NodeId id) const;
+
+    /**
+     * Wait until something is queued, then move up to nMax entries into vBatch,
+     * one from each peer in turn, resuming after the last peer served.
+     */
+    void TakeBatch(std::vector<CTxIngestEntry>& vBatch, size_t nMax);
+};
+
+#endif // ZUMY_TXINGEST_H
@@ -141,6 +141,9 @@ public:
      * @note This hash is not stable between little and big endian.
      */
     uint64_t GetHash(const uint256& salt) const;
+
+    /** Salted hash of this value together with a 32 bit word, e.g. an output index. */
+    uint64_t GetHash(const uint256& salt, uint32_t extra) const;
 };
 
 /* uint256 from const char *.
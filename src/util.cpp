@@ -44,6 +44,10 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #else
 
 #ifdef _MSC_VER
@@ -971,6 +975,21 @@ void SetThreadPriority(int nPriority)
 #endif // WIN32
 }
 
+bool SetThreadAffinity(int nCore)
+{
+#if defined(WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << nCore) != 0;
+#elif defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(nCore, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)nCore;
+    return false;
+#endif
+}
+
 int GetNumCores()
 {
     return std::thread::hardware_concurrency();
@@ -240,6 +240,8 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
 int GetNumCores();
 
 void SetThreadPriority(int nPriority);
+/** Pin the calling thread to one core, returns false if unsupported */
+bool SetThreadAffinity(int nCore);
 void RenameThread(const char* name);
 std::string GetThreadName();
 
@@ -0,0 +1,154 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "streams.h"
+#include "tinyformat.h"
+
+#include <limits>
+#include <stdio.h>
+
+#include <boost/thread.hpp>
+
+bool CUTXOSnapshotHeader::IsValid(const CMessageHeader::MessageStartChars& pchMessageStartIn) const
+{
+    return memcmp(pchMagic, "utxo", sizeof(pchMagic)) == 0 &&
+           memcmp(pchMessageStart, pchMessageStartIn, sizeof(pchMessageStart)) == 0 &&
+           nVersion == CURRENT_VERSION;
+}
+
+namespace {
+
+/** A chunk is its coin count, its payload and the double SHA256 of the payload */
+void WriteChunk(CAutoFile& file, uint32_t nCount, const CDataStream& ssPayload)
+{
+    std::vector<unsigned char> vchPayload(ssPayload.begin(), ssPayload.end());
+    file << nCount << vchPayload << Hash(vchPayload.begin(), vchPayload.end());
+}
+
+}
+
+bool WriteUTXOSnapshot(CAutoFile& file, CCoinsViewCursor* pcursor, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    try {
+        long nHeaderPos = ftell(file.Get());
+        // Written again below, once the count and set hash are known
+        header.nCoins = 0;
+        file << header;
+
+        CCoinsCommitment commitment;
+        CDataStream ssChunk(file.GetType(), file.GetVersion());
+        uint32_t nChunkCoins = 0;
+        uint256 hashPrev;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            COutPoint outpoint;
+            Coin coin;
+            if (!pcursor->GetKey(outpoint) || !pcursor->GetValue(coin)) {
+                strError = "unable to read a coin from the chain state";
+                return false;
+            }
+            // The low bit says the txid is that of the previous coin
+            bool fSameTx = nChunkCoins > 0 && outpoint.hash == hashPrev;
+            uint64_t nCode = ((uint64_t)outpoint.n << 1) | fSameTx;
+            ssChunk << VARINT(nCode);
+            if (!fSameTx)
+                ssChunk << outpoint.hash;
+            ssChunk << coin;
+            hashPrev = outpoint.hash;
+            commitment.AddCoin(outpoint, coin);
+            header.nCoins++;
+            nChunkCoins++;
+            if (ssChunk.size() >= SNAPSHOT_CHUNK_SIZE) {
+                WriteChunk(file, nChunkCoins, ssChunk);
+                ssChunk.clear();
+                nChunkCoins = 0;
+            }
+        }
+        if (nChunkCoins > 0)
+            WriteChunk(file, nChunkCoins, ssChunk);
+
+        header.hashSet = commitment.multiset.GetHash();
+        if (nHeaderPos < 0 || fseek(file.Get(), nHeaderPos, SEEK_SET) != 0) {
+            strError = "unable to seek back to the snapshot header";
+            return false;
+        }
+        file << header;
+        if (fflush(file.Get()) != 0) {
+            strError = "unable to write the snapshot file";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("error writing the snapshot: %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool ReadUTXOSnapshot(CAutoFile& file, const CUTXOSnapshotHeader& header, CCoinsCommitment& commitment, CCoinsViewCache* pview, size_t nMaxCacheUsage, std::string& strError)
+{
+    try {
+        uint64_t nRead = 0;
+        uint256 hashPrev;
+        COutPoint outpointPrev;
+        while (nRead < header.nCoins) {
+            boost::this_thread::interruption_point();
+            uint32_t nChunkCoins;
+            std::vector<unsigned char> vchPayload;
+            uint256 hashChunk;
+            file >> nChunkCoins >> vchPayload >> hashChunk;
+            if (Hash(vchPayload.begin(), vchPayload.end()) != hashChunk) {
+                strError = strprintf("checksum mismatch in the chunk after coin %u", nRead);
+                return false;
+            }
+            if (nChunkCoins == 0 || nChunkCoins > header.nCoins - nRead) {
+                strError = strprintf("bad coin count in the chunk after coin %u", nRead);
+                return false;
+            }
+
+            CDataStream ssChunk(vchPayload, file.GetType(), file.GetVersion());
+            for (uint32_t i = 0; i < nChunkCoins; i++) {
+                uint64_t nCode;
+                ssChunk >> VARINT(nCode);
+                if (!(nCode & 1))
+                    ssChunk >> hashPrev;
+                else if (i == 0)
+                    throw std::ios_base::failure("chunk does not start with a txid");
+                if ((nCode >> 1) > std::numeric_limits<uint32_t>::max())
+                    throw std::ios_base::failure("output index out of range");
+                COutPoint outpoint(hashPrev, nCode >> 1);
+                if (nRead > 0 && !(outpointPrev < outpoint))
+                    throw std::ios_base::failure("coins out of order");
+                outpointPrev = outpoint;
+                Coin coin;
+                ssChunk >> coin;
+                if (coin.IsSpent())
+                    throw std::ios_base::failure("spent coin");
+                commitment.AddCoin(outpoint, coin);
+                nRead++;
+                if (pview) {
+                    pview->AddCoin(outpoint, std::move(coin), false);
+                    if (pview->ZumyMemoryUsage() > nMaxCacheUsage && !pview->Flush()) {
+                        strError = "unable to write coins to the chain state";
+                        return false;
+                    }
+                }
+            }
+            if (!ssChunk.empty())
+                throw std::ios_base::failure("trailing data in chunk");
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("error reading the snapshot: %s", e.what());
+        return false;
+    }
+
+    if (commitment.multiset.GetHash() != header.hashSet) {
+        strError = "the coins do not match the set hash in the snapshot header";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2017-2018 Zumy Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZUMY_UTXOSNAPSHOT_H
+#define ZUMY_UTXOSNAPSHOT_H
+
+#include "protocol.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <string>
+
+#include <string.h>
+
+class CAutoFile;
+class CCoinsCommitment;
+class CCoinsViewCache;
+class CCoinsViewCursor;
+
+//! Payload size after which a snapshot chunk is closed
+static const unsigned int SNAPSHOT_CHUNK_SIZE = 1 << 20;
+
+/**
+ * A UTXO snapshot file holds the chain state after one block: this header,
+ * then the coins in outpoint order, in chunks. A coin of the same
+ * transaction as the one before it in its chunk does not repeat the txid.
+ * Every chunk carries a checksum of its payload, so a damaged file is caught
+ * where it is damaged, and the multiset hash of all coins is checked against
+ * the header at the end.
+ */
+class CUTXOSnapshotHeader
+{
+public:
+    static const uint32_t CURRENT_VERSION = 1;
+
+    char pchMagic[4];
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint32_t nVersion;
+    //! The block whose chain state the snapshot holds
+    uint256 hashBlock;
+    //! Transactions in the chain up to and including hashBlock
+    uint64_t nChainTx;
+    uint64_t nCoins;
+    //! Multiset hash of the coins, the hash_set of gettxoutsetinfo
+    uint256 hashSet;
+
+    CUTXOSnapshotHeader() : nVersion(CURRENT_VERSION), nChainTx(0), nCoins(0)
+    {
+        memcpy(pchMagic, "utxo", sizeof(pchMagic));
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        READWRITE(FLATDATA(pchMagic));
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nChainTx);
+        READWRITE(nCoins);
+        READWRITE(hashSet);
+    }
+
+    //! Whether this is a snapshot of the network with pchMessageStartIn, in a format we read
+    bool IsValid(const CMessageHeader::MessageStartChars& pchMessageStartIn) const;
+};
+
+/**
+ * Write the coins pcursor visits to file. The coin count and set hash of
+ * header are filled in, and the header is written in front of the coins.
+ */
+bool WriteUTXOSnapshot(CAutoFile& file, CCoinsViewCursor* pcursor, CUTXOSnapshotHeader& header, std::string& strError);
+
+/**
+ * Read the coins of a snapshot file positioned right after header, and sum
+ * them into commitment. Fails on a bad checksum, out of order coins, or a
+ * coin count or set hash that does not match the header. If pview is given
+ * every coin is also added to it, flushing it whenever its memory usage
+ * passes nMaxCacheUsage.
+ */
+bool ReadUTXOSnapshot(CAutoFile& file, const CUTXOSnapshotHeader& header, CCoinsCommitment& commitment, CCoinsViewCache* pview, size_t nMaxCacheUsage, std::string& strError);
+
+#endif // ZUMY_UTXOSNAPSHOT_H
@@ -181,14 +181,14 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     {
         LOCK(cs_main);
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex, consensusParams))
+        CBlockRef pblock = ReadBlockFromDiskCached(pindex, consensusParams);
+        if (!pblock)
         {
             zmqError("Can't read block from disk");
             return false;
         }
 
-        ss << block;
+        ss << *pblock;
     }
 
     return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());